@@ -0,0 +1,173 @@
+// Throughput and latency of the main workloads. Every benchmark reports
+// items_per_second plus the p50 and p99 latency of a single operation in
+// nanoseconds. Run with --benchmark_format=json, or --benchmark_out=<file>
+// which writes JSON, to keep results to compare between releases.
+
+#include <benchmark/benchmark.h>
+#include "../db.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <numeric>
+#include <random>
+
+const char *BENCH_DB = "bench.db";
+
+// Times operations one at a time so percentiles can go next to the throughput.
+struct LatencyRecorder {
+  std::vector<double> samples;
+
+  template<typename Operation>
+  void time(Operation &&operation) {
+    auto start = std::chrono::steady_clock::now();
+    operation();
+    samples.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+  }
+
+  void report(benchmark::State &state, int64_t items_per_sample = 1) {
+    state.SetItemsProcessed(static_cast<int64_t>(samples.size()) * items_per_sample);
+    if (samples.empty()) {
+      return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) {
+      return samples[std::min(samples.size() - 1, static_cast<std::size_t>(p * samples.size()))];
+    };
+    state.counters["p50_ns"] = percentile(0.50);
+    state.counters["p99_ns"] = percentile(0.99);
+  }
+};
+
+Row make_row(uint32_t id) {
+  return Row{id, "user", "user@example.com"};
+}
+
+// A fresh database holding the ids 0 to count - 1.
+void fill_table(Table &table, uint32_t count) {
+  std::vector<Row> rows;
+  rows.reserve(count);
+  for (uint32_t id = 0; id < count; id++) {
+    rows.push_back(make_row(id));
+  }
+  table.bulk_load(rows.begin(), rows.end());
+}
+
+void BM_InsertSequential(benchmark::State &state) {
+  std::remove(BENCH_DB);
+  Table table{BENCH_DB};
+  Statement insert{Statement::INSERT};
+  LatencyRecorder latency;
+  uint32_t id = 0;
+  for (auto _ : state) {
+    insert.row_to_insert = make_row(id++);
+    latency.time([&] { execute_insert(insert, table); });
+  }
+  latency.report(state);
+  db_close(table);
+  std::remove(BENCH_DB);
+}
+BENCHMARK(BM_InsertSequential);
+
+void BM_InsertRandom(benchmark::State &state) {
+  std::remove(BENCH_DB);
+  Table table{BENCH_DB};
+  Statement insert{Statement::INSERT};
+  LatencyRecorder latency;
+  // A shuffled run of distinct ids, so no insert is rejected as a duplicate.
+  std::vector<uint32_t> ids(1 << 22);
+  std::iota(ids.begin(), ids.end(), 0);
+  std::shuffle(ids.begin(), ids.end(), std::mt19937{42});
+  std::size_t next = 0;
+  for (auto _ : state) {
+    if (next == ids.size()) {
+      // Used up, move the whole run past the ids already inserted.
+      state.PauseTiming();
+      for (auto &id : ids) {
+        id += ids.size();
+      }
+      next = 0;
+      state.ResumeTiming();
+    }
+    insert.row_to_insert = make_row(ids[next++]);
+    ExecuteResult result;
+    latency.time([&] { result = execute_insert(insert, table); });
+    if (result != ExecuteResult::SUCCESS) {
+      state.SkipWithError("insert failed");
+      break;
+    }
+  }
+  latency.report(state);
+  db_close(table);
+  std::remove(BENCH_DB);
+}
+BENCHMARK(BM_InsertRandom);
+
+void BM_PointLookup(benchmark::State &state) {
+  std::remove(BENCH_DB);
+  auto count = static_cast<uint32_t>(state.range(0));
+  Table table{BENCH_DB};
+  fill_table(table, count);
+  std::mt19937 random{42};
+  LatencyRecorder latency;
+  for (auto _ : state) {
+    auto id = random() % count;
+    latency.time([&] {
+      PinScope scope{table.pager};
+      auto cursor = table_find(table, id);
+      benchmark::DoNotOptimize(cursor.value());
+    });
+  }
+  latency.report(state);
+  db_close(table);
+  std::remove(BENCH_DB);
+}
+BENCHMARK(BM_PointLookup)->Arg(10000)->Arg(1000000);
+
+void BM_FullScan(benchmark::State &state) {
+  std::remove(BENCH_DB);
+  auto count = static_cast<uint32_t>(state.range(0));
+  Table table{BENCH_DB};
+  fill_table(table, count);
+  Statement select{Statement::SELECT};
+  std::vector<Row> rows;
+  rows.reserve(count);
+  LatencyRecorder latency;
+  for (auto _ : state) {
+    rows.clear();
+    latency.time([&] { execute_select(select, table, rows); });
+  }
+  // A scan is one operation, its throughput is counted in rows.
+  latency.report(state, count);
+  db_close(table);
+  std::remove(BENCH_DB);
+}
+BENCHMARK(BM_FullScan)->Arg(10000)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+void BM_BulkLoad(benchmark::State &state) {
+  auto count = static_cast<uint32_t>(state.range(0));
+  std::vector<Row> rows;
+  rows.reserve(count);
+  for (uint32_t id = 0; id < count; id++) {
+    rows.push_back(make_row(id));
+  }
+  LatencyRecorder latency;
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::remove(BENCH_DB);
+    {
+      Table table{BENCH_DB};
+      state.ResumeTiming();
+      latency.time([&] {
+        table.bulk_load(rows.begin(), rows.end());
+        db_close(table);
+      });
+      state.PauseTiming();
+    }
+    state.ResumeTiming();
+  }
+  latency.report(state, count);
+  std::remove(BENCH_DB);
+}
+BENCHMARK(BM_BulkLoad)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
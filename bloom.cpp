@@ -0,0 +1,33 @@
+#include "bloom.hpp"
+
+// Both probe positions come from one 64-bit mix of the key, the rest are
+// combinations of the two (Kirsch and Mitzenmacher).
+uint64_t key_filter_hash(uint32_t key) {
+  uint64_t hash = key * 0x9E3779B97F4A7C15ULL;
+  hash ^= hash >> 32;
+  hash *= 0xD6E8FEB86659FD93ULL;
+  return hash ^ (hash >> 32);
+}
+
+void KeyFilter::add(uint32_t key) {
+  auto hash = key_filter_hash(key);
+  auto position = static_cast<uint32_t>(hash);
+  auto step = static_cast<uint32_t>(hash >> 32) | 1;
+  for (uint32_t i = 0; i < KEY_FILTER_HASHES; i++, position += step) {
+    auto bit = position % KEY_FILTER_BITS;
+    bits[bit / 64] |= uint64_t{1} << (bit % 64);
+  }
+}
+
+bool KeyFilter::may_contain(uint32_t key) const {
+  auto hash = key_filter_hash(key);
+  auto position = static_cast<uint32_t>(hash);
+  auto step = static_cast<uint32_t>(hash >> 32) | 1;
+  for (uint32_t i = 0; i < KEY_FILTER_HASHES; i++, position += step) {
+    auto bit = position % KEY_FILTER_BITS;
+    if (!(bits[bit / 64] & (uint64_t{1} << (bit % 64)))) {
+      return false;
+    }
+  }
+  return true;
+}
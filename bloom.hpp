@@ -0,0 +1,22 @@
+#ifndef CPPQLITE_BLOOM_HPP
+#define CPPQLITE_BLOOM_HPP
+
+#include <array>
+#include <cstdint>
+
+// 512 bytes and four probes: about 1% false positives for a leaf packed with
+// the smallest rows, far fewer for typical ones.
+const uint32_t KEY_FILTER_BITS = 4096;
+const uint32_t KEY_FILTER_HASHES = 4;
+
+// A Bloom filter over the keys of one leaf. It never says a key it was given
+// is missing, and rarely says one it wasn't given may be there.
+struct KeyFilter {
+  std::array<uint64_t, KEY_FILTER_BITS / 64> bits{};
+
+  void add(uint32_t key);
+
+  bool may_contain(uint32_t key) const;
+};
+
+#endif //CPPQLITE_BLOOM_HPP
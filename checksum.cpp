@@ -0,0 +1,67 @@
+#include "checksum.hpp"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#define CPPQLITE_CRC32C_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+const uint32_t CRC32C_POLYNOMIAL = 0x82f63b78; // reflected
+
+const std::array<uint32_t, 256> crc32c_lookup = [] {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+    }
+    table[i] = crc;
+  }
+  return table;
+}();
+
+uint32_t crc32c_table(const char *data, std::size_t size, uint32_t crc) {
+  crc = ~crc;
+  for (std::size_t i = 0; i < size; i++) {
+    crc = crc32c_lookup[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#ifdef CPPQLITE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(const char *data, std::size_t size, uint32_t crc) {
+  uint64_t state = ~crc;
+  std::size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    state = _mm_crc32_u64(state, word);
+  }
+  auto state32 = static_cast<uint32_t>(state);
+  for (; i < size; i++) {
+    state32 = _mm_crc32_u8(state32, static_cast<uint8_t>(data[i]));
+  }
+  return ~state32;
+}
+#endif
+
+bool crc32c_hardware_supported() {
+#ifdef CPPQLITE_CRC32C_SSE42
+  static const bool supported = __builtin_cpu_supports("sse4.2");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+uint32_t crc32c(const char *data, std::size_t size, uint32_t crc) {
+#ifdef CPPQLITE_CRC32C_SSE42
+  if (crc32c_hardware_supported()) {
+    return crc32c_sse42(data, size, crc);
+  }
+#endif
+  return crc32c_table(data, size, crc);
+}
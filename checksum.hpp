@@ -0,0 +1,16 @@
+#ifndef CPPQLITE_CHECKSUM_HPP
+#define CPPQLITE_CHECKSUM_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli), the polynomial SSE4.2's crc32 instruction computes.
+// The instruction is used when the CPU has it, a lookup table otherwise.
+// crc carries on from a previous call, 0 starts a new checksum.
+uint32_t crc32c(const char *data, std::size_t size, uint32_t crc = 0);
+
+uint32_t crc32c_table(const char *data, std::size_t size, uint32_t crc = 0);
+
+bool crc32c_hardware_supported();
+
+#endif //CPPQLITE_CHECKSUM_HPP
@@ -3,15 +3,64 @@
 //
 
 #include "db.hpp"
+#include "checksum.hpp"
+#include "index.hpp"
+#include "rowcache.hpp"
+#include "search.hpp"
 
-#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstring>
 #include <algorithm>
+#include <numeric>
+#include <thread>
 
-Pager::Pager(const std::string &filename)
-    : file(filename, std::ios::in | std::ios::out | std::ios::app | std::ios::binary),
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Frames pinned by the PinScopes open on this thread, innermost last.
+thread_local std::vector<Frame *> pinned_frames;
+thread_local std::size_t open_pin_scopes = 0;
+// Set while this thread is the writer and open snapshots need page versions.
+thread_local Pager *saving_pager = nullptr;
+
+void count_page_read(PagerStats &stats) {
+  metric_add(stats.pages_read);
+  metric_add(stats.bytes_read, PAGE_SIZE);
+}
+
+void count_page_write(PagerStats &stats) {
+  metric_add(stats.pages_written);
+  metric_add(stats.bytes_written, PAGE_SIZE);
+}
+
+Pager::Pager(const std::string &filename,
+             std::size_t pool_frames,
+             PagerBackend backend,
+             const WalOptions &wal_options)
+    : backend(backend),
+      filename(filename),
+      file(filename, std::ios::in | std::ios::out | std::ios::app | std::ios::binary),
       file_length(),
       num_pages(),
-      pages() {
+      fd(-1),
+      map(),
+      map_size(),
+      file_capacity(),
+      page_latches(),
+      frames(backend == PagerBackend::MMAP ? 0 : pool_frames),
+      page_table(),
+      clock_hand(),
+      dirty_frames(),
+      dirty_pages(),
+      wal(),
+      ring(),
+      readahead_leaves(DEFAULT_READAHEAD_LEAVES),
+      max_local(LEAF_NODE_MAX_LOCAL),
+      stats(),
+      versions() {
   file.close();
   file.open(filename, std::ios::in | std::ios::out | std::ios::binary);
   if (!file) {
@@ -21,448 +70,3701 @@ Pager::Pager(const std::string &filename)
   file.seekg(0, std::fstream::end);
   file_length = file.tellg();
   file.seekg(0, std::fstream::beg);
-}
+  num_pages = (file_length + PAGE_SIZE - 1) / PAGE_SIZE;
 
-Page &Pager::get_page(std::size_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    std::cerr << "Tried to fetch page number out of bounds. " << page_num << " > " << TABLE_MAX_PAGES << '\n';
+  if (backend == PagerBackend::MMAP) {
+    if (wal_options.enabled) {
+      std::cerr << "The write-ahead log needs the buffer pool backend.\n";
+      exit(EXIT_FAILURE);
+    }
+    file.close();
+    open_mapping(filename);
+    verified_pages = std::vector<std::atomic<bool>>(num_pages);
+    return;
+  }
+  if (frames.empty()) {
+    std::cerr << "Buffer pool needs at least one frame.\n";
     exit(EXIT_FAILURE);
   }
+  page_table.reserve(frames.size());
 
-  if (!pages[page_num].cached) {
-    if (page_num >= num_pages) {
-      num_pages++;
+  if (backend == PagerBackend::IO_URING) {
+    // All file I/O goes through the descriptor, the stream isn't used.
+    file.close();
+    fd = ::open(filename.c_str(), O_RDWR);
+    if (fd < 0) {
+      std::cerr << "Unable to open file.\n";
+      exit(EXIT_FAILURE);
     }
-    if (page_num <= num_pages) {
-      file.seekg(page_num * PAGE_SIZE, std::fstream::beg);
-      file.read(pages[page_num].data.data(), PAGE_SIZE);
-      if (file.eof()) {
-        file.clear();
-      }
+    ring.emplace();
+  }
+
+  if (wal_options.enabled) {
+    wal.emplace(filename + "-wal", wal_options);
+    if (!wal->index.empty()) {
+      // Replay whatever the last session committed but never checkpointed.
+      num_pages = std::max<std::size_t>(num_pages, wal->db_pages);
+      checkpoint();
     }
-    pages[page_num].cached = true;
   }
-  return pages[page_num];
 }
 
-void Pager::flush(std::size_t page_num) {
-  if (!pages[page_num].cached) {
-    std::cerr << "Tried to flush uncached page\n";
-    exit(EXIT_FAILURE);
+Pager::~Pager() {
+  if (map) {
+    munmap(map, map_size);
   }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
 
-  file.seekg(page_num * PAGE_SIZE, std::fstream::beg);
-
-  file.write(pages[page_num].data.data(), PAGE_SIZE);
-  pages[page_num].cached = false;
+void Pager::open_mapping(const std::string &filename) {
+  fd = ::open(filename.c_str(), O_RDWR);
+  if (fd < 0) {
+    std::cerr << "Unable to open file.\n";
+    exit(EXIT_FAILURE);
+  }
+  file_capacity = num_pages * PAGE_SIZE;
+  if (file_capacity != file_length && ftruncate(fd, file_capacity) != 0) {
+    std::cerr << "Unable to resize file for mapping.\n";
+    exit(EXIT_FAILURE);
+  }
+  // Reserve far more address space than the file needs so that growing the
+  // file with ftruncate never has to move pages that callers still point at.
+  map_size = std::max(MMAP_INITIAL_RESERVE, 2 * file_capacity);
+  void *address = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+  if (address == MAP_FAILED) {
+    std::cerr << "Unable to map file.\n";
+    exit(EXIT_FAILURE);
+  }
+  map = static_cast<char *>(address);
 }
 
-std::size_t Pager::get_unused_page_num() {
-  return num_pages;
+void Pager::grow_mapping(std::size_t min_size) {
+  auto new_capacity = std::max(min_size, std::max(2 * file_capacity, file_capacity + MMAP_MIN_GROWTH_PAGES * PAGE_SIZE));
+  if (new_capacity > map_size) {
+    auto new_map_size = std::max(new_capacity, 2 * map_size);
+    // Other threads may be reading through the mapping, so it can only grow in place.
+    void *address = mremap(map, map_size, new_map_size, 0);
+    if (address == MAP_FAILED) {
+      std::cerr << "Unable to grow file mapping to " << new_map_size << " bytes.\n";
+      exit(EXIT_FAILURE);
+    }
+    map = static_cast<char *>(address);
+    map_size = new_map_size;
+  }
+  if (ftruncate(fd, new_capacity) != 0) {
+    std::cerr << "Unable to grow file to " << new_capacity << " bytes.\n";
+    exit(EXIT_FAILURE);
+  }
+  file_capacity = new_capacity;
 }
 
-void indent(uint32_t level) {
-  for (auto i = 0U; i < level; i++) {
-    std::cout << "  ";
+Page &Pager::mapped_page(std::size_t page_num) {
+  if (page_num >= num_pages) {
+    std::lock_guard<std::recursive_mutex> lock{mutex};
+    if ((page_num + 1) * PAGE_SIZE > file_capacity) {
+      grow_mapping((page_num + 1) * PAGE_SIZE);
+    }
+    num_pages = page_num + 1;
   }
+  return *reinterpret_cast<Page *>(map + page_num * PAGE_SIZE);
 }
 
-void Pager::print_tree(uint32_t page_num, uint32_t indentation_level) {
-  auto node = get_page(page_num);
-  uint32_t num_keys, child;
-  switch (node.node_type()) {
-    case Page::NodeType::LEAF:
-      num_keys = *node.num_cells();
-      indent(indentation_level);
-      std::cout << "- leaf (size " << num_keys << ")\n";
-      for (auto i = 0U; i < num_keys; i++) {
-        indent(indentation_level + 1);
-        std::cout << "- " << *node.key(i) << '\n';
+Page &Pager::get_page(std::size_t page_num) {
+  if (backend == PagerBackend::MMAP) {
+    auto existing = page_num < num_pages;
+    auto &page = mapped_page(page_num);
+    if (page_num < verified_pages.size() && !verified_pages[page_num].load(std::memory_order_acquire)) {
+      // Checked the first time it is asked for, before anyone can change it.
+      std::lock_guard<std::recursive_mutex> lock{mutex};
+      if (!verified_pages[page_num].load(std::memory_order_relaxed)) {
+        verify_loaded_page(page_num, page.data.data());
+        verified_pages[page_num].store(true, std::memory_order_release);
       }
-      break;
-    case Page::NodeType::INTERNAL:
-      num_keys = *node.num_keys();
-      indent(indentation_level);
-      std::cout << "- internal (size " << num_keys << ")\n";
-      for (auto i = 0U; i < num_keys; i++) {
-        child = *node.child(i);
-        print_tree(child, indentation_level + 1);
-        indent(indentation_level + 1);
-        std::cout << "- key " << *node.key(i) << '\n';
+    }
+    if (saving_pager == this && existing) {
+      save_version(page_num, page);
+    }
+    return page;
+  }
+
+  std::lock_guard<std::recursive_mutex> lock{mutex};
+  std::size_t frame_index;
+  auto existing = true;
+  auto it = page_table.find(page_num);
+  if (it != page_table.end()) {
+    metric_add(stats.hits);
+    frame_index = it->second;
+  } else {
+    metric_add(stats.misses);
+    frame_index = find_victim();
+    auto &frame = frames[frame_index];
+    if (frame.in_use) {
+      metric_add(stats.evictions);
+      if (frame.dirty) {
+        write_frame(frame);
       }
-      child = *node.right_child();
-      print_tree(child, indentation_level + 1);
-      break;
+      page_table.erase(frame.page_num);
+    }
+
+    frame.page.data.fill(0);
+    frame.page_num = page_num;
+    frame.in_use = true;
+    frame.dirty = false;
+    existing = page_num < num_pages;
+    if (wal && wal->read_page(page_num, frame.page.data.data())) {
+      // Newest committed copy lives in the log until the next checkpoint.
+      count_page_read(stats);
+      verify_loaded_page(page_num, frame.page.data.data());
+    } else if (page_num < num_pages) {
+      read_file_page(page_num, frame.page.data.data());
+      verify_loaded_page(page_num, frame.page.data.data());
+    } else {
+      // Brand new page past the end of the file, it has to be written out eventually.
+      num_pages = page_num + 1;
+      frame.dirty = true;
+      dirty_frames.push_back(frame_index);
+    }
+    page_table.emplace(page_num, frame_index);
   }
-}
 
-Table::Table(const std::string &filename)
-    : pager(filename),
-      root_page_num(0) {
-  pager.get_page(0).node_type(Page::NodeType::INTERNAL);
+  auto &frame = frames[frame_index];
+  frame.referenced = true;
+  if (open_pin_scopes > 0) {
+    frame.pin_count++;
+    pinned_frames.push_back(&frame);
+  }
+  if (saving_pager == this && existing) {
+    save_version(page_num, frame.page);
+  }
+  return frame.page;
 }
 
-char *Cursor::value() {
-  auto &page = table.pager.get_page(page_num);
-  return page.value(cell_num);
+bool Pager::filter_excludes(std::size_t page_num, uint32_t key) {
+  auto &stripe = filters[page_num % FILTER_STRIPES];
+  std::lock_guard<std::mutex> lock{stripe.mutex};
+  auto it = stripe.filters.find(page_num);
+  return it != stripe.filters.end() && !it->second.may_contain(key);
 }
 
-void Cursor::advance() {
-  auto node = table.pager.get_page(page_num);
-  cell_num++;
-  if (cell_num >= *node.num_cells()) {
-    end_of_table = true;
+void Pager::build_filter(const PageLatch &leaf) {
+  {
+    auto &stripe = filters[leaf.page_num % FILTER_STRIPES];
+    std::lock_guard<std::mutex> lock{stripe.mutex};
+    if (stripe.filters.count(leaf.page_num)) {
+      return;
+    }
   }
+  // The leaf can't change while latched, and changing it afterwards drops the filter.
+  set_filter(leaf.page_num, *leaf.page);
 }
 
-void print_row(const Row &row) {
-  std::cout << "(" << row.id << ", " << row.username.data() << ", " << row.email.data() << ")\n";
+void Pager::set_filter(std::size_t page_num, Page &leaf) {
+  KeyFilter filter;
+  auto *keys = leaf.keys();
+  for (uint32_t i = 0; i < *leaf.num_cells(); i++) {
+    filter.add(keys[i]);
+  }
+  auto &stripe = filters[page_num % FILTER_STRIPES];
+  std::lock_guard<std::mutex> lock{stripe.mutex};
+  stripe.filters[page_num] = filter;
 }
 
-void serialize_row(const Row &source, char *destination) {
-  memcpy(destination + ID_OFFSET, &source.id, ID_SIZE);
-  memcpy(destination + USERNAME_OFFSET, source.username.data(), USERNAME_SIZE);
-  memcpy(destination + EMAIL_OFFSET, source.email.data(), EMAIL_SIZE);
+void Pager::drop_filter(std::size_t page_num) {
+  auto &stripe = filters[page_num % FILTER_STRIPES];
+  std::lock_guard<std::mutex> lock{stripe.mutex};
+  stripe.filters.erase(page_num);
 }
 
-void deserialize_row(const char *source, Row &destination) {
-  destination.id = *(uint32_t *) (source + ID_OFFSET);
-  destination.username = *(std::array<char, USERNAME_SIZE> *) (source + USERNAME_OFFSET);
-  destination.email = *(std::array<char, EMAIL_SIZE> *) (source + EMAIL_OFFSET);
+void Pager::begin_write() {
+  std::lock_guard<std::mutex> lock{versions.mutex};
+  saving_pager = versions.snapshots.empty() ? nullptr : this;
 }
 
-Cursor table_start(Table &table) {
-  auto page_num = table.root_page_num;
-  auto cell_num = 0U;
-  auto root_node = table.pager.get_page(table.root_page_num);
-  auto end_of_table = *root_node.num_keys() == 0;
-  return Cursor{table, page_num, cell_num, end_of_table};
+void Pager::end_write() {
+  {
+    // Rebuilt from the cache only, a leaf written back meanwhile waits for
+    // the next lookup to read it.
+    std::lock_guard<std::recursive_mutex> lock{mutex};
+    std::sort(stale_filters.begin(), stale_filters.end());
+    stale_filters.erase(std::unique(stale_filters.begin(), stale_filters.end()), stale_filters.end());
+    for (auto page_num : stale_filters) {
+      Page *page = nullptr;
+      if (backend == PagerBackend::MMAP) {
+        page = page_num < num_pages ? &mapped_page(page_num) : nullptr;
+      } else if (auto it = page_table.find(page_num); it != page_table.end()) {
+        page = &frames[it->second].page;
+      }
+      if (page && page->node_type() == Page::NodeType::LEAF) {
+        set_filter(page_num, *page);
+      }
+    }
+    stale_filters.clear();
+  }
+  std::lock_guard<std::mutex> lock{versions.mutex};
+  versions.commit_seq++;
+  versions.saved.clear();
+  saving_pager = nullptr;
+  collect_versions();
 }
 
-Cursor table_find(Table &table, uint32_t key) {
-  auto root_page_num = table.root_page_num;
-  auto &root_node = table.pager.get_page(root_page_num);
-
-  if (root_node.node_type() == Page::NodeType::LEAF) {
-    std::clog << "root node type was leaf..\n";
-    return leaf_node_find(table, root_page_num, key);
-  } else {
-    std::cerr << "Need to implement searching an internal node.\n";
-    exit(EXIT_FAILURE);
+void Pager::save_version(std::size_t page_num, const Page &page) {
+  std::lock_guard<std::mutex> lock{versions.mutex};
+  if (!versions.saved.insert(page_num).second) {
+    return;
   }
+  // Readers copy pages under the same mutex, so a snapshot either finds this
+  // version or copied the page before the writer could change it.
+  versions.versions[page_num].push_back(PageVersion{versions.commit_seq + 1, std::make_unique<Page>(page)});
 }
 
-Cursor leaf_node_find(Table &table, std::size_t page_num, uint32_t key) {
-  auto &node = table.pager.get_page(page_num);
-  auto num_cells = *node.num_cells();
-
-  Cursor cursor{table, page_num};
-
-  uint32_t min_index = 0;
-  uint32_t one_past_max_index = num_cells;
-  while (one_past_max_index != min_index) {
-    uint32_t index = (min_index + one_past_max_index) / 2;
-    uint32_t key_at_index = *node.key(index);
-    if (key == key_at_index) {
-      cursor.cell_num = index;
-      return cursor;
+void Pager::read_version(std::size_t page_num, uint64_t seq, Page &out) {
+  // The oldest version superseded after seq is what the page looked like then.
+  auto find_version = [&]() -> const Page * {
+    auto it = versions.versions.find(page_num);
+    if (it != versions.versions.end()) {
+      for (auto &version : it->second) {
+        if (version.superseded_seq > seq) {
+          return version.image.get();
+        }
+      }
     }
-    if (key < key_at_index) {
-      one_past_max_index = index;
-    } else {
-      min_index = index + 1;
+    return nullptr;
+  };
+  {
+    std::lock_guard<std::mutex> lock{versions.mutex};
+    if (auto image = find_version()) {
+      out = *image;
+      return;
     }
   }
-
-  cursor.cell_num = min_index;
-  return cursor;
+  // Unchanged since seq so far. The writer may save and change it before the
+  // lock is taken again, which the second lookup catches.
+  PinScope scope{*this};
+  auto &page = get_page(page_num);
+  std::lock_guard<std::mutex> lock{versions.mutex};
+  auto image = find_version();
+  out = image ? *image : page;
 }
 
-Page::Page(NodeType type)
-    : cached(),
-      data() {
-  node_type(type);
-};
-
-Page::NodeType Page::node_type() {
-  uint8_t value = *(uint8_t *) (data.data() + NODE_TYPE_OFFSET);
-  return static_cast<NodeType>(value);
+uint64_t Pager::open_snapshot() {
+  std::lock_guard<std::mutex> lock{versions.mutex};
+  versions.snapshots.insert(versions.commit_seq);
+  return versions.commit_seq;
 }
 
-void Page::node_type(NodeType type) {
-  if (type == NodeType::LEAF) {
-    root(false);
-    *num_cells() = 0;
-  } else {
-    root(true);
-    *num_keys() = 0;
-  }
-  *(uint8_t *) (data.data() + NODE_TYPE_OFFSET) = static_cast<uint8_t>(type);
+void Pager::close_snapshot(uint64_t seq) {
+  std::lock_guard<std::mutex> lock{versions.mutex};
+  versions.snapshots.erase(versions.snapshots.find(seq));
+  collect_versions();
 }
 
-uint32_t *Page::num_keys() {
-  return (uint32_t *) (data.data() + INTERNAL_NODE_NUM_KEYS_OFFSET);
+void Pager::collect_versions() {
+  if (versions.snapshots.empty()) {
+    versions.versions.clear();
+    return;
+  }
+  // Snapshots only read versions superseded after them.
+  auto oldest = *versions.snapshots.begin();
+  for (auto it = versions.versions.begin(); it != versions.versions.end();) {
+    auto &page_versions = it->second;
+    page_versions.erase(page_versions.begin(),
+                        std::find_if(page_versions.begin(), page_versions.end(),
+                                     [oldest](const PageVersion &version) { return version.superseded_seq > oldest; }));
+    it = page_versions.empty() ? versions.versions.erase(it) : std::next(it);
+  }
 }
 
-uint32_t *Page::num_cells() {
-  return (uint32_t *) (data.data() + LEAF_NODE_NUM_CELLS_OFFSET);
+std::size_t Pager::find_victim() {
+  // Two full sweeps are enough to clear every reference bit and come back around.
+  for (std::size_t i = 0; i < 2 * frames.size(); i++) {
+    auto &frame = frames[clock_hand];
+    auto candidate = clock_hand;
+    clock_hand = (clock_hand + 1) % frames.size();
+    if (!frame.in_use) {
+      return candidate;
+    }
+    if (frame.pin_count > 0) {
+      continue;
+    }
+    if (frame.referenced) {
+      frame.referenced = false;
+      continue;
+    }
+    return candidate;
+  }
+  std::cerr << "Buffer pool exhausted, all " << frames.size() << " frames are pinned.\n";
+  exit(EXIT_FAILURE);
 }
 
-char *Page::right_child() {
-  return data.data() + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+void Pager::write_frame(Frame &frame) {
+  stamp_page_checksum(frame.page.data.data());
+  if (wal) {
+    // The database file only changes at checkpoints, spill to the log instead.
+    wal->append(frame.page_num, frame.page.data.data(), 0);
+    count_page_write(stats);
+  } else {
+    write_file_page(frame.page_num, frame.page.data.data());
+  }
+  frame.dirty = false;
+  metric_add(stats.writebacks);
 }
 
-char *Page::cell(std::size_t cell_num) {
-  switch (node_type()) {
-    case NodeType::INTERNAL:
-      return data.data() + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
-    case NodeType::LEAF:
-      std::clog << "Was a leaf...\n";
-      return data.data() + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+void Pager::verify_loaded_page(std::size_t page_num, const char *data) {
+  if (!page_checksum_valid(data)) {
+    std::cerr << "Page " << page_num << " is corrupt, its checksum doesn't match.\n";
+    exit(EXIT_FAILURE);
   }
 }
 
-char *Page::value(std::size_t cell_num) {
-  return cell(cell_num) + LEAF_NODE_KEY_SIZE;
+void Pager::read_file_page(std::size_t page_num, char *data) {
+  count_page_read(stats);
+  if (backend == PagerBackend::IO_URING) {
+    // A short read at the end of the file leaves the rest of the page zeroed.
+    if (pread(fd, data, PAGE_SIZE, page_num * PAGE_SIZE) < 0) {
+      std::cerr << "Unable to read page " << page_num << ".\n";
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+  file.seekg(page_num * PAGE_SIZE, std::fstream::beg);
+  file.read(data, PAGE_SIZE);
+  if (file.eof()) {
+    file.clear();
+  }
 }
 
-char *Page::child(uint32_t child_num) {
-  if (child_num > *num_keys()) {
-    std::cerr << "Tried to access child_num " << child_num << " > num_keys " << *num_keys() << '\n';
+void Pager::write_file_page(std::size_t page_num, const char *data) {
+  count_page_write(stats);
+  if (backend == PagerBackend::IO_URING) {
+    if (pwrite(fd, data, PAGE_SIZE, page_num * PAGE_SIZE) != PAGE_SIZE) {
+      std::cerr << "Unable to write page " << page_num << ".\n";
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+  file.seekp(page_num * PAGE_SIZE, std::fstream::beg);
+  file.write(data, PAGE_SIZE);
+  if (!file) {
+    std::cerr << "Unable to write page " << page_num << ".\n";
     exit(EXIT_FAILURE);
-  } else if (child_num == *num_keys()) {
-    return right_child();
-  } else {
-    return cell(child_num);
   }
 }
 
-uint32_t *Page::key(std::size_t cell_num) {
-  switch (node_type()) {
-    case Page::NodeType::INTERNAL:
-      return (uint32_t *) (cell(cell_num) + INTERNAL_NODE_CHILD_SIZE);
-    case Page::NodeType::LEAF:
-      return (uint32_t *) cell(cell_num);
+void Pager::write_file_pages(std::vector<IoRequest> &writes) {
+  std::sort(writes.begin(), writes.end(), [](const IoRequest &a, const IoRequest &b) {
+    return a.offset < b.offset;
+  });
+  if (backend != PagerBackend::IO_URING) {
+    for (auto &write : writes) {
+      write_file_page(write.offset / PAGE_SIZE, write.buffer);
+    }
+    return;
   }
-}
-
-uint32_t Page::max_key() {
-  switch (node_type()) {
-    case Page::NodeType::INTERNAL:
-      return *key(*num_keys() - 1);
-    case Page::NodeType::LEAF:
-      return *key(*num_cells() - 1);
+  ring->run(fd, writes.data(), writes.size());
+  for (auto &write : writes) {
+    if (write.result != static_cast<int>(write.length)) {
+      std::cerr << "Unable to write page " << write.offset / PAGE_SIZE << ".\n";
+      exit(EXIT_FAILURE);
+    }
+    count_page_write(stats);
   }
 }
 
-bool Page::is_root() {
-  uint8_t value = *(uint8_t *) (data.data() + IS_ROOT_OFFSET);
-  return (bool) value;
+void Pager::prefetch(const uint32_t *page_nums, std::size_t count) {
+  if (backend != PagerBackend::IO_URING) {
+    return;
+  }
+  std::lock_guard<std::recursive_mutex> lock{mutex};
+  // Frames being filled stay pinned so that a later victim search can't pick them again.
+  std::vector<Frame *> loading;
+  std::vector<IoRequest> reads;
+  for (std::size_t i = 0; i < count && loading.size() < frames.size() / 4; i++) {
+    auto page_num = page_nums[i];
+    if (page_num >= num_pages || page_table.count(page_num) != 0) {
+      continue;
+    }
+    auto frame_index = find_victim();
+    auto &frame = frames[frame_index];
+    if (frame.in_use) {
+      metric_add(stats.evictions);
+      if (frame.dirty) {
+        write_frame(frame);
+      }
+      page_table.erase(frame.page_num);
+    }
+    frame.page.data.fill(0);
+    frame.page_num = page_num;
+    frame.in_use = true;
+    frame.dirty = false;
+    frame.referenced = true;
+    frame.pin_count++;
+    loading.push_back(&frame);
+    page_table.emplace(page_num, frame_index);
+    metric_add(stats.readaheads);
+    if (wal && wal->read_page(page_num, frame.page.data.data())) {
+      count_page_read(stats);
+      verify_loaded_page(page_num, frame.page.data.data());
+    } else {
+      reads.push_back(IoRequest{frame.page.data.data(), PAGE_SIZE, page_num * PAGE_SIZE, false});
+    }
+  }
+  ring->run(fd, reads.data(), reads.size());
+  for (auto &read : reads) {
+    if (read.result < 0) {
+      std::cerr << "Unable to read page " << read.offset / PAGE_SIZE << ".\n";
+      exit(EXIT_FAILURE);
+    }
+    count_page_read(stats);
+    verify_loaded_page(read.offset / PAGE_SIZE, read.buffer);
+  }
+  for (auto *frame : loading) {
+    frame->pin_count--;
+  }
 }
 
-void Page::root(bool is_root) {
-  uint8_t value = is_root;
-  *(uint8_t *) (data.data() + IS_ROOT_OFFSET) = value;
+void Pager::mark_dirty(std::size_t page_num) {
+  if (backend == PagerBackend::MMAP) {
+    std::lock_guard<std::recursive_mutex> lock{mutex};
+    if (dirty_pages.size() <= page_num) {
+      dirty_pages.resize(page_num + 1);
+    }
+    dirty_pages[page_num] = true;
+    // The kernel may write the page back any time from now on, so its
+    // checksum has to be right already rather than at the next flush.
+    stamp_page_checksum(map + page_num * PAGE_SIZE);
+    drop_filter(page_num);
+    stale_filters.push_back(page_num);
+    return;
+  }
+  std::lock_guard<std::recursive_mutex> lock{mutex};
+  auto it = page_table.find(page_num);
+  if (it == page_table.end()) {
+    std::cerr << "Tried to mark uncached page " << page_num << " dirty\n";
+    exit(EXIT_FAILURE);
+  }
+  drop_filter(page_num);
+  stale_filters.push_back(page_num);
+  auto &frame = frames[it->second];
+  if (!frame.dirty) {
+    frame.dirty = true;
+    dirty_frames.push_back(it->second);
+  }
 }
 
-void db_close(Table &table) {
-  for (std::size_t i = 0; i < table.pager.num_pages; i++) {
-    if (table.pager.pages[i].cached) {
-      table.pager.flush(i);
+void Pager::flush(std::size_t page_num) {
+  if (backend == PagerBackend::MMAP) {
+    std::lock_guard<std::recursive_mutex> lock{mutex};
+    if (page_num < dirty_pages.size() && dirty_pages[page_num]) {
+      stamp_page_checksum(map + page_num * PAGE_SIZE);
+      dirty_pages[page_num] = false;
     }
+    if (page_num < num_pages) {
+      msync(map + page_num * PAGE_SIZE, PAGE_SIZE, MS_SYNC);
+    }
+    return;
+  }
+  std::lock_guard<std::recursive_mutex> lock{mutex};
+  auto it = page_table.find(page_num);
+  if (it == page_table.end()) {
+    std::cerr << "Tried to flush uncached page\n";
+    exit(EXIT_FAILURE);
   }
 
-  table.pager.file.close();
+  auto &frame = frames[it->second];
+  if (frame.dirty) {
+    write_frame(frame);
+  }
 }
 
-MetaCommandResult do_meta_command(const std::string &command, Table &table) {
-  if (command == ".exit") {
-    db_close(table);
-    exit(EXIT_SUCCESS);
-  } else if (command == ".btree") {
-    std::cout << "Tree:\n";
-    table.pager.print_tree(0, 0);
-    return MetaCommandResult::SUCCESS;
-  } else if (command == ".constants") {
-    std::cout << "Constants:\n";
-    print_constants();
-    return MetaCommandResult::SUCCESS;
-  } else {
-    return MetaCommandResult::UNRECOGNIZED_COMMAND;
+void Pager::flush_all() {
+  if (backend == PagerBackend::MMAP) {
+    // Pages are stamped as they are marked dirty, again here in case they
+    // changed after that.
+    std::lock_guard<std::recursive_mutex> lock{mutex};
+    for (std::size_t page_num = 0; page_num < std::min<std::size_t>(dirty_pages.size(), num_pages); page_num++) {
+      if (dirty_pages[page_num]) {
+        stamp_page_checksum(map + page_num * PAGE_SIZE);
+      }
+    }
+    dirty_pages.clear();
+    if (num_pages > 0) {
+      msync(map, num_pages * PAGE_SIZE, MS_SYNC);
+    }
+    return;
+  }
+  if (wal) {
+    commit();
+    return;
+  }
+  std::lock_guard<std::recursive_mutex> lock{mutex};
+  dirty_frames.clear();
+  std::vector<IoRequest> writes;
+  for (auto &frame : frames) {
+    if (frame.in_use && frame.dirty) {
+      stamp_page_checksum(frame.page.data.data());
+      writes.push_back(IoRequest{frame.page.data.data(), PAGE_SIZE, frame.page_num * PAGE_SIZE, true});
+      frame.dirty = false;
+      metric_add(stats.writebacks);
+    }
   }
+  write_file_pages(writes);
+  file.flush();
 }
 
-std::vector<std::string> tokenize(const std::string &str, const std::string &delimiters) {
-  std::vector<std::string> tokens;
-  std::string::size_type lastPos = str.find_first_not_of(delimiters, 0);
-  std::string::size_type pos = str.find_first_of(delimiters, lastPos);
+void Pager::commit() {
+  if (!wal) {
+    return;
+  }
+  std::lock_guard<std::recursive_mutex> lock{mutex};
 
-  while (std::string::npos != pos || std::string::npos != lastPos) {
-    tokens.emplace_back(str.substr(lastPos, pos - lastPos));
-    lastPos = str.find_first_not_of(delimiters, pos);
-    pos = str.find_first_of(delimiters, lastPos);
+  std::vector<std::size_t> to_log;
+  for (auto frame_index : dirty_frames) {
+    auto &frame = frames[frame_index];
+    if (frame.in_use && frame.dirty) {
+      frame.dirty = false;
+      to_log.push_back(frame_index);
+    }
+  }
+  dirty_frames.clear();
+  if (to_log.empty()) {
+    // Nothing to log. If the statement's pages were all spilled already, the
+    // last spilled frame carries the commit mark.
+    if (wal->uncommitted_frames > 0) {
+      wal->mark_commit(num_pages);
+    }
+    return;
   }
 
-  return tokens;
-}
+  for (std::size_t i = 0; i < to_log.size(); i++) {
+    auto &frame = frames[to_log[i]];
+    uint32_t commit_pages = i + 1 == to_log.size() ? num_pages.load() : 0;
+    stamp_page_checksum(frame.page.data.data());
+    wal->append(frame.page_num, frame.page.data.data(), commit_pages);
+    count_page_write(stats);
+  }
 
-bool is_number(const std::string &s) {
-  return !s.empty() && std::find_if(s.begin(), s.end(), [](char c) { return !std::isdigit(c); }) == s.end();
+  if (wal->frame_count >= wal->options.checkpoint_frames) {
+    checkpoint();
+  }
 }
 
-void leaf_node_insert(Cursor &cursor, uint32_t key, const Row &value) {
-  auto &node = cursor.table.pager.get_page(cursor.page_num);
-
-  auto num_cells = *node.num_cells();
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-//    leaf_node_split_and_insert(cursor, key, value);
+void Pager::checkpoint() {
+  if (!wal) {
+    flush_all();
     return;
   }
+  std::lock_guard<std::recursive_mutex> lock{mutex};
+  commit();
+  wal->sync();
 
-  if (cursor.cell_num < num_cells) {
-    // Make room for new cell
-    for (auto i = num_cells; i > cursor.cell_num; i--) {
-      memcpy(node.cell(i), node.cell(i - 1), LEAF_NODE_CELL_SIZE);
+  std::vector<std::pair<std::size_t, uint64_t>> entries(wal->index.begin(), wal->index.end());
+  std::sort(entries.begin(), entries.end());
+  // Copied back a batch of pages at a time, each batch in one submission.
+  std::vector<char> buffer(IO_RING_DEFAULT_ENTRIES * PAGE_SIZE);
+  std::vector<IoRequest> writes;
+  for (std::size_t begin = 0; begin < entries.size(); begin += IO_RING_DEFAULT_ENTRIES) {
+    writes.clear();
+    auto end = std::min(entries.size(), begin + IO_RING_DEFAULT_ENTRIES);
+    for (auto i = begin; i < end; i++) {
+      auto *data = buffer.data() + (i - begin) * PAGE_SIZE;
+      wal->read_frame(entries[i].second, data);
+      count_page_read(stats);
+      writes.push_back(IoRequest{data, PAGE_SIZE, entries[i].first * PAGE_SIZE, true});
     }
+    write_file_pages(writes);
   }
+  file.flush();
+  if (!file) {
+    std::cerr << "Unable to write checkpoint.\n";
+    exit(EXIT_FAILURE);
+  }
+  // fsync works on the file, not the descriptor, so a second one will do.
+  // The log is only emptied once the pages are known to be on disk.
+  auto sync_fd = ::open(filename.c_str(), O_RDWR);
+  if (sync_fd < 0 || fsync(sync_fd) != 0) {
+    std::cerr << "Unable to sync checkpoint.\n";
+    exit(EXIT_FAILURE);
+  }
+  ::close(sync_fd);
 
-  *node.num_cells() += 1;
-  *node.key(cursor.cell_num) = key;
-  serialize_row(value, node.cell(cursor.cell_num));
-}
-
-void create_new_root(Table &table, uint32_t right_child_page_num) {
-  auto root = table.pager.get_page(table.root_page_num);
-  auto right_child = table.pager.get_page(right_child_page_num);
-  auto left_child_page_num = table.pager.get_unused_page_num();
-  auto left_child = table.pager.get_page(left_child_page_num);
-  memcpy(left_child.data.data(), root.data.data(), PAGE_SIZE);
-  left_child.root(false);
-  root.root(true);
-  *root.num_keys() = 1;
-  *root.child(0) = left_child_page_num;
-  uint32_t left_child_max_key = left_child.max_key();
-  *root.key(0) = left_child_max_key;
-  *root.right_child() = right_child_page_num;
+  wal->restart();
+  wal->stats.checkpoints++;
 }
 
-void leaf_node_split_and_insert(Cursor cursor, uint32_t key, const Row &value) {
-  auto &old_node = cursor.table.pager.get_page(cursor.page_num);
-  auto new_page_num = cursor.table.pager.get_unused_page_num();
-  auto &new_node = cursor.table.pager.get_page(new_page_num);
-
-  for (auto i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-    Page *destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-      destination_node = &new_node;
-    } else {
-      destination_node = &old_node;
+void Pager::close() {
+  if (backend == PagerBackend::MMAP) {
+    if (map) {
+      munmap(map, map_size);
+      map = nullptr;
     }
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    char *destination = destination_node->cell(index_within_node);
-
-    if (i == cursor.cell_num) {
-      serialize_row(value, destination);
-    } else if (i > cursor.cell_num) {
-      memcpy(destination, old_node.cell(i - 1), LEAF_NODE_CELL_SIZE);
-    } else {
-      memcpy(destination, old_node.cell(i), LEAF_NODE_CELL_SIZE);
+    if (fd >= 0) {
+      // Give back the space grown ahead of use.
+      if (ftruncate(fd, num_pages * PAGE_SIZE) != 0) {
+        std::cerr << "Unable to truncate file.\n";
+      }
+      ::close(fd);
+      fd = -1;
     }
+    return;
   }
-  *old_node.num_cells() = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *new_node.num_cells() = LEAF_NODE_RIGHT_SPLIT_COUNT;
+  if (wal) {
+    checkpoint();
+    auto wal_filename = wal->filename;
+    wal.reset();
+    std::remove(wal_filename.c_str());
+  }
+  file.close();
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
 
-  if (old_node.is_root()) {
-    return create_new_root(cursor.table, new_page_num);
+std::size_t Pager::get_unused_page_num() {
+  if (num_pages <= HEADER_PAGE_NUM) {
+    return num_pages;
+  }
+  PinScope scope{*this};
+  auto &header = get_page(HEADER_PAGE_NUM);
+  auto trunk_page_num = *header.freelist_trunk();
+  if (trunk_page_num == 0) {
+    return num_pages;
+  }
+  auto &trunk = get_page(trunk_page_num);
+  std::size_t page_num;
+  if (*trunk.trunk_num_pages() > 0) {
+    page_num = trunk.trunk_pages()[--*trunk.trunk_num_pages()];
+    mark_dirty(trunk_page_num);
   } else {
-    std::cerr << "Need to implement updating parent after split.\n";
-    exit(EXIT_FAILURE);
+    // A trunk with nothing left on it is handed out itself.
+    page_num = trunk_page_num;
+    *header.freelist_trunk() = *trunk.trunk_next();
   }
+  --*header.freelist_count();
+  mark_dirty(HEADER_PAGE_NUM);
+  // Callers only set up the header of a new node, clear out the old one.
+  get_page(page_num).data.fill(0);
+  mark_dirty(page_num);
+  return page_num;
 }
 
-PrepareResult prepare_statement(const std::string &input, Statement &out_statement) {
-  std::vector<std::string> tokens = tokenize(input, " ");
-  if (tokens.empty()) {
-    return PrepareResult::UNRECOGNIZED_STATEMENT;
+void Pager::free_page(std::size_t page_num) {
+  PinScope scope{*this};
+  auto &header = get_page(HEADER_PAGE_NUM);
+  auto trunk_page_num = *header.freelist_trunk();
+  if (trunk_page_num != 0 && *get_page(trunk_page_num).trunk_num_pages() < FREELIST_TRUNK_CAPACITY) {
+    auto &trunk = get_page(trunk_page_num);
+    trunk.trunk_pages()[(*trunk.trunk_num_pages())++] = page_num;
+    mark_dirty(trunk_page_num);
+  } else {
+    // The first trunk is full, the freed page starts a new one.
+    auto &trunk = get_page(page_num);
+    trunk.node_type(Page::NodeType::FREELIST_TRUNK);
+    *trunk.trunk_next() = trunk_page_num;
+    mark_dirty(page_num);
+    *header.freelist_trunk() = page_num;
   }
-  if (tokens[0] == "insert") {
-    out_statement = Statement{Statement::INSERT};
-    if (tokens.size() != 4) {
-      return PrepareResult::SYNTAX_ERROR;
+  ++*header.freelist_count();
+  mark_dirty(HEADER_PAGE_NUM);
+}
+
+std::size_t Pager::free_page_count() {
+  if (num_pages <= HEADER_PAGE_NUM) {
+    return 0;
+  }
+  PinScope scope{*this};
+  return *get_page(HEADER_PAGE_NUM).freelist_count();
+}
+
+void Pager::truncate(std::size_t page_count) {
+  std::lock_guard<std::recursive_mutex> lock{mutex};
+  for (auto &stripe : filters) {
+    std::lock_guard<std::mutex> stripe_lock{stripe.mutex};
+    for (auto it = stripe.filters.begin(); it != stripe.filters.end();) {
+      it = it->first >= page_count ? stripe.filters.erase(it) : std::next(it);
+    }
+  }
+  if (backend == PagerBackend::MMAP) {
+    if (ftruncate(fd, page_count * PAGE_SIZE) != 0) {
+      std::cerr << "Unable to truncate file.\n";
+      exit(EXIT_FAILURE);
+    }
+    file_capacity = page_count * PAGE_SIZE;
+    num_pages = page_count;
+    return;
+  }
+
+  // Every page has to be in the file first, and none may be left in the log
+  // to be copied back past the new end at the next checkpoint.
+  checkpoint();
+  for (auto &frame : frames) {
+    if (frame.in_use && frame.page_num >= page_count) {
+      page_table.erase(frame.page_num);
+      frame.in_use = false;
+      frame.dirty = false;
+    }
+  }
+  file.flush();
+  if (::truncate(filename.c_str(), page_count * PAGE_SIZE) != 0) {
+    std::cerr << "Unable to truncate file.\n";
+    exit(EXIT_FAILURE);
+  }
+  file_length = page_count * PAGE_SIZE;
+  num_pages = page_count;
+}
+
+PinScope::PinScope(Pager &pager)
+    : pager(pager),
+      mark(pinned_frames.size()) {
+  open_pin_scopes++;
+}
+
+PinScope::~PinScope() {
+  while (pinned_frames.size() > mark) {
+    pinned_frames.back()->pin_count--;
+    pinned_frames.pop_back();
+  }
+  open_pin_scopes--;
+}
+
+PageLatch::PageLatch()
+    : pager(),
+      page_num(),
+      page(),
+      latch(),
+      frame(),
+      exclusive() {
+}
+
+PageLatch::PageLatch(Pager &pager, std::size_t page_num, bool exclusive)
+    : pager(&pager),
+      page_num(page_num),
+      page(),
+      latch(),
+      frame(),
+      exclusive(exclusive) {
+  {
+    std::lock_guard<std::recursive_mutex> lock{pager.mutex};
+    page = &pager.get_page(page_num);
+    if (pager.backend == PagerBackend::MMAP) {
+      while (pager.page_latches.size() <= page_num) {
+        pager.page_latches.emplace_back();
+      }
+      latch = &pager.page_latches[page_num];
+    } else {
+      frame = &pager.frames[pager.page_table[page_num]];
+      frame->pin_count++;
+      latch = &frame->latch;
+    }
+  }
+  // Never wait on a latch while holding the pager mutex, the holder may need it.
+  if (exclusive) {
+    latch->lock();
+  } else {
+    latch->lock_shared();
+  }
+}
+
+PageLatch::PageLatch(Pager &pager, std::size_t page_num, std::try_to_lock_t)
+    : pager(&pager),
+      page_num(page_num),
+      page(),
+      latch(),
+      frame(),
+      exclusive(false) {
+  std::lock_guard<std::recursive_mutex> lock{pager.mutex};
+  page = &pager.get_page(page_num);
+  if (pager.backend == PagerBackend::MMAP) {
+    while (pager.page_latches.size() <= page_num) {
+      pager.page_latches.emplace_back();
+    }
+    latch = &pager.page_latches[page_num];
+  } else {
+    frame = &pager.frames[pager.page_table[page_num]];
+    latch = &frame->latch;
+  }
+  if (!latch->try_lock_shared()) {
+    latch = nullptr;
+    frame = nullptr;
+    return;
+  }
+  if (frame) {
+    frame->pin_count++;
+  }
+}
+
+PageLatch::PageLatch(PageLatch &&other) noexcept
+    : pager(other.pager),
+      page_num(other.page_num),
+      page(other.page),
+      latch(other.latch),
+      frame(other.frame),
+      exclusive(other.exclusive) {
+  other.latch = nullptr;
+  other.frame = nullptr;
+}
+
+PageLatch &PageLatch::operator=(PageLatch &&other) noexcept {
+  if (this != &other) {
+    release();
+    pager = other.pager;
+    page_num = other.page_num;
+    page = other.page;
+    latch = other.latch;
+    frame = other.frame;
+    exclusive = other.exclusive;
+    other.latch = nullptr;
+    other.frame = nullptr;
+  }
+  return *this;
+}
+
+PageLatch::~PageLatch() {
+  release();
+}
+
+void PageLatch::release() {
+  if (latch) {
+    if (exclusive) {
+      latch->unlock();
+    } else {
+      latch->unlock_shared();
+    }
+    latch = nullptr;
+  }
+  if (frame) {
+    frame->pin_count--;
+    frame = nullptr;
+  }
+}
+
+void indent(uint32_t level) {
+  for (auto i = 0U; i < level; i++) {
+    std::cout << "  ";
+  }
+}
+
+void Pager::print_tree(uint32_t page_num, uint32_t indentation_level) {
+  PinScope scope{*this};
+  auto &node = get_page(page_num);
+  uint32_t num_keys, child;
+  switch (node.node_type()) {
+    case Page::NodeType::LEAF:
+      num_keys = *node.num_cells();
+      indent(indentation_level);
+      std::cout << "- leaf (size " << num_keys << ")\n";
+      for (auto i = 0U; i < num_keys; i++) {
+        indent(indentation_level + 1);
+        std::cout << "- " << *node.key(i) << '\n';
+      }
+      break;
+    case Page::NodeType::INTERNAL:
+      num_keys = *node.num_keys();
+      indent(indentation_level);
+      std::cout << "- internal (size " << num_keys << ")\n";
+      for (auto i = 0U; i < num_keys; i++) {
+        child = *node.child(i);
+        print_tree(child, indentation_level + 1);
+        indent(indentation_level + 1);
+        std::cout << "- key " << *node.key(i) << '\n';
+      }
+      child = *node.right_child();
+      print_tree(child, indentation_level + 1);
+      break;
+    case Page::NodeType::INDEX_LEAF:
+    case Page::NodeType::INDEX_INTERNAL: {
+      auto is_leaf = node.node_type() == Page::NodeType::INDEX_LEAF;
+      num_keys = *node.num_cells();
+      indent(indentation_level);
+      std::cout << (is_leaf ? "- index leaf (size " : "- index internal (size ") << num_keys << ")\n";
+      for (auto i = 0U; i < num_keys; i++) {
+        if (!is_leaf) {
+          print_tree(*index_cell_child(node, i), indentation_level + 1);
+        }
+        auto entry = index_cell_entry(node, i);
+        indent(indentation_level + 1);
+        std::cout << (is_leaf ? "- " : "- key ") << entry.value << ' ' << entry.id << '\n';
+      }
+      if (!is_leaf) {
+        print_tree(*node.next_leaf(), indentation_level + 1); // the right child
+      }
+      break;
+    }
+    case Page::NodeType::OVERFLOW:
+    case Page::NodeType::HEADER:
+    case Page::NodeType::FREELIST_TRUNK:
+      std::cerr << "Page " << page_num << " is not a tree node.\n";
+      exit(EXIT_FAILURE);
+  }
+}
+
+Table::Table(const std::string &filename,
+             std::size_t pool_frames,
+             PagerBackend backend,
+             const WalOptions &wal_options,
+             std::size_t row_cache_rows)
+    : pager(filename, pool_frames, backend, wal_options),
+      root_page_num(TABLE_ROOT_PAGE_NUM) {
+  if (row_cache_rows > 0) {
+    row_cache = std::make_unique<RowCache>(row_cache_rows);
+  }
+  PinScope scope{pager};
+  if (pager.num_pages == 0) {
+    // New database file: the header page and an empty root leaf.
+    pager.get_page(HEADER_PAGE_NUM).node_type(Page::NodeType::HEADER);
+    auto &root_node = pager.get_page(root_page_num);
+    root_node.node_type(Page::NodeType::LEAF);
+    root_node.root(true);
+    pager.mark_dirty(HEADER_PAGE_NUM);
+    pager.mark_dirty(root_page_num);
+    pager.commit();
+    if (pager.wal) {
+      pager.wal->wait_durable(pager.wal->writes);
+    }
+  }
+  auto &header = pager.get_page(HEADER_PAGE_NUM);
+  for (std::size_t i = 0; i < INDEX_COLUMN_COUNT; i++) {
+    index_roots[i] = header.index_roots()[i];
+  }
+}
+
+Table::~Table() = default;
+
+WriteScope::WriteScope(Table &table) : writer(table.writer_mutex), pager(table.pager) {
+  pager.begin_write();
+}
+
+WriteScope::~WriteScope() {
+  // Whatever the statement changed is committed, including the undo of one
+  // that failed part way, so no dirty state is left for the next one.
+  pager.commit();
+  pager.end_write();
+  if (pager.wal) {
+    // The statement is only acknowledged once its commit is on disk, but the
+    // next writer is let in first so its commit can share the fsync.
+    auto written = pager.wal->writes.load();
+    writer.unlock();
+    pager.wal->wait_durable(written);
+  }
+}
+
+Snapshot::Snapshot(Table &table) : table(table), seq() {
+  std::lock_guard<std::mutex> writer{table.writer_mutex};
+  seq = table.pager.open_snapshot();
+}
+
+Snapshot::~Snapshot() {
+  table.pager.close_snapshot(seq);
+}
+
+void Snapshot::read_page(std::size_t page_num, Page &out) const {
+  table.pager.read_version(page_num, seq, out);
+}
+
+ExecuteResult Table::bulk_load_rows(const std::vector<uint16_t> &cell_sizes,
+                                   double fill_factor,
+                                   const std::function<const Row &()> &next_row) {
+  WriteScope writer{*this};
+  PageLatch root_latch{pager, root_page_num, true};
+  {
+    PinScope scope{pager};
+    auto &root = pager.get_page(root_page_num);
+    if (root.node_type() != Page::NodeType::LEAF || *root.num_cells() != 0) {
+      return ExecuteResult::TABLE_NOT_EMPTY;
+    }
+  }
+  if (cell_sizes.empty()) {
+    return ExecuteResult::SUCCESS;
+  }
+
+  fill_factor = std::min(1.0, std::max(fill_factor, 0.0));
+  // Cells vary in size, so leaves take cells until the next one would go over
+  // their share of the page. Every leaf gets at least one.
+  std::size_t leaf_budget = LEAF_NODE_SPACE_FOR_CELLS * fill_factor;
+  std::vector<std::size_t> leaf_cells{0};
+  std::size_t leaf_used = 0;
+  for (auto cell_size : cell_sizes) {
+    auto space = LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE + cell_size;
+    if (leaf_cells.back() > 0 && leaf_used + space > leaf_budget) {
+      leaf_cells.push_back(0);
+      leaf_used = 0;
+    }
+    leaf_cells.back()++;
+    leaf_used += space;
+  }
+  std::size_t children_per_node = std::max<std::size_t>(2, (INTERNAL_NODE_MAX_KEYS + 1) * fill_factor);
+  auto nodes_needed = [](std::size_t items, std::size_t per_node) { return (items + per_node - 1) / per_node; };
+  // Spread items evenly so the last node of a level isn't left nearly empty.
+  auto share = [](std::size_t items, std::size_t nodes, std::size_t index) {
+    return items / nodes + (index < items % nodes ? 1 : 0);
+  };
+
+  // Work out the shape of every level up front so nodes know their parent's page
+  // number when they are written. The single top node always goes in the root
+  // page, every other level is laid out sequentially after the existing pages,
+  // leaving any free ones for later inserts.
+  std::vector<std::size_t> level_sizes{leaf_cells.size()};
+  while (level_sizes.back() > 1) {
+    level_sizes.push_back(nodes_needed(level_sizes.back(), children_per_node));
+  }
+  auto top_level = level_sizes.size() - 1;
+  std::vector<std::size_t> level_first_page(level_sizes.size(), root_page_num);
+  std::size_t next_page_num = pager.num_pages;
+  for (std::size_t level = 0; level < top_level; level++) {
+    level_first_page[level] = next_page_num;
+    next_page_num += level_sizes[level];
+  }
+  auto next_overflow_page = next_page_num; // overflow chains follow the tree
+
+  std::vector<uint32_t> max_keys; // max key of every node on the level just written
+  std::vector<uint32_t> row_counts; // and the rows under it
+  max_keys.reserve(level_sizes[0]);
+  for (std::size_t level = 0; level <= top_level; level++) {
+    std::size_t parent_index = 0;
+    std::size_t parent_remaining = level < top_level ? share(level_sizes[level], level_sizes[level + 1], 0) : 0;
+    std::size_t child_index = 0;
+    std::vector<uint32_t> level_max_keys;
+    std::vector<uint32_t> level_row_counts;
+    level_max_keys.reserve(level_sizes[level]);
+    level_row_counts.reserve(level_sizes[level]);
+
+    for (std::size_t index = 0; index < level_sizes[level]; index++) {
+      PinScope scope{pager};
+      auto page_num = level_first_page[level] + index;
+      auto &node = pager.get_page(page_num);
+      if (level == 0) {
+        node.node_type(Page::NodeType::LEAF);
+        auto num_cells = leaf_cells[index];
+        for (std::size_t cell_num = 0; cell_num < num_cells; cell_num++) {
+          const Row &row = next_row();
+          char cell[LEAF_NODE_MAX_CELL_SIZE];
+          auto cell_size = build_leaf_cell(pager, row, cell, &next_overflow_page);
+          leaf_node_insert_cell(node, cell_num, row.id, cell, cell_size);
+        }
+        *node.next_leaf() = index + 1 < level_sizes[0] ? page_num + 1 : 0;
+        level_max_keys.push_back(*node.key(num_cells - 1));
+        level_row_counts.push_back(num_cells);
+      } else {
+        node.node_type(Page::NodeType::INTERNAL);
+        auto num_children = share(level_sizes[level - 1], level_sizes[level], index);
+        *node.num_keys() = num_children - 1;
+        uint32_t rows = 0;
+        for (std::size_t child = 0; child < num_children; child++) {
+          if (child + 1 < num_children) {
+            *node.child(child) = level_first_page[level - 1] + child_index;
+            *node.key(child) = max_keys[child_index];
+          } else {
+            *node.right_child() = level_first_page[level - 1] + child_index;
+            level_max_keys.push_back(max_keys[child_index]);
+          }
+          *node.child_count(child) = row_counts[child_index];
+          rows += row_counts[child_index];
+          child_index++;
+        }
+        level_row_counts.push_back(rows);
+      }
+
+      node.root(level == top_level);
+      if (level < top_level) {
+        *node.parent() = level_first_page[level + 1] + parent_index;
+        if (--parent_remaining == 0 && ++parent_index < level_sizes[level + 1]) {
+          parent_remaining = share(level_sizes[level], level_sizes[level + 1], parent_index);
+        }
+      }
+      pager.mark_dirty(page_num);
+    }
+    max_keys.swap(level_max_keys);
+    row_counts.swap(level_row_counts);
+  }
+
+  // Indexes created on the empty table get their entries now that the tree is complete.
+  root_latch.release();
+  for (std::size_t i = 0; i < INDEX_COLUMN_COUNT; i++) {
+    if (index_roots[i] != 0) {
+      index_build(*this, static_cast<IndexColumn>(i), index_roots[i]);
+    }
+  }
+  return ExecuteResult::SUCCESS;
+}
+
+RowView Cursor::value() {
+  auto &page = snapshot_leaf ? *snapshot_leaf : leaf.page ? *leaf.page : table.pager.get_page(page_num);
+  return read_leaf_cell(table.pager, page, cell_num, scratch, snapshot);
+}
+
+void Cursor::advance() {
+  cell_num++;
+  skip_finished_leaves();
+}
+
+void Cursor::skip_finished_leaves() {
+  // Follow the sibling links past the end of this leaf, skipping any that are empty.
+  while (true) {
+    auto &node = snapshot_leaf ? *snapshot_leaf : leaf.page ? *leaf.page : table.pager.get_page(page_num);
+    if (cell_num < *node.num_cells()) {
+      return;
+    }
+    auto next_page_num = *node.next_leaf();
+    if (next_page_num == 0) {
+      end_of_table = true;
+      leaf.release();
+      return;
+    }
+    if (snapshot_leaf) {
+      snapshot->read_page(next_page_num, *snapshot_leaf);
+    } else if (leaf.latch) {
+      // Latch the sibling before letting go of this leaf so a split can't slip in between.
+      leaf = PageLatch{table.pager, next_page_num, false};
+    }
+    page_num = next_page_num;
+    cell_num = 0;
+    if (leaf.latch) {
+      read_ahead();
+    }
+  }
+}
+
+void Cursor::read_ahead() {
+  auto &pager = table.pager;
+  if (pager.backend != PagerBackend::IO_URING || pager.readahead_leaves == 0) {
+    return;
+  }
+  if (readahead_left > 0) {
+    readahead_left--;
+    return;
+  }
+  auto parent_page_num = *leaf.page->parent();
+  if (parent_page_num == 0) {
+    return;
+  }
+  // The siblings come from the parent. Waiting for its latch while holding a
+  // leaf's could deadlock with the writer coming down, and read-ahead is only
+  // a hint, so a busy parent just means none this time.
+  std::vector<uint32_t> siblings;
+  {
+    PageLatch parent{pager, parent_page_num, std::try_to_lock};
+    if (!parent.latch || parent.page->node_type() != Page::NodeType::INTERNAL) {
+      return;
+    }
+    auto &node = *parent.page;
+    auto num_keys = *node.num_keys();
+    uint32_t child_num = 0;
+    while (child_num <= num_keys && *node.child(child_num) != page_num) {
+      child_num++;
+    }
+    for (auto i = child_num + 1; i <= num_keys && siblings.size() < pager.readahead_leaves; i++) {
+      siblings.push_back(*node.child(i));
+    }
+  }
+  pager.prefetch(siblings.data(), siblings.size());
+  readahead_left = siblings.size();
+}
+
+void print_row(const Row &row, uint8_t columns) {
+  std::string output;
+  format_row(RowView{row.id, row.username.data(), row.email.data()}, columns, output);
+  std::cout.write(output.data(), output.size());
+}
+
+void format_row(const RowView &row, uint8_t columns, std::string &out) {
+  const char *separator = "";
+  out += '(';
+  if (columns & COLUMN_ID) {
+    char digits[10];
+    auto end = std::to_chars(digits, digits + sizeof(digits), row.id).ptr;
+    out.append(digits, end);
+    separator = ", ";
+  }
+  if (columns & COLUMN_USERNAME) {
+    out += separator;
+    out += row.username;
+    separator = ", ";
+  }
+  if (columns & COLUMN_EMAIL) {
+    out += separator;
+    out += row.email;
+  }
+  out += ")\n";
+}
+
+uint32_t serialize_row(const Row &source, char *destination) {
+  auto size = 0U;
+  for (const char *column : {source.username.data(), source.email.data()}) {
+    auto length = static_cast<uint8_t>(strlen(column));
+    destination[size] = static_cast<char>(length);
+    memcpy(destination + size + COLUMN_LENGTH_SIZE, column, length);
+    size += COLUMN_LENGTH_SIZE + length;
+  }
+  return size;
+}
+
+RowView decode_row(uint32_t id, const char *payload) {
+  auto username_length = static_cast<uint8_t>(payload[0]);
+  auto email = payload + COLUMN_LENGTH_SIZE + username_length;
+  auto email_length = static_cast<uint8_t>(email[0]);
+  return RowView{id, {payload + COLUMN_LENGTH_SIZE, username_length}, {email + COLUMN_LENGTH_SIZE, email_length}};
+}
+
+void deserialize_row(const char *source, Row &destination) {
+  auto row = decode_row(destination.id, source);
+  deserialize_columns(row, destination, COLUMN_USERNAME | COLUMN_EMAIL);
+}
+
+void deserialize_row(const RowView &source, Row &destination) {
+  deserialize_columns(source, destination, ALL_COLUMNS);
+}
+
+void deserialize_columns(const RowView &source, Row &destination, uint8_t columns) {
+  if (columns & COLUMN_ID) {
+    destination.id = source.id;
+  }
+  if (columns & COLUMN_USERNAME) {
+    *std::copy(source.username.begin(), source.username.end(), destination.username.begin()) = '\0';
+  }
+  if (columns & COLUMN_EMAIL) {
+    *std::copy(source.email.begin(), source.email.end(), destination.email.begin()) = '\0';
+  }
+}
+
+uint32_t row_payload_size(const Row &row) {
+  return 2 * COLUMN_LENGTH_SIZE + strlen(row.username.data()) + strlen(row.email.data());
+}
+
+uint32_t leaf_cell_size(const Pager &pager, uint32_t payload_size) {
+  if (payload_size > pager.max_local) {
+    return LEAF_NODE_PAYLOAD_SIZE_SIZE + LEAF_NODE_LOCAL_SIZE_SIZE + pager.max_local + LEAF_NODE_OVERFLOW_POINTER_SIZE;
+  }
+  return LEAF_NODE_PAYLOAD_SIZE_SIZE + payload_size;
+}
+
+uint32_t leaf_cell_size(const char *cell) {
+  auto size = *(uint16_t *) cell;
+  if (size & LEAF_NODE_SPILLED) {
+    auto local_size = *(uint16_t *) (cell + LEAF_NODE_PAYLOAD_SIZE_SIZE);
+    return LEAF_NODE_PAYLOAD_SIZE_SIZE + LEAF_NODE_LOCAL_SIZE_SIZE + local_size + LEAF_NODE_OVERFLOW_POINTER_SIZE;
+  }
+  return LEAF_NODE_PAYLOAD_SIZE_SIZE + size;
+}
+
+uint32_t *leaf_cell_overflow_page(const char *cell) {
+  if (!(*(uint16_t *) cell & LEAF_NODE_SPILLED)) {
+    return nullptr;
+  }
+  auto local_size = *(uint16_t *) (cell + LEAF_NODE_PAYLOAD_SIZE_SIZE);
+  return (uint32_t *) (cell + LEAF_NODE_PAYLOAD_SIZE_SIZE + LEAF_NODE_LOCAL_SIZE_SIZE + local_size);
+}
+
+uint32_t build_leaf_cell(Pager &pager, const Row &row, char *cell, std::size_t *next_overflow_page) {
+  char payload[ROW_MAX_PAYLOAD_SIZE];
+  auto payload_size = serialize_row(row, payload);
+  if (payload_size <= pager.max_local) {
+    *(uint16_t *) cell = payload_size;
+    memcpy(cell + LEAF_NODE_PAYLOAD_SIZE_SIZE, payload, payload_size);
+    return leaf_cell_size(cell);
+  }
+
+  auto local_size = pager.max_local;
+  *(uint16_t *) cell = payload_size | LEAF_NODE_SPILLED;
+  *(uint16_t *) (cell + LEAF_NODE_PAYLOAD_SIZE_SIZE) = local_size;
+  memcpy(cell + LEAF_NODE_PAYLOAD_SIZE_SIZE + LEAF_NODE_LOCAL_SIZE_SIZE, payload, local_size);
+  auto *link = leaf_cell_overflow_page(cell);
+  for (auto written = local_size; written < payload_size;) {
+    PinScope scope{pager};
+    auto page_num = next_overflow_page ? (*next_overflow_page)++ : pager.get_unused_page_num();
+    auto &page = pager.get_page(page_num);
+    page.node_type(Page::NodeType::OVERFLOW);
+    auto chunk = std::min(OVERFLOW_PAGE_CAPACITY, payload_size - written);
+    memcpy(page.data.data() + OVERFLOW_HEADER_SIZE, payload + written, chunk);
+    written += chunk;
+    pager.mark_dirty(page_num);
+    *link = page_num;
+    link = page.next_overflow();
+  }
+  return leaf_cell_size(cell);
+}
+
+RowView read_leaf_cell(Pager &pager,
+                       Page &leaf,
+                       uint32_t cell_num,
+                       std::vector<char> &scratch,
+                       const Snapshot *snapshot) {
+  const char *cell = leaf.cell(cell_num);
+  const char *payload = cell + LEAF_NODE_PAYLOAD_SIZE_SIZE;
+  if (auto *overflow_page = leaf_cell_overflow_page(cell)) {
+    uint32_t payload_size = *(uint16_t *) cell & ~LEAF_NODE_SPILLED;
+    uint32_t local_size = *(uint16_t *) payload;
+    scratch.resize(payload_size);
+    memcpy(scratch.data(), payload + LEAF_NODE_LOCAL_SIZE_SIZE, local_size);
+    auto page_num = *overflow_page;
+    std::unique_ptr<Page> copy;
+    for (auto read = local_size; read < payload_size;) {
+      PageLatch overflow;
+      Page *page;
+      if (snapshot) {
+        if (!copy) {
+          copy = std::make_unique<Page>();
+        }
+        snapshot->read_page(page_num, *copy);
+        page = copy.get();
+      } else {
+        overflow = PageLatch{pager, page_num, false};
+        page = overflow.page;
+      }
+      auto chunk = std::min<uint32_t>(OVERFLOW_PAGE_CAPACITY, payload_size - read);
+      memcpy(scratch.data() + read, page->data.data() + OVERFLOW_HEADER_SIZE, chunk);
+      read += chunk;
+      page_num = *page->next_overflow();
+    }
+    payload = scratch.data();
+  }
+  return decode_row(leaf.keys()[cell_num], payload);
+}
+
+void leaf_node_insert_cell(Page &node, uint32_t cell_num, uint32_t key, const char *cell, uint32_t cell_size) {
+  auto num_cells = *node.num_cells();
+  auto *keys = node.keys();
+  auto *slots = (char *) node.slots();
+  // The key array grows by one, so every slot moves up a key's width and the
+  // ones after cell_num by a slot's width more. Move the highest bytes first.
+  memmove(slots + LEAF_NODE_KEY_SIZE + (cell_num + 1) * LEAF_NODE_SLOT_SIZE,
+          slots + cell_num * LEAF_NODE_SLOT_SIZE,
+          (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+  memmove(slots + LEAF_NODE_KEY_SIZE, slots, cell_num * LEAF_NODE_SLOT_SIZE);
+  memmove(keys + cell_num + 1, keys + cell_num, (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+
+  *node.cell_content_start() -= cell_size;
+  memcpy(node.data.data() + *node.cell_content_start(), cell, cell_size);
+  keys[cell_num] = key;
+  *node.num_cells() = num_cells + 1;
+  node.slots()[cell_num] = *node.cell_content_start();
+}
+
+void leaf_node_merge_cells(Page &node,
+                           const uint32_t *keys,
+                           const char *cells,
+                           const uint16_t *cell_sizes,
+                           uint32_t count) {
+  const uint32_t MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE);
+  uint16_t old_slots[MAX_CELLS];
+  uint16_t new_slots[MAX_CELLS];
+  auto num_cells = *node.num_cells();
+  memcpy(old_slots, node.slots(), num_cells * LEAF_NODE_SLOT_SIZE);
+  for (uint32_t i = 0; i < count; i++) {
+    *node.cell_content_start() -= cell_sizes[i];
+    memcpy(node.data.data() + *node.cell_content_start(), cells, cell_sizes[i]);
+    new_slots[i] = *node.cell_content_start();
+    cells += cell_sizes[i];
+  }
+
+  // Fill the grown key array from the back, an old key is always read before
+  // its position can be overwritten. The slot array moves past the new keys,
+  // old slots were saved above because the keys grow over them.
+  *node.num_cells() = num_cells + count;
+  auto *node_keys = node.keys();
+  auto *slots = node.slots();
+  for (uint32_t i = num_cells, j = count, k = num_cells + count; k > 0; k--) {
+    if (j > 0 && (i == 0 || keys[j - 1] > node_keys[i - 1])) {
+      node_keys[k - 1] = keys[j - 1];
+      slots[k - 1] = new_slots[--j];
+    } else {
+      node_keys[k - 1] = node_keys[i - 1];
+      slots[k - 1] = old_slots[--i];
+    }
+  }
+}
+
+bool Predicate::matches(const RowView &row) const {
+  if (op == Op::PREFIX) {
+    auto value = column == Column::USERNAME ? row.username : row.email;
+    return value.substr(0, text_value.size()) == text_value;
+  }
+  int comparison;
+  switch (column) {
+    case Column::ID:
+      comparison = row.id < id_value ? -1 : row.id > id_value;
+      break;
+    case Column::USERNAME:
+      comparison = row.username.compare(text_value);
+      break;
+    case Column::EMAIL:
+      comparison = row.email.compare(text_value);
+      break;
+  }
+  switch (op) {
+    case Op::EQ:
+      return comparison == 0;
+    case Op::NE:
+      return comparison != 0;
+    case Op::LT:
+      return comparison < 0;
+    case Op::LE:
+      return comparison <= 0;
+    case Op::GT:
+      return comparison > 0;
+    case Op::GE:
+      return comparison >= 0;
+    case Op::PREFIX:
+      break;
+  }
+  return false;
+}
+
+bool Statement::matches(const RowView &row) const {
+  return std::all_of(predicates.begin(), predicates.end(),
+                     [row](const Predicate &predicate) { return predicate.matches(row); });
+}
+
+Cursor table_start(Table &table) {
+  return table_seek(table, 0);
+}
+
+Cursor table_seek(Table &table, uint32_t key) {
+  auto cursor = table_find(table, key);
+  // table_find may land one past the last cell when the key belongs after this leaf.
+  cursor.skip_finished_leaves();
+  return cursor;
+}
+
+Cursor table_find(Table &table, uint32_t key) {
+  PageLatch latch{table.pager, table.root_page_num, false};
+  while (true) {
+    auto &node = *latch.page;
+    if (node.node_type() == Page::NodeType::LEAF) {
+      auto cursor = leaf_node_find(table, latch.page_num, key);
+      cursor.leaf = std::move(latch);
+      return cursor;
+    }
+    auto child_page_num = *node.child(internal_node_find_child(node, key));
+    latch = PageLatch{table.pager, child_page_num, false};
+  }
+}
+
+Cursor table_find(const Snapshot &snapshot, uint32_t key) {
+  auto node = std::make_unique<Page>();
+  auto page_num = snapshot.table.root_page_num;
+  while (true) {
+    snapshot.read_page(page_num, *node);
+    if (node->node_type() == Page::NodeType::LEAF) {
+      Cursor cursor{snapshot.table, page_num};
+      cursor.cell_num = node_lower_bound(node->keys(), *node->num_cells(), key);
+      cursor.snapshot = &snapshot;
+      cursor.snapshot_leaf = std::move(node);
+      return cursor;
+    }
+    page_num = *node->child(internal_node_find_child(*node, key));
+  }
+}
+
+Cursor table_seek(const Snapshot &snapshot, uint32_t key) {
+  auto cursor = table_find(snapshot, key);
+  cursor.skip_finished_leaves();
+  return cursor;
+}
+
+uint64_t table_rank(Table &table, uint32_t key) {
+  uint64_t rank = 0;
+  PageLatch latch{table.pager, table.root_page_num, false};
+  while (true) {
+    auto &node = *latch.page;
+    if (node.node_type() == Page::NodeType::LEAF) {
+      return rank + node_lower_bound(node.keys(), *node.num_cells(), key);
+    }
+    auto child_num = internal_node_find_child(node, key);
+    for (uint32_t i = 0; i < child_num; i++) {
+      rank += *node.child_count(i);
+    }
+    latch = PageLatch{table.pager, *node.child(child_num), false};
+  }
+}
+
+uint64_t table_row_count(Table &table) {
+  PageLatch root{table.pager, table.root_page_num, false};
+  return root.page->row_count();
+}
+
+Cursor table_seek_position(Table &table, uint64_t position) {
+  PageLatch latch{table.pager, table.root_page_num, false};
+  while (true) {
+    auto &node = *latch.page;
+    if (node.node_type() == Page::NodeType::LEAF) {
+      Cursor cursor{table, latch.page_num};
+      cursor.cell_num = std::min<uint64_t>(position, *node.num_cells());
+      cursor.leaf = std::move(latch);
+      cursor.skip_finished_leaves();
+      return cursor;
+    }
+    uint32_t child_num = 0;
+    while (child_num < *node.num_keys() && position >= *node.child_count(child_num)) {
+      position -= *node.child_count(child_num);
+      child_num++;
+    }
+    latch = PageLatch{table.pager, *node.child(child_num), false};
+  }
+}
+
+std::optional<Cursor> table_lookup(Table &table, uint32_t key) {
+  auto &pager = table.pager;
+  PageLatch latch{pager, table.root_page_num, false};
+  while (true) {
+    auto &node = *latch.page;
+    if (node.node_type() == Page::NodeType::LEAF) {
+      auto num_cells = *node.num_cells();
+      auto cell_num = node_lower_bound(node.keys(), num_cells, key);
+      if (!node.is_root()) {
+        pager.build_filter(latch);
+      }
+      if (cell_num >= num_cells || *node.key(cell_num) != key) {
+        return std::nullopt;
+      }
+      Cursor cursor{table, latch.page_num};
+      cursor.cell_num = cell_num;
+      cursor.leaf = std::move(latch);
+      return cursor;
+    }
+    // Only leaves have filters, so one for the child means it is a leaf.
+    auto child_page_num = *node.child(internal_node_find_child(node, key));
+    if (pager.filter_excludes(child_page_num, key)) {
+      metric_add(pager.stats.filter_skips);
+      return std::nullopt;
+    }
+    latch = PageLatch{pager, child_page_num, false};
+  }
+}
+
+Cursor table_find_for_write(Table &table, uint32_t key, std::vector<PageLatch> &path, int32_t rows_added) {
+  // Exclusive latch crabbing: ancestors stay latched only while a split of
+  // the node below could still reach them.
+  auto page_num = table.root_page_num;
+  while (true) {
+    path.emplace_back(table.pager, page_num, true);
+    auto &node = *path.back().page;
+    auto is_leaf = node.node_type() == Page::NodeType::LEAF;
+    auto safe = is_leaf ? node.free_space() >= LEAF_NODE_MAX_CELL_SPACE : *node.num_keys() < INTERNAL_NODE_MAX_KEYS;
+    if (safe) {
+      path.erase(path.begin(), path.end() - 1);
+    }
+    if (is_leaf) {
+      return leaf_node_find(table, page_num, key);
+    }
+    auto child_num = internal_node_find_child(node, key);
+    if (rows_added != 0) {
+      // Counted on the way down, the node may be let go of before the leaf changes.
+      *node.child_count(child_num) += rows_added;
+      table.pager.mark_dirty(page_num);
+    }
+    page_num = *node.child(child_num);
+  }
+}
+
+uint32_t internal_node_find_child(Page &node, uint32_t key) {
+  // Index of the first key >= the one we want, or num_keys for the right child.
+  return node_lower_bound(node.keys(), *node.num_keys(), key);
+}
+
+uint32_t get_node_max_key(Pager &pager, std::size_t page_num) {
+  // Internal nodes don't store a key for their right child, follow it down to a leaf.
+  while (true) {
+    auto &node = pager.get_page(page_num);
+    if (node.node_type() == Page::NodeType::LEAF) {
+      return node.max_key();
+    }
+    page_num = *node.right_child();
+  }
+}
+
+uint32_t tree_depth(Table &table) {
+  uint32_t depth = 1;
+  auto page_num = table.root_page_num;
+  while (true) {
+    auto &node = table.pager.get_page(page_num);
+    if (node.node_type() == Page::NodeType::LEAF) {
+      return depth;
+    }
+    page_num = *node.right_child();
+    depth++;
+  }
+}
+
+Cursor leaf_node_find(Table &table, std::size_t page_num, uint32_t key) {
+  PinScope scope{table.pager};
+  auto &node = table.pager.get_page(page_num);
+  auto num_cells = *node.num_cells();
+
+  Cursor cursor{table, page_num};
+
+  // Either the cell holding key or the position it would be inserted at.
+  cursor.cell_num = node_lower_bound(node.keys(), num_cells, key);
+  return cursor;
+}
+
+Page::Page(NodeType type)
+    : data() {
+  node_type(type);
+};
+
+Page::NodeType Page::node_type() {
+  uint8_t value = *(uint8_t *) (data.data() + NODE_TYPE_OFFSET);
+  return static_cast<NodeType>(value);
+}
+
+void Page::node_type(NodeType type) {
+  root(false);
+  *parent() = 0;
+  switch (type) {
+    case NodeType::LEAF:
+    case NodeType::INDEX_LEAF:
+    case NodeType::INDEX_INTERNAL:
+      *num_cells() = 0;
+      *next_leaf() = 0; // or an index node's right child, 0 means none as page 0 is the header
+      *cell_content_start() = PAGE_SIZE;
+      break;
+    case NodeType::INTERNAL:
+      *num_keys() = 0;
+      *right_child() = 0;
+      break;
+    case NodeType::OVERFLOW:
+      *next_overflow() = 0;
+      break;
+    case NodeType::HEADER:
+      std::fill_n(index_roots(), INDEX_COLUMN_COUNT, 0);
+      *freelist_trunk() = 0;
+      *freelist_count() = 0;
+      break;
+    case NodeType::FREELIST_TRUNK:
+      *trunk_next() = 0;
+      *trunk_num_pages() = 0;
+      break;
+  }
+  *(uint8_t *) (data.data() + NODE_TYPE_OFFSET) = static_cast<uint8_t>(type);
+}
+
+uint32_t *Page::num_keys() {
+  return (uint32_t *) (data.data() + INTERNAL_NODE_NUM_KEYS_OFFSET);
+}
+
+uint32_t *Page::num_cells() {
+  return (uint32_t *) (data.data() + LEAF_NODE_NUM_CELLS_OFFSET);
+}
+
+uint32_t *Page::next_leaf() {
+  return (uint32_t *) (data.data() + LEAF_NODE_NEXT_LEAF_OFFSET);
+}
+
+uint32_t *Page::right_child() {
+  return (uint32_t *) (data.data() + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+}
+
+uint16_t *Page::cell_content_start() {
+  return (uint16_t *) (data.data() + LEAF_NODE_CELL_CONTENT_OFFSET);
+}
+
+uint32_t *Page::keys() {
+  return (uint32_t *) (data.data() + NODE_KEYS_OFFSET);
+}
+
+uint16_t *Page::slots() {
+  return (uint16_t *) (keys() + *num_cells());
+}
+
+char *Page::cell(std::size_t cell_num) {
+  return data.data() + slots()[cell_num];
+}
+
+uint32_t Page::free_space() {
+  auto used = NODE_KEYS_OFFSET + *num_cells() * (LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE);
+  return *cell_content_start() - used;
+}
+
+uint32_t *Page::next_overflow() {
+  return (uint32_t *) (data.data() + OVERFLOW_NEXT_PAGE_OFFSET);
+}
+
+uint32_t *Page::index_roots() {
+  return (uint32_t *) (data.data() + HEADER_INDEX_ROOTS_OFFSET);
+}
+
+uint32_t *Page::freelist_trunk() {
+  return (uint32_t *) (data.data() + HEADER_FREELIST_TRUNK_OFFSET);
+}
+
+uint32_t *Page::freelist_count() {
+  return (uint32_t *) (data.data() + HEADER_FREELIST_COUNT_OFFSET);
+}
+
+uint32_t *Page::trunk_next() {
+  return (uint32_t *) (data.data() + FREELIST_TRUNK_NEXT_OFFSET);
+}
+
+uint32_t *Page::trunk_num_pages() {
+  return (uint32_t *) (data.data() + FREELIST_TRUNK_NUM_PAGES_OFFSET);
+}
+
+uint32_t *Page::trunk_pages() {
+  return (uint32_t *) (data.data() + FREELIST_TRUNK_PAGES_OFFSET);
+}
+
+uint32_t *Page::child(uint32_t child_num) {
+  if (child_num > *num_keys()) {
+    std::cerr << "Tried to access child_num " << child_num << " > num_keys " << *num_keys() << '\n';
+    exit(EXIT_FAILURE);
+  } else if (child_num == *num_keys()) {
+    return right_child();
+  } else {
+    return (uint32_t *) (data.data() + INTERNAL_NODE_CHILDREN_OFFSET) + child_num;
+  }
+}
+
+uint32_t *Page::child_count(uint32_t child_num) {
+  if (child_num > *num_keys()) {
+    std::cerr << "Tried to access child_num " << child_num << " > num_keys " << *num_keys() << '\n';
+    exit(EXIT_FAILURE);
+  } else if (child_num == *num_keys()) {
+    return (uint32_t *) (data.data() + INTERNAL_NODE_RIGHT_COUNT_OFFSET);
+  } else {
+    return (uint32_t *) (data.data() + INTERNAL_NODE_COUNTS_OFFSET) + child_num;
+  }
+}
+
+uint64_t Page::row_count() {
+  if (node_type() == NodeType::LEAF) {
+    return *num_cells();
+  }
+  auto *counts = (uint32_t *) (data.data() + INTERNAL_NODE_COUNTS_OFFSET);
+  return std::accumulate(counts, counts + *num_keys(), uint64_t{*child_count(*num_keys())});
+}
+
+uint32_t *Page::key(std::size_t key_num) {
+  return keys() + key_num;
+}
+
+uint32_t Page::max_key() {
+  switch (node_type()) {
+    case Page::NodeType::INTERNAL:
+      return *key(*num_keys() - 1);
+    case Page::NodeType::LEAF:
+      return *key(*num_cells() - 1);
+    case Page::NodeType::INDEX_LEAF:
+    case Page::NodeType::INDEX_INTERNAL:
+      // Ordered by (value, id), the largest entry is index_cell_entry of the last cell.
+      std::cerr << "Index nodes have no integer max key.\n";
+      exit(EXIT_FAILURE);
+    case Page::NodeType::OVERFLOW:
+    case Page::NodeType::HEADER:
+    case Page::NodeType::FREELIST_TRUNK:
+      break;
+  }
+  std::cerr << "No max key for node type " << static_cast<int>(node_type()) << ".\n";
+  exit(EXIT_FAILURE);
+}
+
+bool Page::is_root() {
+  uint8_t value = *(uint8_t *) (data.data() + IS_ROOT_OFFSET);
+  return (bool) value;
+}
+
+void Page::root(bool is_root) {
+  uint8_t value = is_root;
+  *(uint8_t *) (data.data() + IS_ROOT_OFFSET) = value;
+}
+
+uint32_t *Page::parent() {
+  return (uint32_t *) (data.data() + PARENT_POINTER_OFFSET);
+}
+
+void db_close(Table &table) {
+  table.pager.flush_all();
+  table.pager.close();
+}
+
+uint32_t page_checksum(const char *data) {
+  auto crc = crc32c(data, PAGE_CHECKSUM_OFFSET);
+  auto rest = PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE;
+  return crc32c(data + rest, PAGE_SIZE - rest, crc);
+}
+
+void stamp_page_checksum(char *data) {
+  *(uint32_t *) (data + PAGE_CHECKSUM_OFFSET) = page_checksum(data);
+}
+
+bool page_checksum_valid(const char *data) {
+  auto stored = *(const uint32_t *) (data + PAGE_CHECKSUM_OFFSET);
+  if (stored == page_checksum(data)) {
+    return true;
+  }
+  // Never written through the pager: a hole in the file or the zeroed tail of a short read.
+  return stored == 0 && std::all_of(data, data + PAGE_SIZE, [](char c) { return c == 0; });
+}
+
+std::vector<std::size_t> check_pages(Table &table, std::size_t num_threads) {
+  std::lock_guard<std::mutex> writer{table.writer_mutex};
+  auto &pager = table.pager;
+  // The file is what gets checked, so everything cached or logged goes there first.
+  pager.checkpoint();
+  pager.flush_all();
+  auto fd = ::open(pager.filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Unable to open file.\n";
+    exit(EXIT_FAILURE);
+  }
+  std::size_t num_pages = pager.num_pages;
+  if (num_threads == 0) {
+    num_threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  num_threads = std::max<std::size_t>(1, std::min(num_threads, num_pages / PARALLEL_SCAN_MORSEL_LEAVES));
+
+  // Each worker reads a contiguous stretch of the file.
+  std::vector<std::vector<std::size_t>> corrupt(num_threads);
+  auto worker = [&](std::size_t worker_index) {
+    std::array<char, PAGE_SIZE> data{};
+    auto begin = num_pages * worker_index / num_threads;
+    auto end = num_pages * (worker_index + 1) / num_threads;
+    for (auto page_num = begin; page_num < end; page_num++) {
+      data.fill(0);
+      if (pread(fd, data.data(), PAGE_SIZE, page_num * PAGE_SIZE) < 0 || !page_checksum_valid(data.data())) {
+        corrupt[worker_index].push_back(page_num);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (std::size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ::close(fd);
+
+  std::vector<std::size_t> result;
+  for (auto &pages : corrupt) {
+    result.insert(result.end(), pages.begin(), pages.end());
+  }
+  return result;
+}
+
+// Replaces every page number stored in a page by new_page_nums[page_num].
+// Returns whether any changed.
+bool node_remap_pages(Page &node, const std::vector<uint32_t> &new_page_nums) {
+  auto changed = false;
+  auto remap = [&](uint32_t *page_num) {
+    changed |= new_page_nums[*page_num] != *page_num;
+    *page_num = new_page_nums[*page_num];
+  };
+  switch (node.node_type()) {
+    case Page::NodeType::HEADER:
+      for (std::size_t i = 0; i < INDEX_COLUMN_COUNT; i++) {
+        remap(node.index_roots() + i);
+      }
+      break;
+    case Page::NodeType::INTERNAL:
+      remap(node.parent());
+      for (uint32_t i = 0; i < *node.num_keys(); i++) {
+        remap(node.child(i));
+      }
+      remap(node.right_child());
+      break;
+    case Page::NodeType::LEAF:
+      remap(node.parent());
+      remap(node.next_leaf());
+      for (uint32_t i = 0; i < *node.num_cells(); i++) {
+        if (auto *overflow_page = leaf_cell_overflow_page(node.cell(i))) {
+          remap(overflow_page);
+        }
+      }
+      break;
+    case Page::NodeType::OVERFLOW:
+      remap(node.next_overflow());
+      break;
+    case Page::NodeType::INDEX_LEAF:
+    case Page::NodeType::INDEX_INTERNAL:
+      changed = index_node_remap_pages(node, new_page_nums);
+      break;
+    case Page::NodeType::FREELIST_TRUNK:
+      break;
+  }
+  return changed;
+}
+
+void vacuum(Table &table) {
+  WriteScope writer{table};
+  auto &pager = table.pager;
+  std::size_t num_pages = pager.num_pages;
+  std::vector<bool> is_free(num_pages);
+  uint32_t trunk_page_num;
+  {
+    PinScope scope{pager};
+    trunk_page_num = *pager.get_page(HEADER_PAGE_NUM).freelist_trunk();
+  }
+  while (trunk_page_num != 0) {
+    PinScope scope{pager};
+    auto &trunk = pager.get_page(trunk_page_num);
+    is_free[trunk_page_num] = true;
+    for (uint32_t i = 0; i < *trunk.trunk_num_pages(); i++) {
+      is_free[trunk.trunk_pages()[i]] = true;
+    }
+    trunk_page_num = *trunk.trunk_next();
+  }
+
+  // Pages in use past the end of the compacted file take the free pages before it.
+  auto page_count = std::count(is_free.begin(), is_free.end(), false);
+  std::vector<uint32_t> new_page_nums(num_pages);
+  std::iota(new_page_nums.begin(), new_page_nums.end(), 0);
+  std::size_t hole = 0;
+  for (std::size_t page_num = page_count; page_num < num_pages; page_num++) {
+    if (is_free[page_num]) {
+      continue;
+    }
+    while (!is_free[hole]) {
+      hole++;
+    }
+    new_page_nums[page_num] = hole++;
+  }
+
+  for (std::size_t page_num = 0; page_num < num_pages; page_num++) {
+    if (is_free[page_num]) {
+      continue;
+    }
+    PinScope scope{pager};
+    auto &page = pager.get_page(page_num);
+    auto changed = node_remap_pages(page, new_page_nums);
+    if (new_page_nums[page_num] != page_num) {
+      auto &destination = pager.get_page(new_page_nums[page_num]);
+      destination.data = page.data;
+      pager.mark_dirty(new_page_nums[page_num]);
+    } else if (changed) {
+      pager.mark_dirty(page_num);
+    }
+  }
+
+  {
+    PinScope scope{pager};
+    auto &header = pager.get_page(HEADER_PAGE_NUM);
+    *header.freelist_trunk() = 0;
+    *header.freelist_count() = 0;
+    pager.mark_dirty(HEADER_PAGE_NUM);
+    for (std::size_t i = 0; i < INDEX_COLUMN_COUNT; i++) {
+      table.index_roots[i] = header.index_roots()[i];
+    }
+  }
+  pager.commit();
+  pager.truncate(page_count);
+}
+
+MetaCommandResult do_meta_command(const std::string &command, Table &table) {
+  if (command == ".exit") {
+    db_close(table);
+    exit(EXIT_SUCCESS);
+  } else if (command == ".btree") {
+    std::cout << "Tree:\n";
+    table.pager.print_tree(table.root_page_num, 0);
+    return MetaCommandResult::SUCCESS;
+  } else if (command == ".vacuum") {
+    vacuum(table);
+    return MetaCommandResult::SUCCESS;
+  } else if (command == ".stats") {
+    print_metrics(collect_metrics(table));
+    return MetaCommandResult::SUCCESS;
+  } else if (command == ".check") {
+    auto corrupt = check_pages(table);
+    for (auto page_num : corrupt) {
+      std::cout << "Page " << page_num << ": checksum mismatch\n";
+    }
+    std::cout << "Checked " << table.pager.num_pages << " pages, " << corrupt.size() << " corrupt.\n";
+    return MetaCommandResult::SUCCESS;
+  } else if (command == ".constants") {
+    std::cout << "Constants:\n";
+    print_constants();
+    return MetaCommandResult::SUCCESS;
+  } else {
+    return MetaCommandResult::UNRECOGNIZED_COMMAND;
+  }
+}
+
+// Splits str at any of the delimiters into tokens pointing into str. Reuses
+// the storage tokens already has.
+void tokenize(std::string_view str, std::string_view delimiters, std::vector<std::string_view> &tokens) {
+  tokens.clear();
+  auto last_pos = str.find_first_not_of(delimiters);
+  while (last_pos != std::string_view::npos) {
+    auto pos = str.find_first_of(delimiters, last_pos);
+    tokens.push_back(str.substr(last_pos, pos - last_pos));
+    last_pos = str.find_first_not_of(delimiters, pos);
+  }
+}
+
+void leaf_node_insert(Cursor &cursor, uint32_t key, const Row &value) {
+  PinScope scope{cursor.table.pager};
+  auto &pager = cursor.table.pager;
+  char cell[LEAF_NODE_MAX_CELL_SIZE];
+  auto cell_size = build_leaf_cell(pager, value, cell);
+
+  auto &node = pager.get_page(cursor.page_num);
+  if (node.free_space() < LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE + cell_size) {
+    leaf_node_split_and_insert(cursor, key, cell, cell_size);
+    return;
+  }
+  leaf_node_insert_cell(node, cursor.cell_num, key, cell, cell_size);
+  pager.mark_dirty(cursor.page_num);
+}
+
+void create_new_root(Table &table, std::size_t right_child_page_num) {
+  PinScope scope{table.pager};
+  metric_add(table.stats.root_splits);
+  auto &pager = table.pager;
+  auto &root = pager.get_page(table.root_page_num);
+  auto &right_child = pager.get_page(right_child_page_num);
+  auto left_child_page_num = pager.get_unused_page_num();
+  auto &left_child = pager.get_page(left_child_page_num);
+
+  // The root keeps its page number, so its old contents move to a new left child.
+  memcpy(left_child.data.data(), root.data.data(), PAGE_SIZE);
+  left_child.root(false);
+  if (left_child.node_type() == Page::NodeType::INTERNAL) {
+    for (uint32_t i = 0; i <= *left_child.num_keys(); i++) {
+      PinScope child_scope{pager};
+      auto child_page_num = *left_child.child(i);
+      *pager.get_page(child_page_num).parent() = left_child_page_num;
+      pager.mark_dirty(child_page_num);
+    }
+  }
+
+  root.node_type(Page::NodeType::INTERNAL);
+  root.root(true);
+  *root.num_keys() = 1;
+  *root.child(0) = left_child_page_num;
+  *root.key(0) = get_node_max_key(pager, left_child_page_num);
+  *root.child_count(0) = left_child.row_count();
+  *root.right_child() = right_child_page_num;
+  *root.child_count(1) = right_child.row_count();
+  *left_child.parent() = table.root_page_num;
+  *right_child.parent() = table.root_page_num;
+
+  pager.mark_dirty(table.root_page_num);
+  pager.mark_dirty(left_child_page_num);
+  pager.mark_dirty(right_child_page_num);
+}
+
+// After page_num split off new_page_num, fix the separator that pointed at
+// page_num and hang the new sibling off the same parent.
+void update_parent_after_split(Table &table, std::size_t page_num, uint32_t old_max, std::size_t new_page_num) {
+  PinScope scope{table.pager};
+  auto &pager = table.pager;
+  auto &old_node = pager.get_page(page_num);
+  if (old_node.is_root()) {
+    create_new_root(table, new_page_num);
+    return;
+  }
+
+  auto parent_page_num = *old_node.parent();
+  auto &parent = pager.get_page(parent_page_num);
+  auto index = internal_node_find_child(parent, old_max);
+  if (index < *parent.num_keys()) {
+    *parent.key(index) = get_node_max_key(pager, page_num);
+  }
+  // The parent already counts the rows of both halves under page_num.
+  *parent.child_count(index) = old_node.row_count();
+  pager.mark_dirty(parent_page_num);
+  internal_node_insert(table, parent_page_num, new_page_num);
+}
+
+void leaf_node_split_and_insert(const Cursor &cursor, uint32_t key, const char *cell, uint32_t cell_size) {
+  uint16_t size = cell_size;
+  leaf_node_split_and_merge(cursor.table, cursor.page_num, &key, cell, &size, 1);
+}
+
+void leaf_node_split_and_merge(Table &table,
+                               std::size_t page_num,
+                               const uint32_t *keys,
+                               const char *new_cells,
+                               const uint16_t *cell_sizes,
+                               uint32_t count) {
+  PinScope scope{table.pager};
+  metric_add(table.stats.leaf_splits);
+  auto &pager = table.pager;
+  auto &old_node = pager.get_page(page_num);
+  auto old_max = old_node.max_key();
+  auto num_cells = *old_node.num_cells();
+
+  // Take every cell out, the new ones included, and split them by bytes so
+  // both halves end up with about the same free space.
+  std::vector<std::pair<uint32_t, std::string>> cells;
+  cells.reserve(num_cells + count);
+  std::size_t total_space = 0;
+  for (uint32_t i = 0, j = 0; i < num_cells || j < count;) {
+    if (j < count && (i == num_cells || keys[j] < *old_node.key(i))) {
+      cells.emplace_back(keys[j], std::string(new_cells, cell_sizes[j]));
+      new_cells += cell_sizes[j++];
+    } else {
+      auto *old_cell = old_node.cell(i);
+      cells.emplace_back(*old_node.key(i), std::string(old_cell, leaf_cell_size(old_cell)));
+      i++;
+    }
+    total_space += LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE + cells.back().second.size();
+  }
+  std::size_t left_count = 0;
+  for (std::size_t left_space = 0; left_count + 1 < cells.size() && left_space < total_space / 2; left_count++) {
+    left_space += LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE + cells[left_count].second.size();
+  }
+
+  auto new_page_num = pager.get_unused_page_num();
+  auto &new_node = pager.get_page(new_page_num);
+  new_node.node_type(Page::NodeType::LEAF);
+  *new_node.parent() = *old_node.parent();
+  *new_node.next_leaf() = *old_node.next_leaf();
+
+  auto is_root = old_node.is_root();
+  auto parent = *old_node.parent();
+  old_node.node_type(Page::NodeType::LEAF);
+  old_node.root(is_root);
+  *old_node.parent() = parent;
+  *old_node.next_leaf() = new_page_num;
+
+  for (std::size_t i = 0; i < cells.size(); i++) {
+    auto &node = i < left_count ? old_node : new_node;
+    auto &entry = cells[i];
+    leaf_node_insert_cell(node, *node.num_cells(), entry.first, entry.second.data(), entry.second.size());
+  }
+  pager.mark_dirty(page_num);
+  pager.mark_dirty(new_page_num);
+
+  update_parent_after_split(table, page_num, old_max, new_page_num);
+}
+
+void internal_node_insert(Table &table, std::size_t parent_page_num, std::size_t child_page_num) {
+  PinScope scope{table.pager};
+  auto &pager = table.pager;
+  auto &parent = pager.get_page(parent_page_num);
+  auto num_keys = *parent.num_keys();
+  if (num_keys >= INTERNAL_NODE_MAX_KEYS) {
+    internal_node_split_and_insert(table, parent_page_num, child_page_num);
+    return;
+  }
+
+  auto child_max_key = get_node_max_key(pager, child_page_num);
+  auto index = internal_node_find_child(parent, child_max_key);
+  auto right_child_page_num = *parent.right_child();
+  auto right_child_count = *parent.child_count(num_keys);
+  auto &child = pager.get_page(child_page_num);
+  *child.parent() = parent_page_num;
+  pager.mark_dirty(child_page_num);
+
+  *parent.num_keys() = num_keys + 1;
+  if (child_max_key > get_node_max_key(pager, right_child_page_num)) {
+    // New child becomes the right child, the old one moves into the last cell.
+    *parent.child(num_keys) = right_child_page_num;
+    *parent.key(num_keys) = get_node_max_key(pager, right_child_page_num);
+    *parent.child_count(num_keys) = right_child_count;
+    *parent.right_child() = child_page_num;
+    *parent.child_count(num_keys + 1) = child.row_count();
+  } else {
+    memmove(parent.key(index + 1), parent.key(index), (num_keys - index) * INTERNAL_NODE_KEY_SIZE);
+    memmove(parent.child(index) + 1, parent.child(index), (num_keys - index) * INTERNAL_NODE_CHILD_SIZE);
+    memmove(parent.child_count(index) + 1, parent.child_count(index), (num_keys - index) * INTERNAL_NODE_COUNT_SIZE);
+    *parent.child(index) = child_page_num;
+    *parent.key(index) = child_max_key;
+    *parent.child_count(index) = child.row_count();
+  }
+  pager.mark_dirty(parent_page_num);
+}
+
+void internal_node_split_and_insert(Table &table, std::size_t page_num, std::size_t child_page_num) {
+  metric_add(table.stats.internal_splits);
+  PinScope scope{table.pager};
+  auto &pager = table.pager;
+  auto &old_node = pager.get_page(page_num);
+  auto old_max = get_node_max_key(pager, page_num);
+  auto child_max_key = get_node_max_key(pager, child_page_num);
+
+  // Lay out every child of the overfull node in key order, then deal them out to both halves.
+  std::vector<std::pair<uint32_t, uint32_t>> children; // (page_num, max key)
+  children.reserve(INTERNAL_NODE_MAX_KEYS + 2);
+  for (uint32_t i = 0; i < *old_node.num_keys(); i++) {
+    children.emplace_back(*old_node.child(i), *old_node.key(i));
+  }
+  children.emplace_back(*old_node.right_child(), old_max);
+  auto position = std::lower_bound(children.begin(), children.end(), child_max_key,
+                                   [](const std::pair<uint32_t, uint32_t> &entry, uint32_t key) {
+                                     return entry.second < key;
+                                   });
+  children.emplace(position, static_cast<uint32_t>(child_page_num), child_max_key);
+
+  auto new_page_num = pager.get_unused_page_num();
+  auto &new_node = pager.get_page(new_page_num);
+  new_node.node_type(Page::NodeType::INTERNAL);
+  *new_node.parent() = *old_node.parent();
+
+  auto left_count = (children.size() + 1) / 2;
+  internal_node_fill(pager, old_node, page_num, children, 0, left_count);
+  internal_node_fill(pager, new_node, new_page_num, children, left_count, children.size());
+
+  update_parent_after_split(table, page_num, old_max, new_page_num);
+}
+
+void leaf_node_remove_cell(Page &node, uint32_t cell_num) {
+  auto num_cells = *node.num_cells();
+  auto offset = node.slots()[cell_num];
+  auto cell_size = leaf_cell_size(node.cell(cell_num));
+  auto content_start = *node.cell_content_start();
+  // Close the gap right away so free_space stays exact: the cells stored
+  // below the removed one move up by its size.
+  memmove(node.data.data() + content_start + cell_size, node.data.data() + content_start, offset - content_start);
+  auto *slots = node.slots();
+  for (uint32_t i = 0; i < num_cells; i++) {
+    if (slots[i] < offset) {
+      slots[i] += cell_size;
+    }
+  }
+  *node.cell_content_start() = content_start + cell_size;
+
+  // The key array shrinks by one, so the slots before cell_num move down a
+  // key's width and the ones after it a slot's width more.
+  auto *keys = node.keys();
+  memmove(keys + cell_num, keys + cell_num + 1, (num_cells - cell_num - 1) * LEAF_NODE_KEY_SIZE);
+  auto *new_slots = (char *) (keys + num_cells - 1);
+  memmove(new_slots, slots, cell_num * LEAF_NODE_SLOT_SIZE);
+  memmove(new_slots + cell_num * LEAF_NODE_SLOT_SIZE,
+          slots + cell_num + 1,
+          (num_cells - cell_num - 1) * LEAF_NODE_SLOT_SIZE);
+  *node.num_cells() = num_cells - 1;
+}
+
+void free_overflow_chain(Pager &pager, const char *cell) {
+  auto *overflow_page = leaf_cell_overflow_page(cell);
+  if (!overflow_page) {
+    return;
+  }
+  auto page_num = *overflow_page;
+  while (page_num != 0) {
+    uint32_t next_page_num;
+    {
+      PinScope scope{pager};
+      next_page_num = *pager.get_page(page_num).next_overflow();
+    }
+    pager.free_page(page_num);
+    page_num = next_page_num;
+  }
+}
+
+uint32_t leaf_node_used_space(Page &node) {
+  return LEAF_NODE_SPACE_FOR_CELLS - node.free_space();
+}
+
+void internal_node_fill(Pager &pager,
+                        Page &node,
+                        std::size_t node_page_num,
+                        const std::vector<std::pair<uint32_t, uint32_t>> &children,
+                        std::size_t begin,
+                        std::size_t end) {
+  *node.num_keys() = end - begin - 1;
+  for (auto i = begin; i < end; i++) {
+    if (i + 1 < end) {
+      *node.child(i - begin) = children[i].first;
+      *node.key(i - begin) = children[i].second;
+    } else {
+      *node.right_child() = children[i].first;
+    }
+    PinScope child_scope{pager};
+    auto &child = pager.get_page(children[i].first);
+    *child.parent() = node_page_num;
+    *node.child_count(i - begin) = child.row_count();
+    pager.mark_dirty(children[i].first);
+  }
+  pager.mark_dirty(node_page_num);
+}
+
+// Moves every cell of right into left if they fit and returns true, or
+// spreads the cells of both evenly by bytes and returns false.
+bool leaf_node_rebalance(Page &left, Page &right) {
+  auto left_used = leaf_node_used_space(left);
+  auto right_used = leaf_node_used_space(right);
+  if (left_used + right_used <= LEAF_NODE_SPACE_FOR_CELLS) {
+    for (uint32_t i = 0; i < *right.num_cells(); i++) {
+      auto *cell = right.cell(i);
+      leaf_node_insert_cell(left, *left.num_cells(), *right.key(i), cell, leaf_cell_size(cell));
+    }
+    *left.next_leaf() = *right.next_leaf();
+    return true;
+  }
+
+  std::vector<std::pair<uint32_t, std::string>> cells;
+  for (auto *node : {&left, &right}) {
+    for (uint32_t i = 0; i < *node->num_cells(); i++) {
+      auto *cell = node->cell(i);
+      cells.emplace_back(*node->key(i), std::string(cell, leaf_cell_size(cell)));
+    }
+  }
+  std::size_t left_count = 0;
+  for (std::size_t left_space = 0; left_space < (left_used + right_used) / 2; left_count++) {
+    left_space += LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE + cells[left_count].second.size();
+  }
+  for (auto *node : {&left, &right}) {
+    auto parent = *node->parent();
+    auto next_leaf = *node->next_leaf();
+    node->node_type(Page::NodeType::LEAF);
+    *node->parent() = parent;
+    *node->next_leaf() = next_leaf;
+  }
+  for (std::size_t i = 0; i < cells.size(); i++) {
+    auto &node = i < left_count ? left : right;
+    leaf_node_insert_cell(node, *node.num_cells(), cells[i].first, cells[i].second.data(), cells[i].second.size());
+  }
+  return false;
+}
+
+// Internal node version of leaf_node_rebalance. separator is the parent's key
+// for left, it's updated when children move between the two.
+bool internal_node_rebalance(Pager &pager,
+                             Page &left,
+                             std::size_t left_page_num,
+                             Page &right,
+                             std::size_t right_page_num,
+                             uint32_t &separator) {
+  std::vector<std::pair<uint32_t, uint32_t>> children; // (page_num, max key)
+  for (uint32_t i = 0; i < *left.num_keys(); i++) {
+    children.emplace_back(*left.child(i), *left.key(i));
+  }
+  children.emplace_back(*left.right_child(), separator);
+  for (uint32_t i = 0; i < *right.num_keys(); i++) {
+    children.emplace_back(*right.child(i), *right.key(i));
+  }
+  // Its bound is the parent's key for right, which doesn't change.
+  children.emplace_back(*right.right_child(), 0);
+
+  if (children.size() <= INTERNAL_NODE_MAX_KEYS + 1) {
+    internal_node_fill(pager, left, left_page_num, children, 0, children.size());
+    return true;
+  }
+  auto left_count = children.size() / 2;
+  internal_node_fill(pager, left, left_page_num, children, 0, left_count);
+  internal_node_fill(pager, right, right_page_num, children, left_count, children.size());
+  separator = children[left_count - 1].second;
+  return false;
+}
+
+// Drops child child_num, which was merged into child child_num - 1. That one
+// takes over its upper bound.
+void internal_node_remove_child(Page &node, uint32_t child_num) {
+  auto num_keys = *node.num_keys();
+  if (child_num < num_keys) {
+    *node.key(child_num - 1) = *node.key(child_num);
+    memmove(node.key(child_num), node.key(child_num + 1), (num_keys - child_num - 1) * INTERNAL_NODE_KEY_SIZE);
+    memmove(node.child(child_num), node.child(child_num + 1), (num_keys - child_num - 1) * INTERNAL_NODE_CHILD_SIZE);
+    memmove(node.child_count(child_num),
+            node.child_count(child_num + 1),
+            (num_keys - child_num - 1) * INTERNAL_NODE_COUNT_SIZE);
+  } else {
+    *node.right_child() = *node.child(child_num - 1);
+    *node.child_count(num_keys) = *node.child_count(child_num - 1);
+  }
+  *node.num_keys() = num_keys - 1;
+}
+
+// Walks back up path after its last node lost an entry, merging or
+// redistributing underfull nodes with a sibling. Every node of path is
+// latched exclusively, positions holds the child taken at each level.
+void rebalance_after_delete(Table &table, std::vector<PageLatch> &path, const std::vector<uint32_t> &positions) {
+  auto &pager = table.pager;
+  for (auto level = path.size() - 1; level > 0; level--) {
+    auto &node = *path[level].page;
+    auto is_leaf = node.node_type() == Page::NodeType::LEAF;
+    auto underfull = is_leaf ? leaf_node_used_space(node) < LEAF_NODE_MIN_USED_SPACE
+                             : *node.num_keys() + 1 < INTERNAL_NODE_MIN_CHILDREN;
+    auto &parent = *path[level - 1].page;
+    auto num_keys = *parent.num_keys();
+    if (!underfull || num_keys == 0) {
+      break;
+    }
+
+    // Pair the node with its right sibling, or with its left one if it is the
+    // last child. Latch them left to right, the direction scans take.
+    auto left_index = std::min(positions[level - 1], num_keys - 1);
+    auto left_page_num = *parent.child(left_index);
+    auto right_page_num = *parent.child(left_index + 1);
+    PageLatch left_latch;
+    PageLatch right_latch;
+    if (path[level].page_num == left_page_num) {
+      left_latch = std::move(path[level]);
+    } else {
+      path[level].release();
+      left_latch = PageLatch{pager, left_page_num, true};
+    }
+    right_latch = PageLatch{pager, right_page_num, true};
+    auto &left = *left_latch.page;
+    auto &right = *right_latch.page;
+
+    auto separator = *parent.key(left_index);
+    auto merged = is_leaf ? leaf_node_rebalance(left, right)
+                          : internal_node_rebalance(pager, left, left_page_num, right, right_page_num, separator);
+    pager.mark_dirty(left_page_num);
+    pager.mark_dirty(path[level - 1].page_num);
+    if (!merged) {
+      metric_add(table.stats.redistributions);
+      pager.mark_dirty(right_page_num);
+      *parent.key(left_index) = is_leaf ? left.max_key() : separator;
+      *parent.child_count(left_index) = left.row_count();
+      *parent.child_count(left_index + 1) = right.row_count();
+      return;
+    }
+    metric_add(table.stats.merges);
+    internal_node_remove_child(parent, left_index + 1);
+    *parent.child_count(left_index) = left.row_count();
+    right_latch.release();
+    pager.free_page(right_page_num);
+  }
+
+  // A root left with a single child takes over its contents, keeping its page number.
+  auto &root = *path[0].page;
+  if (root.node_type() == Page::NodeType::INTERNAL && *root.num_keys() == 0) {
+    auto child_page_num = *root.right_child();
+    {
+      PageLatch child{pager, child_page_num, true};
+      memcpy(root.data.data(), child.page->data.data(), PAGE_SIZE);
+    }
+    root.root(true);
+    *root.parent() = 0;
+    if (root.node_type() == Page::NodeType::INTERNAL) {
+      for (uint32_t i = 0; i <= *root.num_keys(); i++) {
+        PinScope scope{pager};
+        auto grandchild = *root.child(i);
+        *pager.get_page(grandchild).parent() = table.root_page_num;
+        pager.mark_dirty(grandchild);
+      }
+    }
+    pager.mark_dirty(table.root_page_num);
+    pager.free_page(child_page_num);
+  }
+}
+
+bool table_delete(Table &table, uint32_t key, Row *old_row) {
+  PinScope scope{table.pager};
+  auto &pager = table.pager;
+  // A merge can travel all the way up, so the whole path stays latched.
+  std::vector<PageLatch> path;
+  std::vector<uint32_t> positions;
+  auto page_num = table.root_page_num;
+  while (true) {
+    path.emplace_back(pager, page_num, true);
+    auto &node = *path.back().page;
+    if (node.node_type() == Page::NodeType::LEAF) {
+      positions.push_back(node_lower_bound(node.keys(), *node.num_cells(), key));
+      break;
+    }
+    positions.push_back(internal_node_find_child(node, key));
+    page_num = *node.child(positions.back());
+  }
+
+  auto &leaf = *path.back().page;
+  auto cell_num = positions.back();
+  if (cell_num >= *leaf.num_cells() || *leaf.key(cell_num) != key) {
+    return false;
+  }
+  if (old_row) {
+    std::vector<char> scratch;
+    deserialize_row(read_leaf_cell(pager, leaf, cell_num, scratch), *old_row);
+  }
+  if (table.row_cache) {
+    table.row_cache->erase(key);
+  }
+  free_overflow_chain(pager, leaf.cell(cell_num));
+  leaf_node_remove_cell(leaf, cell_num);
+  pager.mark_dirty(path.back().page_num);
+  for (std::size_t level = 0; level + 1 < path.size(); level++) {
+    --*path[level].page->child_count(positions[level]);
+    pager.mark_dirty(path[level].page_num);
+  }
+  rebalance_after_delete(table, path, positions);
+  return true;
+}
+
+bool table_update(Table &table, const Row &row) {
+  PinScope scope{table.pager};
+  auto &pager = table.pager;
+  std::vector<PageLatch> path;
+  auto cursor = table_find_for_write(table, row.id, path);
+  auto &leaf = pager.get_page(cursor.page_num);
+  if (cursor.cell_num >= *leaf.num_cells() || *leaf.key(cursor.cell_num) != row.id) {
+    return false;
+  }
+  if (table.row_cache) {
+    // Readers fill the cache under a shared latch on the leaf, so none can put the old row back.
+    table.row_cache->erase(row.id);
+  }
+
+  auto old_cell_size = leaf_cell_size(leaf.cell(cursor.cell_num));
+  free_overflow_chain(pager, leaf.cell(cursor.cell_num));
+  char cell[LEAF_NODE_MAX_CELL_SIZE];
+  auto cell_size = build_leaf_cell(pager, row, cell);
+  pager.mark_dirty(cursor.page_num);
+  if (cell_size == old_cell_size) {
+    memcpy(leaf.cell(cursor.cell_num), cell, cell_size);
+    return true;
+  }
+  leaf_node_remove_cell(leaf, cursor.cell_num);
+  if (leaf.free_space() >= LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE + cell_size) {
+    leaf_node_insert_cell(leaf, cursor.cell_num, row.id, cell, cell_size);
+  } else {
+    leaf_node_split_and_insert(cursor, row.id, cell, cell_size);
+  }
+  return true;
+}
+
+PrepareResult parse_id(std::string_view token, uint32_t &out_id) {
+  if (!token.empty() && token[0] == '-') {
+    return PrepareResult::NEGATIVE_ID;
+  }
+  auto end = token.data() + token.size();
+  auto [ptr, error] = std::from_chars(token.data(), end, out_id);
+  if (error != std::errc() || ptr != end) {
+    return PrepareResult::SYNTAX_ERROR;
+  }
+  return PrepareResult::SUCCESS;
+}
+
+bool parse_op(std::string_view token, Predicate::Op &out_op) {
+  static const std::pair<const char *, Predicate::Op> ops[] = {
+      {"=", Predicate::Op::EQ}, {"!=", Predicate::Op::NE}, {"<", Predicate::Op::LT},
+      {"<=", Predicate::Op::LE}, {">", Predicate::Op::GT}, {">=", Predicate::Op::GE},
+      {"like", Predicate::Op::PREFIX}};
+  for (auto &op : ops) {
+    if (token == op.first) {
+      out_op = op.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Folds an id term into [id_min, id_max]. Returns false for terms a range
+// can't express, those stay predicates.
+bool narrow_id_range(Predicate::Op op, uint32_t id, int64_t &id_min, int64_t &id_max) {
+  switch (op) {
+    case Predicate::Op::EQ:
+      id_min = std::max<int64_t>(id_min, id);
+      id_max = std::min<int64_t>(id_max, id);
+      return true;
+    case Predicate::Op::LT:
+      id_max = std::min<int64_t>(id_max, int64_t(id) - 1);
+      return true;
+    case Predicate::Op::LE:
+      id_max = std::min<int64_t>(id_max, id);
+      return true;
+    case Predicate::Op::GT:
+      id_min = std::max<int64_t>(id_min, int64_t(id) + 1);
+      return true;
+    case Predicate::Op::GE:
+      id_min = std::max<int64_t>(id_min, id);
+      return true;
+    default:
+      return false;
+  }
+}
+
+void set_id_range(Statement &statement, int64_t id_min, int64_t id_max) {
+  if (id_min > id_max) {
+    // Nothing can match, leave an empty range behind.
+    statement.id_min = std::numeric_limits<uint32_t>::max();
+    statement.id_max = 0;
+  } else {
+    statement.id_min = id_min;
+    statement.id_max = id_max;
+  }
+}
+
+template<std::size_t N>
+void copy_column(std::string_view value, std::array<char, N> &column) {
+  memcpy(column.data(), value.data(), value.size());
+  column[value.size()] = '\0';
+}
+
+bool is_placeholder(std::string_view token, const std::vector<Parameter> *parameters) {
+  return parameters != nullptr && token == "?";
+}
+
+PrepareResult prepare_where(const std::vector<std::string_view> &tokens,
+                            std::size_t where,
+                            Statement &out_statement,
+                            std::vector<Parameter> *parameters,
+                            std::size_t *out_end = nullptr);
+
+// select [<column>[,<column>...] | * | count(*)] [where <term> [and <term>...]] [limit <n>] [offset <n>]
+// where a term is `<column> <op> <value>`, `<column> like <prefix>%` or
+// `id between <min> and <max>`. With parameters, a ? value is a placeholder.
+PrepareResult prepare_select(const std::vector<std::string_view> &tokens,
+                             Statement &out_statement,
+                             std::vector<Parameter> *parameters) {
+  // The column list runs up to the where clause, or the limit or offset when there is none.
+  std::size_t where = std::find_if(tokens.begin() + 1, tokens.end(), [](std::string_view token) {
+    return token == "where" || token == "limit" || token == "offset";
+  }) - tokens.begin();
+  if (where == 2 && tokens[1] == "count(*)") {
+    out_statement.count_rows = true;
+  } else if (where > 1 && !(where == 2 && tokens[1] == "*")) {
+    out_statement.columns = 0;
+    for (std::size_t i = 1; i < where; i++) {
+      auto list = tokens[i];
+      while (!list.empty()) {
+        auto comma = std::min(list.find(','), list.size());
+        auto column = list.substr(0, comma);
+        list.remove_prefix(std::min(comma + 1, list.size()));
+        if (column.empty()) {
+          continue;
+        }
+        if (column == "id") {
+          out_statement.columns |= COLUMN_ID;
+        } else if (column == "username") {
+          out_statement.columns |= COLUMN_USERNAME;
+        } else if (column == "email") {
+          out_statement.columns |= COLUMN_EMAIL;
+        } else {
+          return PrepareResult::SYNTAX_ERROR;
+        }
+      }
+    }
+    if (out_statement.columns == 0) {
+      return PrepareResult::SYNTAX_ERROR;
     }
-    int id = std::strtol(tokens[1].data(), nullptr, 10);
-    if (id < 0) {
-      return PrepareResult::NEGATIVE_ID;
+  }
+
+  auto end = where;
+  if (where < tokens.size() && tokens[where] == "where") {
+    auto result = prepare_where(tokens, where, out_statement, parameters, &end);
+    if (result != PrepareResult::SUCCESS) {
+      return result;
+    }
+  }
+  // Keywords only once the where clause is over, a where value may be either word.
+  auto paged = false;
+  for (auto [keyword, value] : {std::pair{"limit", &out_statement.limit}, std::pair{"offset", &out_statement.offset}}) {
+    if (tokens.size() - end >= 2 && tokens[end] == keyword) {
+      auto result = parse_id(tokens[end + 1], *value);
+      if (result != PrepareResult::SUCCESS) {
+        return result;
+      }
+      end += 2;
+      paged = true;
+    }
+  }
+  if (end != tokens.size() || (paged && out_statement.count_rows)) {
+    return PrepareResult::SYNTAX_ERROR;
+  }
+  return PrepareResult::SUCCESS;
+}
+
+// The where clause starting at tokens[where], if there is one, shared by
+// select, delete and update. It has to take up the rest of the tokens,
+// unless out_end is given to receive the index of the first token after it.
+PrepareResult prepare_where(const std::vector<std::string_view> &tokens,
+                            std::size_t where,
+                            Statement &out_statement,
+                            std::vector<Parameter> *parameters,
+                            std::size_t *out_end) {
+  std::size_t i = where;
+  if (i == tokens.size()) {
+    return PrepareResult::SUCCESS;
+  }
+
+  // Id terms narrow the range the scan seeks to instead of being checked per
+  // row. Placeholders stay predicates until they are bound.
+  int64_t id_min = 0;
+  int64_t id_max = std::numeric_limits<uint32_t>::max();
+  auto add_id_term = [&](Predicate::Op op, std::string_view value) {
+    if (is_placeholder(value, parameters)) {
+      parameters->push_back(Parameter{Parameter::Target::PREDICATE, out_statement.predicates.size()});
+      out_statement.predicates.push_back(Predicate{Predicate::Column::ID, op});
+      return PrepareResult::SUCCESS;
+    }
+    uint32_t id;
+    auto result = parse_id(value, id);
+    if (result == PrepareResult::SUCCESS && !narrow_id_range(op, id, id_min, id_max)) {
+      out_statement.predicates.push_back(Predicate{Predicate::Column::ID, op, id});
+    }
+    return result;
+  };
+  do {
+    i++; // skip "where" or "and"
+    if (tokens.size() - i < 3) {
+      return PrepareResult::SYNTAX_ERROR;
+    }
+    auto column = tokens[i];
+    if (column == "id" && tokens[i + 1] == "between") {
+      if (tokens.size() - i < 5 || tokens[i + 3] != "and") {
+        return PrepareResult::SYNTAX_ERROR;
+      }
+      auto result = add_id_term(Predicate::Op::GE, tokens[i + 2]);
+      if (result == PrepareResult::SUCCESS) {
+        result = add_id_term(Predicate::Op::LE, tokens[i + 4]);
+      }
+      if (result != PrepareResult::SUCCESS) {
+        return result;
+      }
+      i += 5;
+      continue;
+    }
+
+    Predicate predicate{};
+    if (!parse_op(tokens[i + 1], predicate.op)) {
+      return PrepareResult::SYNTAX_ERROR;
+    }
+    auto value = tokens[i + 2];
+    i += 3;
+    if (column == "id") {
+      if (predicate.op == Predicate::Op::PREFIX) {
+        return PrepareResult::SYNTAX_ERROR;
+      }
+      auto result = add_id_term(predicate.op, value);
+      if (result != PrepareResult::SUCCESS) {
+        return result;
+      }
+      continue;
+    }
+    if (column != "username" && column != "email") {
+      return PrepareResult::SYNTAX_ERROR;
+    }
+    predicate.column = column == "username" ? Predicate::Column::USERNAME : Predicate::Column::EMAIL;
+    if (is_placeholder(value, parameters)) {
+      parameters->push_back(Parameter{Parameter::Target::PREDICATE, out_statement.predicates.size()});
+    } else {
+      if (value.size() >= (column == "username" ? USERNAME_SIZE : EMAIL_SIZE)) {
+        return PrepareResult::STRING_TOO_LONG;
+      }
+      if (predicate.op == Predicate::Op::PREFIX) {
+        // Only a trailing wildcard is supported.
+        if (value.find('%') != value.size() - 1) {
+          return PrepareResult::SYNTAX_ERROR;
+        }
+        value.remove_suffix(1);
+      }
+      predicate.text_value = value;
+    }
+    out_statement.predicates.push_back(std::move(predicate));
+  } while (i < tokens.size() && tokens[i] == "and");
+  if (out_end) {
+    *out_end = i;
+  } else if (i != tokens.size()) {
+    return PrepareResult::SYNTAX_ERROR;
+  }
+  set_id_range(out_statement, id_min, id_max);
+  return PrepareResult::SUCCESS;
+}
+
+// delete [where ...]
+PrepareResult prepare_delete(const std::vector<std::string_view> &tokens,
+                             Statement &out_statement,
+                             std::vector<Parameter> *parameters) {
+  if (tokens.size() > 1 && tokens[1] != "where") {
+    return PrepareResult::SYNTAX_ERROR;
+  }
+  return prepare_where(tokens, 1, out_statement, parameters);
+}
+
+// update set <column> = <value>[, <column> = <value>] [where ...]
+// Only username and email can be set, the id is the row's key.
+PrepareResult prepare_update(const std::vector<std::string_view> &tokens,
+                             Statement &out_statement,
+                             std::vector<Parameter> *parameters) {
+  if (tokens.size() < 2 || tokens[1] != "set") {
+    return PrepareResult::SYNTAX_ERROR;
+  }
+  std::size_t i = 2;
+  while (i < tokens.size() && tokens[i] != "where") {
+    if (tokens[i] == ",") {
+      i++;
+      continue;
+    }
+    if (tokens.size() - i < 3 || tokens[i + 1] != "=") {
+      return PrepareResult::SYNTAX_ERROR;
+    }
+    auto column = tokens[i];
+    auto value = tokens[i + 2];
+    i += 3;
+    if (!value.empty() && value.back() == ',') {
+      value.remove_suffix(1);
+    }
+    auto is_username = column == "username";
+    if (!is_username && column != "email") {
+      return PrepareResult::SYNTAX_ERROR;
+    }
+    auto column_flag = is_username ? COLUMN_USERNAME : COLUMN_EMAIL;
+    if (value.empty() || (out_statement.update_columns & column_flag)) {
+      return PrepareResult::SYNTAX_ERROR;
     }
-    if (!is_number(tokens[1])) {
+    out_statement.update_columns |= column_flag;
+    auto &row = out_statement.row_to_insert;
+    if (is_placeholder(value, parameters)) {
+      parameters->push_back(Parameter{is_username ? Parameter::Target::INSERT_USERNAME
+                                                  : Parameter::Target::INSERT_EMAIL});
+    } else if (value.size() >= (is_username ? USERNAME_SIZE : EMAIL_SIZE)) {
+      return PrepareResult::STRING_TOO_LONG;
+    } else if (is_username) {
+      copy_column(value, row.username);
+    } else {
+      copy_column(value, row.email);
+    }
+  }
+  if (out_statement.update_columns == 0) {
+    return PrepareResult::SYNTAX_ERROR;
+  }
+  return prepare_where(tokens, i, out_statement, parameters);
+}
+
+// (<id>, <username>, <email>)[, (...)...] after insert values.
+PrepareResult prepare_insert_values(std::string_view values,
+                                    Statement &out_statement,
+                                    const std::vector<Parameter> *parameters) {
+  auto trim = [](std::string_view token) {
+    auto begin = std::min(token.find_first_not_of(' '), token.size());
+    auto end = token.find_last_not_of(' ') + 1;
+    return token.substr(begin, end - begin);
+  };
+  auto rest = trim(values);
+  while (true) {
+    if (rest.empty() || rest[0] != '(') {
+      return PrepareResult::SYNTAX_ERROR;
+    }
+    auto close = rest.find(')');
+    if (close == std::string_view::npos) {
+      return PrepareResult::SYNTAX_ERROR;
+    }
+    auto fields = rest.substr(1, close - 1);
+    rest = trim(rest.substr(close + 1));
+    std::string_view field[3];
+    std::size_t field_count = 0;
+    while (true) {
+      if (field_count == 3) {
+        return PrepareResult::SYNTAX_ERROR;
+      }
+      auto comma = fields.find(',');
+      field[field_count] = trim(fields.substr(0, comma));
+      if (field[field_count].empty() || is_placeholder(field[field_count], parameters)) {
+        return PrepareResult::SYNTAX_ERROR;
+      }
+      field_count++;
+      if (comma == std::string_view::npos) {
+        break;
+      }
+      fields.remove_prefix(comma + 1);
+    }
+    if (field_count != 3) {
       return PrepareResult::SYNTAX_ERROR;
     }
-    if (tokens[2].size() >= USERNAME_SIZE || tokens[3].size() >= EMAIL_SIZE) {
+
+    auto &row = out_statement.rows_to_insert.emplace_back();
+    auto result = parse_id(field[0], row.id);
+    if (result != PrepareResult::SUCCESS) {
+      return result;
+    }
+    if (field[1].size() >= USERNAME_SIZE || field[2].size() >= EMAIL_SIZE) {
       return PrepareResult::STRING_TOO_LONG;
     }
+    copy_column(field[1], row.username);
+    copy_column(field[2], row.email);
+    if (rest.empty()) {
+      return PrepareResult::SUCCESS;
+    }
+    if (rest[0] != ',') {
+      return PrepareResult::SYNTAX_ERROR;
+    }
+    rest = trim(rest.substr(1));
+  }
+}
 
-    out_statement.row_to_insert.id = id;
-    std::copy(tokens[2].begin(), tokens[2].end(), out_statement.row_to_insert.username.data());
-    std::copy(tokens[3].begin(), tokens[3].end(), out_statement.row_to_insert.email.data());
+PrepareResult parse_statement(std::string_view input, Statement &out_statement, std::vector<Parameter> *parameters) {
+  // Reused from statement to statement, tokenizing allocates nothing once warm.
+  thread_local std::vector<std::string_view> tokens;
+  tokenize(input, " ", tokens);
+  if (tokens.empty()) {
+    return PrepareResult::UNRECOGNIZED_STATEMENT;
+  }
+  if (tokens[0] == "insert" && tokens.size() > 1 && tokens[1] == "values") {
+    out_statement = Statement{Statement::INSERT_BATCH};
+    auto values = input.substr(tokens[1].data() + tokens[1].size() - input.data());
+    return prepare_insert_values(values, out_statement, parameters);
+  }
+  if (tokens[0] == "insert") {
+    out_statement = Statement{Statement::INSERT};
+    if (tokens.size() != 4) {
+      return PrepareResult::SYNTAX_ERROR;
+    }
+    auto &row = out_statement.row_to_insert;
+    if (is_placeholder(tokens[1], parameters)) {
+      parameters->push_back(Parameter{Parameter::Target::INSERT_ID});
+    } else {
+      auto result = parse_id(tokens[1], row.id);
+      if (result != PrepareResult::SUCCESS) {
+        return result;
+      }
+    }
+    if (is_placeholder(tokens[2], parameters)) {
+      parameters->push_back(Parameter{Parameter::Target::INSERT_USERNAME});
+    } else if (tokens[2].size() >= USERNAME_SIZE) {
+      return PrepareResult::STRING_TOO_LONG;
+    } else {
+      copy_column(tokens[2], row.username);
+    }
+    if (is_placeholder(tokens[3], parameters)) {
+      parameters->push_back(Parameter{Parameter::Target::INSERT_EMAIL});
+    } else if (tokens[3].size() >= EMAIL_SIZE) {
+      return PrepareResult::STRING_TOO_LONG;
+    } else {
+      copy_column(tokens[3], row.email);
+    }
     return PrepareResult::SUCCESS;
   }
   if (tokens[0] == "select") {
     out_statement = Statement{Statement::SELECT};
+    return prepare_select(tokens, out_statement, parameters);
+  }
+  if (tokens[0] == "delete") {
+    out_statement = Statement{Statement::DELETE};
+    return prepare_delete(tokens, out_statement, parameters);
+  }
+  if (tokens[0] == "update") {
+    out_statement = Statement{Statement::UPDATE};
+    return prepare_update(tokens, out_statement, parameters);
+  }
+  if (tokens[0] == "create") {
+    // create index on users(<column>)
+    out_statement = Statement{Statement::CREATE_INDEX};
+    if (tokens.size() < 4 || tokens[1] != "index" || tokens[2] != "on") {
+      return PrepareResult::SYNTAX_ERROR;
+    }
+    std::string target;
+    for (std::size_t i = 3; i < tokens.size(); i++) {
+      target += tokens[i];
+    }
+    if (target == "users(username)") {
+      out_statement.index_column = IndexColumn::USERNAME;
+    } else if (target == "users(email)") {
+      out_statement.index_column = IndexColumn::EMAIL;
+    } else {
+      return PrepareResult::SYNTAX_ERROR;
+    }
     return PrepareResult::SUCCESS;
   }
   return PrepareResult::UNRECOGNIZED_STATEMENT;
 }
 
-ExecuteResult execute_insert(const Statement &statement, Table &table) {
-  auto &node = table.pager.get_page(table.root_page_num);
-  auto num_cells = *node.num_cells();
+PrepareResult prepare_statement(std::string_view input, Statement &out_statement) {
+  return parse_statement(input, out_statement, nullptr);
+}
+
+PrepareResult prepare(std::string_view input, PreparedStatement &out_statement) {
+  out_statement.parameters.clear();
+  auto result = parse_statement(input, out_statement.statement, &out_statement.parameters);
+  out_statement.id_min = out_statement.statement.id_min;
+  out_statement.id_max = out_statement.statement.id_max;
+  return result;
+}
+
+PrepareResult PreparedStatement::bind(std::size_t index, uint32_t value) {
+  if (index >= parameters.size()) {
+    return PrepareResult::SYNTAX_ERROR;
+  }
+  auto &parameter = parameters[index];
+  if (parameter.target == Parameter::Target::INSERT_ID) {
+    statement.row_to_insert.id = value;
+    return PrepareResult::SUCCESS;
+  }
+  if (parameter.target == Parameter::Target::PREDICATE
+      && statement.predicates[parameter.predicate].column == Predicate::Column::ID) {
+    statement.predicates[parameter.predicate].id_value = value;
+    return PrepareResult::SUCCESS;
+  }
+  return PrepareResult::SYNTAX_ERROR;
+}
+
+PrepareResult PreparedStatement::bind(std::size_t index, std::string_view value) {
+  if (index >= parameters.size()) {
+    return PrepareResult::SYNTAX_ERROR;
+  }
+  auto &parameter = parameters[index];
+  auto is_id = parameter.target == Parameter::Target::INSERT_ID
+      || (parameter.target == Parameter::Target::PREDICATE
+          && statement.predicates[parameter.predicate].column == Predicate::Column::ID);
+  if (is_id) {
+    uint32_t id;
+    auto result = parse_id(value, id);
+    return result == PrepareResult::SUCCESS ? bind(index, id) : result;
+  }
+  switch (parameter.target) {
+    case Parameter::Target::INSERT_USERNAME:
+      if (value.size() >= USERNAME_SIZE) {
+        return PrepareResult::STRING_TOO_LONG;
+      }
+      copy_column(value, statement.row_to_insert.username);
+      return PrepareResult::SUCCESS;
+    case Parameter::Target::INSERT_EMAIL:
+      if (value.size() >= EMAIL_SIZE) {
+        return PrepareResult::STRING_TOO_LONG;
+      }
+      copy_column(value, statement.row_to_insert.email);
+      return PrepareResult::SUCCESS;
+    default: {
+      auto &predicate = statement.predicates[parameter.predicate];
+      if (value.size() >= (predicate.column == Predicate::Column::USERNAME ? USERNAME_SIZE : EMAIL_SIZE)) {
+        return PrepareResult::STRING_TOO_LONG;
+      }
+      predicate.text_value.assign(value.data(), value.size());
+      return PrepareResult::SUCCESS;
+    }
+  }
+}
+
+// Narrows the literal id range by the bound id terms. They are still checked
+// as predicates too, which is redundant but cheap.
+void apply_bound_id_range(PreparedStatement &prepared) {
+  int64_t id_min = prepared.id_min;
+  int64_t id_max = prepared.id_max;
+  for (auto &parameter : prepared.parameters) {
+    if (parameter.target != Parameter::Target::PREDICATE) {
+      continue;
+    }
+    auto &predicate = prepared.statement.predicates[parameter.predicate];
+    if (predicate.column == Predicate::Column::ID) {
+      narrow_id_range(predicate.op, predicate.id_value, id_min, id_max);
+    }
+  }
+  set_id_range(prepared.statement, id_min, id_max);
+}
+
+// Records how long a statement took in its type's latency histogram.
+struct StatementTimer {
+  LatencyHistogram &histogram;
+  std::chrono::steady_clock::time_point start;
+
+  StatementTimer(Table &table, Statement::StatementType type)
+      : histogram(table.stats.statement_latency[type]),
+        start(std::chrono::steady_clock::now()) {
+  }
+
+  ~StatementTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  }
+};
+
+ExecuteResult PreparedStatement::execute(Table &table) {
+  apply_bound_id_range(*this);
+  return execute_statement(statement, table);
+}
 
+ExecuteResult PreparedStatement::execute(Table &table, std::vector<Row> &out_rows) {
+  apply_bound_id_range(*this);
+  if (statement.statement_type != Statement::SELECT) {
+    return execute_statement(statement, table);
+  }
+  StatementTimer timer{table, statement.statement_type};
+  return execute_select_parallel(statement, table, out_rows);
+}
+
+ExecuteResult execute_insert(const Statement &statement, Table &table) {
+  WriteScope writer{table};
+  PinScope scope{table.pager};
   const Row &row_to_insert = statement.row_to_insert;
   auto key_to_insert = row_to_insert.id;
-  auto cursor = table_find(table, key_to_insert);
+  std::vector<PageLatch> path;
+  auto cursor = table_find_for_write(table, key_to_insert, path, 1);
 
-  if (cursor.cell_num < num_cells) {
+  auto &node = table.pager.get_page(cursor.page_num);
+  auto num_cells = *node.num_cells();
+  // The leaf takes the row anyway, so its filter only spares reading the key.
+  if (cursor.cell_num < num_cells && !table.pager.filter_excludes(cursor.page_num, key_to_insert)) {
     auto key_at_index = *node.key(cursor.cell_num);
     if (key_at_index == key_to_insert) {
+      // Take back the row counted on the way down.
+      path.clear();
+      std::vector<PageLatch> undo_path;
+      table_find_for_write(table, key_to_insert, undo_path, -1);
       return ExecuteResult::DUPLICATE_KEY;
     }
   }
   leaf_node_insert(cursor, row_to_insert.id, row_to_insert);
+  // Readers look rows up after letting go of index latches, so the table
+  // latches have to be gone before taking the index ones.
+  path.clear();
+  for (std::size_t i = 0; i < INDEX_COLUMN_COUNT; i++) {
+    if (auto root = table.index_roots[i].load()) {
+      auto value = index_column_value(row_to_insert, static_cast<IndexColumn>(i));
+      index_insert(table.pager, root, IndexEntry{value, row_to_insert.id});
+    }
+  }
+  return ExecuteResult::SUCCESS;
+}
+
+ExecuteResult execute_insert_batch(const Row *rows, std::size_t count, Table &table) {
+  WriteScope writer{table};
+  auto &pager = table.pager;
+  std::vector<const Row *> sorted(count);
+  for (std::size_t i = 0; i < count; i++) {
+    sorted[i] = rows + i;
+  }
+  std::sort(sorted.begin(), sorted.end(), [](const Row *a, const Row *b) { return a->id < b->id; });
+  auto taken = std::adjacent_find(sorted.begin(), sorted.end(), [](const Row *a, const Row *b) {
+    return a->id == b->id;
+  });
+  if (taken != sorted.end()) {
+    return ExecuteResult::DUPLICATE_KEY;
+  }
+
+  // A leaf takes every following row up to its largest key, the last leaf
+  // takes the rest. Each run is sized and checked for taken ids on the one
+  // descent that writes it, a taken id takes back the rows put in before it.
+  auto leaf_last_key = [](Page &leaf) {
+    return *leaf.next_leaf() == 0 ? std::numeric_limits<uint32_t>::max() : leaf.max_key();
+  };
+  auto take_back = [&](std::size_t inserted) {
+    for (std::size_t j = 0; j < inserted; j++) {
+      table_delete(table, sorted[j]->id);
+    }
+    return ExecuteResult::DUPLICATE_KEY;
+  };
+  std::vector<uint32_t> run_keys;
+  std::vector<uint16_t> run_sizes;
+  std::vector<char> run_cells;
+  for (std::size_t i = 0; i < count;) {
+    PinScope scope{pager};
+    // The run is only known at the leaf, so the whole path stays latched to count it in afterwards.
+    std::vector<PageLatch> path;
+    std::vector<uint32_t> positions;
+    auto page_num = table.root_page_num;
+    while (true) {
+      path.emplace_back(pager, page_num, true);
+      auto &node = *path.back().page;
+      if (node.node_type() == Page::NodeType::LEAF) {
+        break;
+      }
+      positions.push_back(internal_node_find_child(node, sorted[i]->id));
+      page_num = *node.child(positions.back());
+    }
+
+    auto &leaf = *path.back().page;
+    auto *keys = leaf.keys();
+    auto num_cells = *leaf.num_cells();
+    auto last_key = leaf_last_key(leaf);
+    // A run that fits goes straight into the leaf. One that doesn't is split
+    // together with the leaf's cells, as much of it as two halves can take.
+    auto free_space = leaf.free_space();
+    auto split_space = 2 * (LEAF_NODE_SPACE_FOR_CELLS - LEAF_NODE_MAX_CELL_SPACE) - leaf_node_used_space(leaf);
+    std::size_t fitting = 0;
+    run_keys.clear();
+    run_sizes.clear();
+    uint32_t position = 0;
+    for (auto end = i; end < count && (end == i || sorted[end]->id <= last_key); end++) {
+      // Ids the leaf's filter rules out aren't searched for, the next search
+      // just starts further back.
+      if (!pager.filter_excludes(page_num, sorted[end]->id)) {
+        position += node_lower_bound(keys + position, num_cells - position, sorted[end]->id);
+        if (position < num_cells && keys[position] == sorted[end]->id) {
+          path.clear();
+          return take_back(i);
+        }
+      }
+      auto space = LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE + leaf_cell_size(pager, row_payload_size(*sorted[end]));
+      if (space > split_space && !run_keys.empty()) {
+        break;
+      }
+      split_space -= std::min(space, split_space);
+      if (fitting == run_keys.size() && space <= free_space) {
+        free_space -= space;
+        fitting++;
+      }
+      run_keys.push_back(sorted[end]->id);
+      run_sizes.push_back(space - LEAF_NODE_KEY_SIZE - LEAF_NODE_SLOT_SIZE);
+    }
+    auto split = fitting < run_keys.size();
+    if (!split || fitting > 0) {
+      // Fill the leaf before splitting anything.
+      run_keys.resize(fitting);
+      run_sizes.resize(fitting);
+      split = false;
+    }
+
+    for (std::size_t level = 0; level < positions.size(); level++) {
+      *path[level].page->child_count(positions[level]) += run_keys.size();
+      pager.mark_dirty(path[level].page_num);
+    }
+    run_cells.resize(run_keys.size() * LEAF_NODE_MAX_CELL_SIZE);
+    std::size_t offset = 0;
+    for (std::size_t j = 0; j < run_keys.size(); j++) {
+      offset += build_leaf_cell(pager, *sorted[i + j], run_cells.data() + offset);
+    }
+    if (split) {
+      leaf_node_split_and_merge(table, path.back().page_num, run_keys.data(), run_cells.data(), run_sizes.data(),
+                                run_keys.size());
+    } else {
+      leaf_node_merge_cells(leaf, run_keys.data(), run_cells.data(), run_sizes.data(), run_keys.size());
+      pager.mark_dirty(path.back().page_num);
+    }
+    i += run_keys.size();
+  }
+
+  for (std::size_t column = 0; column < INDEX_COLUMN_COUNT; column++) {
+    auto root = table.index_roots[column].load();
+    if (root == 0) {
+      continue;
+    }
+    std::vector<IndexEntry> entries;
+    entries.reserve(count);
+    for (auto *row : sorted) {
+      entries.push_back(IndexEntry{index_column_value(*row, static_cast<IndexColumn>(column)), row->id});
+    }
+    // In index order consecutive entries mostly land in the same leaf.
+    std::sort(entries.begin(), entries.end(), [](const IndexEntry &a, const IndexEntry &b) {
+      return a.value != b.value ? a.value < b.value : a.id < b.id;
+    });
+    for (auto &entry : entries) {
+      index_insert(pager, root, entry);
+    }
+  }
+  return ExecuteResult::SUCCESS;
+}
+
+const Predicate *choose_index(const Statement &statement, Table &table) {
+  for (auto &predicate : statement.predicates) {
+    if (predicate.column == Predicate::Column::ID
+        || (predicate.op != Predicate::Op::EQ && predicate.op != Predicate::Op::PREFIX)) {
+      continue;
+    }
+    auto column = predicate.column == Predicate::Column::USERNAME ? IndexColumn::USERNAME : IndexColumn::EMAIL;
+    if (table.index_roots[static_cast<std::size_t>(column)] != 0) {
+      return &predicate;
+    }
+  }
+  return nullptr;
+}
+
+ResultSet open_select(const Statement &statement, Table &table) {
+  ResultSet results{&statement};
+  results.to_skip = statement.offset;
+  results.to_return = statement.limit;
+  if (auto predicate = choose_index(statement, table)) {
+    auto column = predicate->column == Predicate::Column::USERNAME ? IndexColumn::USERNAME : IndexColumn::EMAIL;
+    index_lookup(table.pager, table.index_roots[static_cast<std::size_t>(column)], predicate->text_value,
+                 predicate->op == Predicate::Op::PREFIX, results.ids);
+    // Results come out in id order like a scan's.
+    std::sort(results.ids.begin(), results.ids.end());
+    results.lookup_table = &table;
+    return results;
+  }
+  if (statement.id_min == statement.id_max) {
+    // A single row, which the row cache may have or the leaf's filter may rule out.
+    results.ids.push_back(statement.id_min);
+    results.lookup_table = &table;
+    return results;
+  }
+  if (statement.offset > 0 && statement.predicates.empty()) {
+    // Every row in the id range matches, so the offset is a position to jump to.
+    results.cursor.emplace(table_seek_position(table, table_rank(table, statement.id_min) + statement.offset));
+    results.to_skip = 0;
+    return results;
+  }
+  results.cursor.emplace(table_seek(table, statement.id_min));
+  return results;
+}
+
+ResultSet open_select(const Statement &statement, const Snapshot &snapshot) {
+  ResultSet results{&statement};
+  results.to_skip = statement.offset;
+  results.to_return = statement.limit;
+  results.cursor.emplace(table_seek(snapshot, statement.id_min));
+  return results;
+}
+
+bool ResultSet::next(RowView &out_row) {
+  if (to_return == 0) {
+    cursor.reset();
+    return false;
+  }
+  while (true) {
+    if (lookup_table) {
+      // Let go of the last row's leaf before latching the next one.
+      cursor.reset();
+      if (ids_read == ids.size()) {
+        return false;
+      }
+      auto id = ids[ids_read++];
+      if (id < statement->id_min || id > statement->id_max) {
+        continue;
+      }
+      auto &row_cache = lookup_table->row_cache;
+      if (row_cache && row_cache->get(id, cached_row)) {
+        out_row = RowView{cached_row.id, cached_row.username.data(), cached_row.email.data()};
+      } else {
+        auto found = table_lookup(*lookup_table, id);
+        if (!found) {
+          continue;
+        }
+        cursor.emplace(std::move(*found));
+        out_row = cursor->value();
+        if (row_cache) {
+          // Still under the leaf's latch, so no writer has changed the row since.
+          deserialize_row(out_row, cached_row);
+          row_cache->put(cached_row);
+        }
+      }
+    } else {
+      // The cursor only moves on now that the caller is done with the last row.
+      if (started) {
+        cursor->advance();
+      }
+      started = true;
+      if (cursor->end_of_table) {
+        return false;
+      }
+      out_row = cursor->value();
+    }
+    if (out_row.id > statement->id_max) {
+      cursor.reset();
+      ids_read = ids.size();
+      return false;
+    }
+    if (!statement->matches(out_row)) {
+      continue;
+    }
+    if (to_skip > 0) {
+      to_skip--;
+      continue;
+    }
+    to_return--;
+    return true;
+  }
+}
 
+ExecuteResult execute_count(const Statement &statement, Table &table, uint64_t &out_count) {
+  if (statement.predicates.empty()) {
+    auto end = statement.id_max == std::numeric_limits<uint32_t>::max() ? table_row_count(table)
+                                                                        : table_rank(table, statement.id_max + 1);
+    auto begin = table_rank(table, statement.id_min);
+    out_count = end > begin ? end - begin : 0;
+    return ExecuteResult::SUCCESS;
+  }
+  out_count = 0;
+  auto results = open_select(statement, table);
+  RowView row{};
+  while (results.next(row)) {
+    out_count++;
+  }
   return ExecuteResult::SUCCESS;
 }
 
 ExecuteResult execute_select(const Statement &statement, Table &table, std::vector<Row> &out_vec) {
-  auto cursor = table_start(table);
-  while (!cursor.end_of_table) {
-    Row row{};
-    deserialize_row(cursor.value(), row);
-    out_vec.emplace_back(row);
-    cursor.advance();
+  if (statement.count_rows) {
+    uint64_t count;
+    auto result = execute_count(statement, table, count);
+    out_vec.push_back(Row{static_cast<uint32_t>(count)});
+    return result;
+  }
+  auto results = open_select(statement, table);
+  RowView row{};
+  while (results.next(row)) {
+    out_vec.emplace_back();
+    deserialize_columns(row, out_vec.back(), statement.columns);
+  }
+  return ExecuteResult::SUCCESS;
+}
+
+ExecuteResult execute_select(const Statement &statement, const Snapshot &snapshot, std::vector<Row> &out_vec) {
+  auto results = open_select(statement, snapshot);
+  RowView row{};
+  while (results.next(row)) {
+    out_vec.emplace_back();
+    deserialize_columns(row, out_vec.back(), statement.columns);
+  }
+  return ExecuteResult::SUCCESS;
+}
+
+ExecuteResult execute_delete(const Statement &statement, Table &table) {
+  WriteScope writer{table};
+  // The writer mutex keeps the rows from changing between finding and deleting them.
+  std::vector<Row> rows;
+  execute_select(statement, table, rows);
+  for (auto &row : rows) {
+    table_delete(table, row.id);
+    for (std::size_t i = 0; i < INDEX_COLUMN_COUNT; i++) {
+      if (auto root = table.index_roots[i].load()) {
+        index_delete(table.pager, root, IndexEntry{index_column_value(row, static_cast<IndexColumn>(i)), row.id});
+      }
+    }
+  }
+  return ExecuteResult::SUCCESS;
+}
+
+ExecuteResult execute_update(const Statement &statement, Table &table) {
+  WriteScope writer{table};
+  std::vector<Row> rows;
+  execute_select(statement, table, rows);
+  for (auto &old_row : rows) {
+    auto new_row = old_row;
+    if (statement.update_columns & COLUMN_USERNAME) {
+      new_row.username = statement.row_to_insert.username;
+    }
+    if (statement.update_columns & COLUMN_EMAIL) {
+      new_row.email = statement.row_to_insert.email;
+    }
+    table_update(table, new_row);
+    for (std::size_t i = 0; i < INDEX_COLUMN_COUNT; i++) {
+      auto root = table.index_roots[i].load();
+      auto column = static_cast<IndexColumn>(i);
+      auto old_value = index_column_value(old_row, column);
+      auto new_value = index_column_value(new_row, column);
+      if (root != 0 && old_value != new_value) {
+        index_delete(table.pager, root, IndexEntry{old_value, old_row.id});
+        index_insert(table.pager, root, IndexEntry{new_value, new_row.id});
+      }
+    }
+  }
+  return ExecuteResult::SUCCESS;
+}
+
+std::vector<uint32_t> collect_leaves(const Snapshot &snapshot, uint32_t id_min, uint32_t id_max) {
+  // Walk the internal levels breadth first, keeping only children whose key
+  // range overlaps [id_min, id_max]. Each level stays in key order.
+  std::vector<uint32_t> level{static_cast<uint32_t>(snapshot.table.root_page_num)};
+  auto copy = std::make_unique<Page>();
+  auto &node = *copy;
+  while (true) {
+    snapshot.read_page(level.front(), node);
+    if (node.node_type() == Page::NodeType::LEAF) {
+      return level;
+    }
+    std::vector<uint32_t> next_level;
+    for (auto page_num : level) {
+      snapshot.read_page(page_num, node);
+      auto num_keys = *node.num_keys();
+      uint64_t lower = 0; // smallest id the next child can hold
+      for (uint32_t i = 0; i <= num_keys && lower <= id_max; i++) {
+        uint64_t upper = i < num_keys ? *node.key(i) : std::numeric_limits<uint32_t>::max();
+        if (upper >= id_min) {
+          next_level.push_back(*node.child(i));
+        }
+        lower = upper + 1;
+      }
+    }
+    level.swap(next_level);
+    if (level.empty()) {
+      return level;
+    }
+  }
+}
+
+ExecuteResult execute_select_parallel(const Statement &statement,
+                                      Table &table,
+                                      std::vector<Row> &out_vec,
+                                      std::size_t num_threads,
+                                      ScanOrder order) {
+  // Counts, pages of rows, single ids and index lookups don't need to visit every leaf.
+  if (statement.count_rows || statement.id_min == statement.id_max || statement.offset > 0 || statement.limit != std::numeric_limits<uint32_t>::max()
+      || choose_index(statement, table)) {
+    return execute_select(statement, table, out_vec);
+  }
+  // Workers read a snapshot, so neither they nor the writer wait for each other.
+  Snapshot snapshot{table};
+  auto leaves = collect_leaves(snapshot, statement.id_min, statement.id_max);
+  if (num_threads == 0) {
+    num_threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  auto num_morsels = (leaves.size() + PARALLEL_SCAN_MORSEL_LEAVES - 1) / PARALLEL_SCAN_MORSEL_LEAVES;
+  num_threads = std::min(num_threads, num_morsels);
+
+  // With key order every morsel fills its own slot and the slots are joined
+  // in leaf order, otherwise every worker just fills one of its own.
+  std::vector<std::vector<Row>> results(order == ScanOrder::KEY ? num_morsels : num_threads);
+  std::atomic<std::size_t> next_morsel{0};
+  auto worker = [&](std::size_t worker_index) {
+    std::vector<char> scratch;
+    auto copy = std::make_unique<Page>();
+    auto &leaf = *copy;
+    while (true) {
+      auto morsel = next_morsel++;
+      if (morsel >= num_morsels) {
+        return;
+      }
+      auto &rows = results[order == ScanOrder::KEY ? morsel : worker_index];
+      auto end = std::min(leaves.size(), (morsel + 1) * PARALLEL_SCAN_MORSEL_LEAVES);
+      for (auto i = morsel * PARALLEL_SCAN_MORSEL_LEAVES; i < end; i++) {
+        snapshot.read_page(leaves[i], leaf);
+        auto num_cells = *leaf.num_cells();
+        for (uint32_t cell = 0; cell < num_cells; cell++) {
+          auto key = *leaf.key(cell);
+          if (key < statement.id_min || key > statement.id_max) {
+            continue;
+          }
+          auto row = read_leaf_cell(table.pager, leaf, cell, scratch, &snapshot);
+          if (!statement.matches(row)) {
+            continue;
+          }
+          rows.emplace_back();
+          deserialize_columns(row, rows.back(), statement.columns);
+        }
+      }
+    }
+  };
+
+  if (num_threads <= 1) {
+    worker(0);
+  } else {
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < num_threads; i++) {
+      threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+  std::size_t total = out_vec.size();
+  for (auto &rows : results) {
+    total += rows.size();
+  }
+  out_vec.reserve(total);
+  for (auto &rows : results) {
+    out_vec.insert(out_vec.end(), rows.begin(), rows.end());
   }
   return ExecuteResult::SUCCESS;
 }
 
 ExecuteResult execute_statement(const Statement &statement, Table &table) {
+  StatementTimer timer{table, statement.statement_type};
   switch (statement.statement_type) {
     case (Statement::INSERT):
       return execute_insert(statement, table);
-    case (Statement::SELECT):
-      std::vector<Row> select_rows;
-      ExecuteResult result = execute_select(statement, table, select_rows);
-      for (auto &row : select_rows) {
-        print_row(row);
+    case (Statement::INSERT_BATCH):
+      return execute_insert_batch(statement.rows_to_insert.data(), statement.rows_to_insert.size(), table);
+    case (Statement::CREATE_INDEX):
+      return create_index(table, statement.index_column);
+    case (Statement::DELETE):
+      return execute_delete(statement, table);
+    case (Statement::UPDATE):
+      return execute_update(statement, table);
+    case (Statement::SELECT): {
+      if (statement.count_rows) {
+        uint64_t count;
+        auto result = execute_count(statement, table, count);
+        std::cout << "(" << count << ")\n";
+        return result;
       }
-      return result;
+      // Rows are formatted straight from their leaves, and the output written out in large chunks.
+      auto results = open_select(statement, table);
+      std::string output;
+      output.reserve(OUTPUT_BUFFER_SIZE + PAGE_SIZE);
+      RowView row{};
+      while (results.next(row)) {
+        format_row(row, statement.columns, output);
+        if (output.size() >= OUTPUT_BUFFER_SIZE) {
+          std::cout.write(output.data(), output.size());
+          output.clear();
+        }
+      }
+      std::cout.write(output.data(), output.size());
+      return ExecuteResult::SUCCESS;
+    }
   }
   return ExecuteResult::UNHANDLED_STATEMENT;
 }
 
+const char *statement_type_name(Statement::StatementType type) {
+  switch (type) {
+    case Statement::INSERT:
+      return "insert";
+    case Statement::INSERT_BATCH:
+      return "insert_values";
+    case Statement::SELECT:
+      return "select";
+    case Statement::CREATE_INDEX:
+      return "create_index";
+    case Statement::DELETE:
+      return "delete";
+    case Statement::UPDATE:
+      return "update";
+  }
+  return "unknown";
+}
+
+MetricsSnapshot collect_metrics(Table &table) {
+  auto &pager = table.pager;
+  MetricsSnapshot metrics{};
+  metrics.pages_read = metric_read(pager.stats.pages_read);
+  metrics.pages_written = metric_read(pager.stats.pages_written);
+  metrics.bytes_read = metric_read(pager.stats.bytes_read);
+  metrics.bytes_written = metric_read(pager.stats.bytes_written);
+  metrics.cache_hits = metric_read(pager.stats.hits);
+  metrics.cache_misses = metric_read(pager.stats.misses);
+  metrics.evictions = metric_read(pager.stats.evictions);
+  metrics.readaheads = metric_read(pager.stats.readaheads);
+  metrics.filter_skips = metric_read(pager.stats.filter_skips);
+  if (table.row_cache) {
+    metrics.row_cache_hits = metric_read(table.row_cache->hits);
+    metrics.row_cache_misses = metric_read(table.row_cache->misses);
+  }
+  metrics.leaf_splits = metric_read(table.stats.leaf_splits);
+  metrics.internal_splits = metric_read(table.stats.internal_splits);
+  metrics.root_splits = metric_read(table.stats.root_splits);
+  metrics.merges = metric_read(table.stats.merges);
+  metrics.redistributions = metric_read(table.stats.redistributions);
+  metrics.num_pages = pager.num_pages;
+
+  // Down the right edge with shared latches, like any reader.
+  metrics.tree_depth = 1;
+  {
+    PinScope scope{pager};
+    PageLatch latch{pager, table.root_page_num, false};
+    while (latch.page->node_type() == Page::NodeType::INTERNAL) {
+      latch = PageLatch{pager, *latch.page->right_child(), false};
+      metrics.tree_depth++;
+    }
+  }
+
+  for (std::size_t i = 0; i < STATEMENT_TYPE_COUNT; i++) {
+    auto &histogram = table.stats.statement_latency[i];
+    auto &summary = metrics.statements[i];
+    summary.count = metric_read(histogram.count);
+    summary.mean_ns = summary.count == 0 ? 0 : metric_read(histogram.total_ns) / summary.count;
+    summary.p50_ns = histogram.percentile(0.50);
+    summary.p90_ns = histogram.percentile(0.90);
+    summary.p99_ns = histogram.percentile(0.99);
+    summary.max_ns = metric_read(histogram.max_ns);
+  }
+  return metrics;
+}
+
+void print_metrics(const MetricsSnapshot &metrics) {
+  std::cout << "pages_read: " << metrics.pages_read << '\n';
+  std::cout << "pages_written: " << metrics.pages_written << '\n';
+  std::cout << "bytes_read: " << metrics.bytes_read << '\n';
+  std::cout << "bytes_written: " << metrics.bytes_written << '\n';
+  std::cout << "cache_hits: " << metrics.cache_hits << '\n';
+  std::cout << "cache_misses: " << metrics.cache_misses << '\n';
+  std::cout << "evictions: " << metrics.evictions << '\n';
+  std::cout << "readaheads: " << metrics.readaheads << '\n';
+  std::cout << "filter_skips: " << metrics.filter_skips << '\n';
+  std::cout << "row_cache_hits: " << metrics.row_cache_hits << '\n';
+  std::cout << "row_cache_misses: " << metrics.row_cache_misses << '\n';
+  std::cout << "leaf_splits: " << metrics.leaf_splits << '\n';
+  std::cout << "internal_splits: " << metrics.internal_splits << '\n';
+  std::cout << "root_splits: " << metrics.root_splits << '\n';
+  std::cout << "merges: " << metrics.merges << '\n';
+  std::cout << "redistributions: " << metrics.redistributions << '\n';
+  std::cout << "tree_depth: " << metrics.tree_depth << '\n';
+  std::cout << "num_pages: " << metrics.num_pages << '\n';
+  for (std::size_t i = 0; i < STATEMENT_TYPE_COUNT; i++) {
+    auto &summary = metrics.statements[i];
+    if (summary.count == 0) {
+      continue;
+    }
+    std::cout << statement_type_name(static_cast<Statement::StatementType>(i)) << ": count " << summary.count
+              << ", mean " << summary.mean_ns << " ns, p50 " << summary.p50_ns << " ns, p90 " << summary.p90_ns
+              << " ns, p99 " << summary.p99_ns << " ns, max " << summary.max_ns << " ns\n";
+  }
+}
+
 void print_constants() {
-  std::cout << "ROW_SIZE: " << ROW_SIZE << '\n';
+  std::cout << "ROW_MAX_PAYLOAD_SIZE: " << ROW_MAX_PAYLOAD_SIZE << '\n';
   std::cout << "COMMON_NODE_HEADER_SIZE: " << COMMON_NODE_HEADER_SIZE << '\n';
   std::cout << "LEAF_NODE_HEADER_SIZE: " << LEAF_NODE_HEADER_SIZE << '\n';
-  std::cout << "LEAF_NODE_CELL_SIZE: " << LEAF_NODE_CELL_SIZE << '\n';
   std::cout << "LEAF_NODE_SPACE_FOR_CELLS: " << LEAF_NODE_SPACE_FOR_CELLS << '\n';
-  std::cout << "LEAF_NODE_MAX_CELLS: " << LEAF_NODE_MAX_CELLS << '\n';
+  std::cout << "LEAF_NODE_MAX_LOCAL: " << LEAF_NODE_MAX_LOCAL << '\n';
+  std::cout << "LEAF_NODE_MAX_CELL_SIZE: " << LEAF_NODE_MAX_CELL_SIZE << '\n';
 }
\ No newline at end of file
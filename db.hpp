@@ -7,15 +7,35 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <optional>
 #include <array>
 #include <vector>
 #include <fstream>
+#include <unordered_map>
+#include <limits>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <unordered_set>
+
+#include "bloom.hpp"
+#include "metrics.hpp"
+#include "uring.hpp"
+#include "wal.hpp"
 
 enum class ExecuteResult {
   SUCCESS,
   DUPLICATE_KEY,
   TABLE_FULL,
+  UNSORTED_INPUT,
+  TABLE_NOT_EMPTY,
+  INDEX_EXISTS,
   UNHANDLED_STATEMENT
 };
 
@@ -41,33 +61,128 @@ struct Row {
   std::array<char, COLUMN_EMAIL_SIZE + 1> email;
 };
 
+const uint32_t ID_SIZE = sizeof(Row::id);
+const uint32_t USERNAME_SIZE = sizeof(Row::username);
+const uint32_t EMAIL_SIZE = sizeof(Row::email);
+
+// Columns a secondary index can be built on.
+enum class IndexColumn {
+  USERNAME,
+  EMAIL
+};
+
+const std::size_t INDEX_COLUMN_COUNT = 2;
+
+// Serialized rows are a payload of length-prefixed columns,
+// [uint8 length][username][uint8 length][email]. The id is the cell's key.
+const uint32_t COLUMN_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t ROW_MAX_PAYLOAD_SIZE = 2 * COLUMN_LENGTH_SIZE + Row::COLUMN_USERNAME_SIZE + Row::COLUMN_EMAIL_SIZE;
+
+// A row decoded in place. The strings point into the leaf, or into a scratch
+// buffer when part of the payload had to be read back from overflow pages.
+struct RowView {
+  uint32_t id;
+  std::string_view username;
+  std::string_view email;
+};
+
+// Column bits for a select projection.
+const uint8_t COLUMN_ID = 1 << 0;
+const uint8_t COLUMN_USERNAME = 1 << 1;
+const uint8_t COLUMN_EMAIL = 1 << 2;
+const uint8_t ALL_COLUMNS = COLUMN_ID | COLUMN_USERNAME | COLUMN_EMAIL;
+
+// A where clause term, checked against a RowView of a cell so rows are only
+// deserialized once they match.
+struct Predicate {
+  enum class Column {
+    ID,
+    USERNAME,
+    EMAIL
+  };
+
+  enum class Op {
+    EQ,
+    NE,
+    LT,
+    LE,
+    GT,
+    GE,
+    PREFIX // like '<value>%', text columns only
+  };
+
+  Column column;
+  Op op;
+  uint32_t id_value;
+  std::string text_value;
+
+  bool matches(const RowView &row) const;
+};
+
 struct Statement {
   enum StatementType {
     INSERT,
-    SELECT
+    INSERT_BATCH,
+    SELECT,
+    CREATE_INDEX,
+    DELETE,
+    UPDATE
   };
 
   StatementType statement_type;
-  Row row_to_insert; // only used by insert statement
+  Row row_to_insert; // only used by insert statement, and by update for the new values
+  std::vector<Row> rows_to_insert; // only used by insert values
+  IndexColumn index_column = IndexColumn::USERNAME; // only used by create index
+  // Select, delete and update. Id terms of the where clause are folded into
+  // [id_min, id_max], everything else stays in predicates.
+  uint32_t id_min = 0;
+  uint32_t id_max = std::numeric_limits<uint32_t>::max();
+  std::vector<Predicate> predicates;
+  uint8_t columns = ALL_COLUMNS;
+  uint8_t update_columns = 0; // columns an update sets to row_to_insert's values
+  // Select only: count(*) instead of the rows, and which of the matching rows to return.
+  bool count_rows = false;
+  uint32_t limit = std::numeric_limits<uint32_t>::max();
+  uint32_t offset = 0;
+
+  bool matches(const RowView &row) const;
+};
+
+const std::size_t STATEMENT_TYPE_COUNT = Statement::UPDATE + 1;
+
+const char *statement_type_name(Statement::StatementType type);
+
+// Where the value bound to a ? placeholder goes.
+struct Parameter {
+  enum class Target {
+    INSERT_ID,
+    INSERT_USERNAME,
+    INSERT_EMAIL,
+    PREDICATE // id_value or text_value of predicates[predicate]
+  };
+
+  Target target;
+  std::size_t predicate;
 };
 
-const uint32_t ID_SIZE = sizeof(Row::id);
-const uint32_t USERNAME_SIZE = sizeof(Row::username);
-const uint32_t EMAIL_SIZE = sizeof(Row::email);
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 const uint32_t PAGE_SIZE = 4096;
-const uint32_t TABLE_MAX_PAGES = 100;
+const std::size_t DEFAULT_POOL_FRAMES = 100;
+const std::size_t MMAP_INITIAL_RESERVE = std::size_t(1) << 40;
+const std::size_t MMAP_MIN_GROWTH_PAGES = 16;
+// Sibling leaves a scan reads in one batch ahead of itself, io_uring backend only.
+const std::size_t DEFAULT_READAHEAD_LEAVES = 8;
 
 struct Page {
   enum class NodeType {
     INTERNAL,
-    LEAF
+    LEAF,
+    OVERFLOW,
+    HEADER,
+    INDEX_LEAF,
+    INDEX_INTERNAL,
+    FREELIST_TRUNK
   };
 
-  bool cached;
   std::array<char, PAGE_SIZE> data;
 
   explicit Page(NodeType type = NodeType::LEAF);
@@ -77,15 +192,43 @@ struct Page {
 
   uint32_t *num_cells();
 
+  uint32_t *next_leaf();
+
+  uint16_t *cell_content_start();
+
+  uint32_t *keys();
+
+  uint16_t *slots();
+
   char *cell(std::size_t cell_num);
 
-  char* value(std::size_t cell_num);
+  uint32_t free_space();
+
+  uint32_t *next_overflow();
+
+  uint32_t *index_roots();
+
+  uint32_t *freelist_trunk();
+
+  uint32_t *freelist_count();
+
+  uint32_t *trunk_next();
+
+  uint32_t *trunk_num_pages();
+
+  uint32_t *trunk_pages();
 
   uint32_t *num_keys();
 
-  char *right_child();
+  uint32_t *right_child();
+
+  uint32_t *child(uint32_t child_num);
+
+  // Rows in the subtree under child(child_num).
+  uint32_t *child_count(uint32_t child_num);
 
-  char *child(uint32_t child_num);
+  // Rows in this node's subtree: its cells, or the sum of its children's counts.
+  uint64_t row_count();
 
   uint32_t *key(std::size_t key_num);
 
@@ -94,40 +237,362 @@ struct Page {
   bool is_root();
 
   void root(bool is_root);
+
+  uint32_t *parent();
+};
+
+// The mmap backend hands out pages that live directly in the file mapping.
+static_assert(sizeof(Page) == PAGE_SIZE, "Page must be exactly one page of raw bytes");
+
+// A buffer pool slot. Unpinned frames are recycled with the CLOCK algorithm,
+// dirty victims are written back before their frame is reused. Everything but
+// the page contents, pin_count and latch is guarded by Pager::mutex.
+struct Frame {
+  Page page;
+  std::size_t page_num = 0;
+  std::atomic<uint32_t> pin_count{0};
+  bool in_use = false;
+  bool dirty = false;
+  bool referenced = false;
+  std::shared_mutex latch; // protects the page contents from concurrent readers and the writer
+};
+
+enum class PagerBackend {
+  BUFFER_POOL,
+  MMAP,
+  IO_URING // the buffer pool, with batched reads and writes through io_uring and scan read-ahead
+};
+
+// Bumped with metric_add and safe to read from any thread. I/O counts cover
+// the database file and the log, the mmap backend's is left to the kernel.
+// Bytes are page contents either way, a log frame's header isn't counted.
+struct PagerStats {
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> evictions{0};
+  std::atomic<uint64_t> writebacks{0};
+  std::atomic<uint64_t> readaheads{0}; // pages read ahead of a scan
+  std::atomic<uint64_t> filter_skips{0}; // lookups a leaf's filter answered without fetching the leaf
+  std::atomic<uint64_t> pages_read{0};
+  std::atomic<uint64_t> pages_written{0};
+  std::atomic<uint64_t> bytes_read{0};
+  std::atomic<uint64_t> bytes_written{0};
+};
+
+// A page's contents as committed before the writer first touched it in the
+// statement that ended with commit sequence number superseded_seq.
+struct PageVersion {
+  uint64_t superseded_seq;
+  std::unique_ptr<Page> image;
+};
+
+// Old page images kept for open snapshots, everything guarded by mutex.
+struct VersionStore {
+  std::mutex mutex;
+  uint64_t commit_seq = 0; // statements the writer has finished
+  std::multiset<uint64_t> snapshots; // commit sequence numbers of the open snapshots
+  std::unordered_map<std::size_t, std::vector<PageVersion>> versions; // oldest first
+  std::unordered_set<std::size_t> saved; // pages saved by the writer's current statement
+};
+
+// Bloom filters over the keys of leaves, kept apart from the frames so they
+// outlive eviction and spare the read of a leaf that isn't cached. The first
+// lookup reaching a leaf builds its filter, changing the leaf drops it until
+// the end of the statement, which builds it again. At most one per leaf.
+struct FilterStripe {
+  std::mutex mutex;
+  std::unordered_map<std::size_t, KeyFilter> filters; // page_num -> filter
 };
 
+const std::size_t FILTER_STRIPES = 64; // so lookups of different leaves rarely wait on each other
+
+struct PageLatch;
+
 struct Pager {
+  PagerBackend backend;
+  std::string filename;
+  std::recursive_mutex mutex; // guards the page table, frame metadata, file I/O and the log
   std::fstream file;
   std::size_t file_length;
-  std::size_t num_pages;
-  std::array<Page, TABLE_MAX_PAGES> pages;
-
-  explicit Pager(const std::string &filename);
-
+  std::atomic<std::size_t> num_pages;
+  int fd;            // mmap and io_uring backends only
+  char *map;         // start of the reserved mapping
+  std::size_t map_size;
+  std::size_t file_capacity; // file size on disk, grown ahead of num_pages
+  std::deque<std::shared_mutex> page_latches; // mmap backend only, one per page
+  std::vector<Frame> frames;
+  std::unordered_map<std::size_t, std::size_t> page_table; // page_num -> frame index
+  std::size_t clock_hand;
+  std::vector<std::size_t> dirty_frames; // frames dirtied since the last commit, may hold stale entries
+  std::vector<bool> dirty_pages; // mmap backend only, pages changed since the last flush
+  std::vector<std::atomic<bool>> verified_pages; // mmap backend only, pages found in the file at open that were checked
+  std::optional<Wal> wal;
+  std::optional<IoRing> ring; // io_uring backend only
+  std::size_t readahead_leaves;
+  uint32_t max_local; // payload bytes a new leaf cell keeps before the rest spills to overflow pages
+  PagerStats stats;
+  VersionStore versions;
+  std::array<FilterStripe, FILTER_STRIPES> filters; // by page_num % FILTER_STRIPES
+  std::vector<std::size_t> stale_filters; // pages changed by the writer's statement, may repeat
+
+  explicit Pager(const std::string &filename,
+                 std::size_t pool_frames = DEFAULT_POOL_FRAMES,
+                 PagerBackend backend = PagerBackend::BUFFER_POOL,
+                 const WalOptions &wal_options = WalOptions{});
+  ~Pager();
+
+  Pager(const Pager &) = delete;
+  Pager &operator=(const Pager &) = delete;
+
+  // The returned reference stays valid until the innermost open PinScope closes.
+  // Outside of any PinScope it is only valid until the next call to get_page.
+  // Reading a page another thread may be writing also needs its latch, see PageLatch.
   Page &get_page(std::size_t page_num);
 
+  // Needed after changing a page with any backend: the buffer pool writes it
+  // back, the mmap backend restamps its checksum right away.
+  void mark_dirty(std::size_t page_num);
+
   void flush(std::size_t page_num);
 
+  void flush_all();
+
+  // Ends a statement. With a write-ahead log every page it dirtied is
+  // appended to the log, otherwise pages stay cached until flushed.
+  void commit();
+
+  // Copies the committed contents of the write-ahead log into the database file.
+  void checkpoint();
+
+  void close();
+
+  // Page for a new node: the last one freed, zeroed, or else the next one
+  // past the end of the file. Writer only.
   std::size_t get_unused_page_num();
 
+  // Puts a page nothing refers to anymore on the free list. Writer only.
+  void free_page(std::size_t page_num);
+
+  // Pages on the free list, trunks included.
+  std::size_t free_page_count();
+
+  // Shrinks the file to page_count pages, dropping any cached page past them.
+  void truncate(std::size_t page_count);
+
+  void open_mapping(const std::string &filename);
+
+  Page &mapped_page(std::size_t page_num);
+
+  void grow_mapping(std::size_t min_size);
+
+  std::size_t find_victim();
+
+  void write_frame(Frame &frame);
+
+  // Exits if a page just read from the file or the log, or first mapped, fails its checksum.
+  void verify_loaded_page(std::size_t page_num, const char *data);
+
+  // Whole pages to and from the database file, buffer pool backends only.
+  void read_file_page(std::size_t page_num, char *data);
+
+  void write_file_page(std::size_t page_num, const char *data);
+
+  // Writes the requests in offset order, in one batch with io_uring.
+  void write_file_pages(std::vector<IoRequest> &writes);
+
+  // Reads the uncached pages among page_nums into the pool in one batch.
+  // Does nothing unless the backend is io_uring.
+  void prefetch(const uint32_t *page_nums, std::size_t count);
+
   void print_tree(uint32_t page_num, uint32_t indentation_level);
+
+  // Whether page_num has a filter and key certainly isn't in it. Only leaves
+  // have filters, so it can be asked before the page is fetched.
+  bool filter_excludes(std::size_t page_num, uint32_t key);
+
+  // Filter for a latched leaf, unless it has one already.
+  void build_filter(const PageLatch &leaf);
+
+  // Replaces the filter of page_num with one over the keys of leaf.
+  void set_filter(std::size_t page_num, Page &leaf);
+  void drop_filter(std::size_t page_num);
+
+  // Bracket one statement of the writer, see WriteScope. While snapshots are
+  // open, every existing page the statement fetches is saved first. At the
+  // end, the leaves it changed that are still cached get their filters back.
+  void begin_write();
+  void end_write();
+
+  // Copy of the page before the writer's get_page hands it out to be changed.
+  void save_version(std::size_t page_num, const Page &page);
+
+  // Copies the page as it was after commit sequence number seq into out.
+  void read_version(std::size_t page_num, uint64_t seq, Page &out);
+
+  // Registers a snapshot of the last commit and returns its sequence number.
+  // Caller holds the writer mutex so no statement is halfway done.
+  uint64_t open_snapshot();
+
+  // Drops the snapshot and every version no open snapshot can read anymore.
+  void close_snapshot(uint64_t seq);
+
+  // Caller holds versions.mutex.
+  void collect_versions();
+};
+
+// Pins every page the current thread fetches while it is alive so that
+// references obtained from Pager::get_page can't be evicted out from under it.
+struct PinScope {
+  Pager &pager;
+  std::size_t mark;
+
+  explicit PinScope(Pager &pager);
+  ~PinScope();
+
+  PinScope(const PinScope &) = delete;
+  PinScope &operator=(const PinScope &) = delete;
+};
+
+// Pins a page and holds its reader/writer latch until destroyed or released.
+// Readers crab down the tree with shared latches, taking the child's latch
+// before letting go of the parent's. The single writer takes exclusive ones.
+struct PageLatch {
+  Pager *pager;
+  std::size_t page_num;
+  Page *page;
+  std::shared_mutex *latch;
+  Frame *frame; // buffer pool only, to drop the pin again
+  bool exclusive;
+
+  PageLatch();
+  PageLatch(Pager &pager, std::size_t page_num, bool exclusive);
+  // Shared, and only if that doesn't mean waiting. latch is null if it failed.
+  PageLatch(Pager &pager, std::size_t page_num, std::try_to_lock_t);
+  PageLatch(PageLatch &&other) noexcept;
+  PageLatch &operator=(PageLatch &&other) noexcept;
+  ~PageLatch();
+
+  void release();
+};
+
+struct RowCache;
+
+// Structural changes to the table's tree and how long statements take,
+// bumped with metric_add like PagerStats.
+struct TreeStats {
+  std::atomic<uint64_t> leaf_splits{0};
+  std::atomic<uint64_t> internal_splits{0};
+  std::atomic<uint64_t> root_splits{0}; // the tree grew a level
+  std::atomic<uint64_t> merges{0};
+  std::atomic<uint64_t> redistributions{0};
+  // Statements run through execute_statement or PreparedStatement::execute, by type.
+  std::array<LatencyHistogram, STATEMENT_TYPE_COUNT> statement_latency;
 };
 
 struct Table {
   Pager pager;
   std::size_t root_page_num;
+  std::mutex writer_mutex; // one writer at a time, see WriteScope, readers only take latches
+  // Root page of the index on each column, 0 if there is none. Mirrors the header page.
+  std::array<std::atomic<uint32_t>, INDEX_COLUMN_COUNT> index_roots;
+  TreeStats stats;
+  std::unique_ptr<RowCache> row_cache; // null unless asked for, see RowCache
+
+  // A row_cache_rows above 0 keeps that many recently looked up rows in memory.
+  explicit Table(const std::string &filename,
+                 std::size_t pool_frames = DEFAULT_POOL_FRAMES,
+                 PagerBackend backend = PagerBackend::BUFFER_POOL,
+                 const WalOptions &wal_options = WalOptions{},
+                 std::size_t row_cache_rows = 0);
+  ~Table();
+
+  // Builds the tree bottom-up from rows sorted by strictly increasing id.
+  // Only allowed on an empty table. Leaves and internal nodes are packed to
+  // fill_factor of their capacity, leaving room for later inserts.
+  template<typename ForwardIt>
+  ExecuteResult bulk_load(ForwardIt first, ForwardIt last, double fill_factor = 1.0);
+
+  ExecuteResult bulk_load_rows(const std::vector<uint16_t> &cell_sizes,
+                               double fill_factor,
+                               const std::function<const Row &()> &next_row);
+};
+
+// The writer's hold on a table for one statement that changes it: the writer
+// mutex, and page versions for the open snapshots. Ends with the next commit
+// sequence number, and with a write-ahead log waits for the commit to be on
+// disk after letting go of the writer mutex.
+struct WriteScope {
+  std::unique_lock<std::mutex> writer;
+  Pager &pager;
+
+  explicit WriteScope(Table &table);
+  ~WriteScope();
+
+  WriteScope(const WriteScope &) = delete;
+  WriteScope &operator=(const WriteScope &) = delete;
+};
+
+// The table as of the last commit before it was taken. Reads through it take
+// no latches and never wait for the writer: pages changed since come from the
+// copies the writer saved before touching them, which are dropped once the
+// last snapshot needing them closes. Taking one waits for the statement in
+// progress, if any, to finish.
+struct Snapshot {
+  Table &table;
+  uint64_t seq;
+
+  explicit Snapshot(Table &table);
+  ~Snapshot();
+
+  Snapshot(const Snapshot &) = delete;
+  Snapshot &operator=(const Snapshot &) = delete;
 
-  explicit Table(const std::string &filename);
+  void read_page(std::size_t page_num, Page &out) const;
 };
 
+uint32_t row_payload_size(const Row &row);
+
+// Size of the cell a payload of payload_size bytes gets from the pager.
+uint32_t leaf_cell_size(const Pager &pager, uint32_t payload_size);
+
+// Size of a cell already in a leaf.
+uint32_t leaf_cell_size(const char *cell);
+
+// Where a spilled cell keeps the first page of its overflow chain, null for a
+// cell kept whole in its leaf.
+uint32_t *leaf_cell_overflow_page(const char *cell);
+
+template<typename ForwardIt>
+ExecuteResult Table::bulk_load(ForwardIt first, ForwardIt last, double fill_factor) {
+  auto out_of_order = std::adjacent_find(first, last, [](const Row &a, const Row &b) { return a.id >= b.id; });
+  if (out_of_order != last) {
+    return out_of_order->id == std::next(out_of_order)->id ? ExecuteResult::DUPLICATE_KEY
+                                                           : ExecuteResult::UNSORTED_INPUT;
+  }
+  // Leaves are cut by bytes, so their sizes have to be known before the levels are laid out.
+  std::vector<uint16_t> cell_sizes;
+  cell_sizes.reserve(std::distance(first, last));
+  for (auto it = first; it != last; ++it) {
+    cell_sizes.push_back(leaf_cell_size(pager, row_payload_size(*it)));
+  }
+  return bulk_load_rows(cell_sizes, fill_factor, [&first]() -> const Row & { return *first++; });
+}
+
 struct Cursor {
   Table &table;
   std::size_t page_num;
   std::size_t cell_num;
   bool end_of_table;
+  PageLatch leaf; // shared latch on the current leaf while scanning
+  std::vector<char> scratch; // reassembled payloads of overflowing cells
+  std::size_t readahead_left = 0; // leaves still covered by the last read-ahead
+  const Snapshot *snapshot = nullptr; // set on cursors reading a snapshot
+  std::unique_ptr<Page> snapshot_leaf; // their copy of the current leaf
 
-  char *value();
+  RowView value();
   void advance();
+  void skip_finished_leaves();
+  void read_ahead();
 };
 
 // Common node header layout
@@ -137,65 +602,379 @@ const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
 const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const uint32_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+// CRC32C of the rest of the page, stamped when the page is written out and
+// checked when it is read back. An all zero page has none and is accepted.
+const uint32_t PAGE_CHECKSUM_SIZE = sizeof(uint32_t);
+const uint32_t PAGE_CHECKSUM_OFFSET = PARENT_POINTER_OFFSET + PARENT_POINTER_SIZE;
+const uint32_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE + PAGE_CHECKSUM_SIZE;
 
 // Leaf node header layout
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
-
-// Leaf node body layout
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CELL_CONTENT_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_CELL_CONTENT_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE
+    + LEAF_NODE_CELL_CONTENT_SIZE;
+
+// Both node types keep their keys in one packed array right after the
+// header, apart from the row payloads or child pointers, so a search scans
+// contiguous keys. The array starts on a 16 byte boundary.
+const uint32_t NODE_KEYS_OFFSET = 32;
+static_assert(LEAF_NODE_HEADER_SIZE <= NODE_KEYS_OFFSET, "leaf header overlaps the key array");
+
+// Leaf node body layout: a slotted page. keys[num_cells] and the cell pointer
+// array slots[num_cells] grow up from NODE_KEYS_OFFSET, the cells the slots
+// point at grow down from the end of the page to cell_content_start. A cell
+// is a uint16 payload size and the payload. A payload over the pager's
+// max_local spills: its size has LEAF_NODE_SPILLED set and is followed by how
+// many bytes stay in the cell, those bytes and the first page of an overflow
+// chain holding the rest. Cells describe themselves, so the limit only
+// decides how new rows are stored. An overflow page only ever holds one
+// payload's tail, so by default the limit is the largest row payload and rows
+// never spill.
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = LEAF_NODE_MAX_CELLS + 1 - LEAF_NODE_RIGHT_SPLIT_COUNT;
+const uint32_t LEAF_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_PAYLOAD_SIZE_SIZE = sizeof(uint16_t);
+const uint16_t LEAF_NODE_SPILLED = 0x8000;
+const uint32_t LEAF_NODE_LOCAL_SIZE_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_MAX_LOCAL = ROW_MAX_PAYLOAD_SIZE; // the default max_local
+const uint32_t LEAF_NODE_OVERFLOW_POINTER_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_MAX_CELL_SIZE =
+    LEAF_NODE_PAYLOAD_SIZE_SIZE + LEAF_NODE_LOCAL_SIZE_SIZE + ROW_MAX_PAYLOAD_SIZE + LEAF_NODE_OVERFLOW_POINTER_SIZE;
+const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - NODE_KEYS_OFFSET;
+// Most space a single insert can take: the cell, its key and its slot.
+const uint32_t LEAF_NODE_MAX_CELL_SPACE = LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE + LEAF_NODE_MAX_CELL_SIZE;
+
+// Header page layout. Page 0 describes the file, the table's root is always page 1.
+const uint32_t HEADER_PAGE_NUM = 0;
+const uint32_t TABLE_ROOT_PAGE_NUM = 1;
+const uint32_t HEADER_INDEX_ROOT_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_INDEX_ROOTS_OFFSET = COMMON_NODE_HEADER_SIZE; // one per IndexColumn
+const uint32_t HEADER_FREELIST_TRUNK_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_FREELIST_TRUNK_OFFSET = HEADER_INDEX_ROOTS_OFFSET + INDEX_COLUMN_COUNT * HEADER_INDEX_ROOT_SIZE;
+const uint32_t HEADER_FREELIST_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_FREELIST_COUNT_OFFSET = HEADER_FREELIST_TRUNK_OFFSET + HEADER_FREELIST_TRUNK_SIZE;
+
+// Free list trunk page layout: the common header, the next trunk (0 ends the
+// list), how many free pages this trunk lists and then their page numbers.
+// The listed pages themselves are never written while free.
+const uint32_t FREELIST_TRUNK_NEXT_SIZE = sizeof(uint32_t);
+const uint32_t FREELIST_TRUNK_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t FREELIST_TRUNK_NUM_PAGES_SIZE = sizeof(uint32_t);
+const uint32_t FREELIST_TRUNK_NUM_PAGES_OFFSET = FREELIST_TRUNK_NEXT_OFFSET + FREELIST_TRUNK_NEXT_SIZE;
+const uint32_t FREELIST_TRUNK_PAGES_OFFSET = FREELIST_TRUNK_NUM_PAGES_OFFSET + FREELIST_TRUNK_NUM_PAGES_SIZE;
+const uint32_t FREELIST_TRUNK_CAPACITY = (PAGE_SIZE - FREELIST_TRUNK_PAGES_OFFSET) / sizeof(uint32_t);
+
+// Overflow page layout: the common header, the next page of the chain (0 ends it), then payload bytes.
+const uint32_t OVERFLOW_NEXT_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t OVERFLOW_NEXT_PAGE_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t OVERFLOW_HEADER_SIZE = OVERFLOW_NEXT_PAGE_OFFSET + OVERFLOW_NEXT_PAGE_SIZE;
+const uint32_t OVERFLOW_PAGE_CAPACITY = PAGE_SIZE - OVERFLOW_HEADER_SIZE;
 
 // Internal node header layout
 const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_COUNT_OFFSET = INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
 const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-    INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+    INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE + INTERNAL_NODE_COUNT_SIZE;
 
-// Internal node body layout
+static_assert(INTERNAL_NODE_HEADER_SIZE <= NODE_KEYS_OFFSET, "internal header overlaps the key array");
+
+// Internal node body layout: keys[INTERNAL_NODE_MAX_KEYS], children[INTERNAL_NODE_MAX_KEYS]
+// then counts[INTERNAL_NODE_MAX_KEYS], the number of rows under each child.
+// The right child's count is in the header.
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_COUNT_SIZE;
+const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - NODE_KEYS_OFFSET;
+const uint32_t INTERNAL_NODE_MAX_KEYS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+const uint32_t INTERNAL_NODE_CHILDREN_OFFSET = NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_KEYS * INTERNAL_NODE_KEY_SIZE;
+const uint32_t INTERNAL_NODE_COUNTS_OFFSET = INTERNAL_NODE_CHILDREN_OFFSET + INTERNAL_NODE_MAX_KEYS * INTERNAL_NODE_CHILD_SIZE;
+
+// A node left below these by a delete is merged with a sibling, or takes
+// entries from it when the two don't fit in one page.
+const uint32_t LEAF_NODE_MIN_USED_SPACE = LEAF_NODE_SPACE_FOR_CELLS / 3;
+const uint32_t INTERNAL_NODE_MIN_CHILDREN = (INTERNAL_NODE_MAX_KEYS + 1) / 3;
+
+// Parallel scans hand out work in runs of this many consecutive leaves.
+const std::size_t PARALLEL_SCAN_MORSEL_LEAVES = 16;
+
+enum class ScanOrder {
+  KEY, // rows come back sorted by id
+  ANY  // rows come back in whatever order the workers finish
+};
 
 void leaf_node_insert(Cursor &cursor, uint32_t key, const Row &value);
 
-void leaf_node_split_and_insert(Cursor, uint32_t key, const Row &value);
+void leaf_node_split_and_insert(const Cursor &cursor, uint32_t key, const char *cell, uint32_t cell_size);
+
+// Splits a leaf in two and adds count cells, packed back to back in cells,
+// with ascending keys none of which is in the leaf yet. They have to fit in
+// the two halves together with the leaf's own cells.
+void leaf_node_split_and_merge(Table &table,
+                               std::size_t page_num,
+                               const uint32_t *keys,
+                               const char *cells,
+                               const uint16_t *cell_sizes,
+                               uint32_t count);
 
 Cursor leaf_node_find(Table &table, std::size_t page_num, uint32_t key);
 
+uint32_t internal_node_find_child(Page &node, uint32_t key);
+
+void internal_node_insert(Table &table, std::size_t parent_page_num, std::size_t child_page_num);
+
+void internal_node_split_and_insert(Table &table, std::size_t page_num, std::size_t child_page_num);
+
+// Makes node the parent of children[begin, end), given as (page_num, max key) pairs.
+void internal_node_fill(Pager &pager,
+                        Page &node,
+                        std::size_t node_page_num,
+                        const std::vector<std::pair<uint32_t, uint32_t>> &children,
+                        std::size_t begin,
+                        std::size_t end);
+
+void create_new_root(Table &table, std::size_t right_child_page_num);
+
+uint32_t get_node_max_key(Pager &pager, std::size_t page_num);
+
+uint32_t tree_depth(Table &table);
+
 void print_constants();
 
 void print_leaf_node(Page &page);
 
-void print_row(const Row &row);
+void print_row(const Row &row, uint8_t columns = ALL_COLUMNS);
 
-void serialize_row(const Row &source, char *destination);
+// Appends the row to out as print_row prints it.
+void format_row(const RowView &row, uint8_t columns, std::string &out);
 
+// Selects printed by execute_statement go to std::cout in writes of about this size.
+const std::size_t OUTPUT_BUFFER_SIZE = 64 * 1024;
+
+// Writes the row's payload and returns its size. The id is not part of it.
+uint32_t serialize_row(const Row &source, char *destination);
+
+// Fills in the username and email from a payload.
 void deserialize_row(const char *source, Row &destination);
 
+void deserialize_row(const RowView &source, Row &destination);
+
+// Copies only the given columns out of a decoded row.
+void deserialize_columns(const RowView &source, Row &destination, uint8_t columns);
+
+// Encodes row as a leaf cell into cell, spilling the payload past the pager's
+// max_local to overflow pages from the pager, or numbered from
+// *next_overflow_page on when given.
+uint32_t build_leaf_cell(Pager &pager, const Row &row, char *cell, std::size_t *next_overflow_page = nullptr);
+
+RowView read_leaf_cell(Pager &pager,
+                       Page &leaf,
+                       uint32_t cell_num,
+                       std::vector<char> &scratch,
+                       const Snapshot *snapshot = nullptr);
+
+// Puts a cell into a leaf that has room for it, at position cell_num.
+void leaf_node_insert_cell(Page &node, uint32_t cell_num, uint32_t key, const char *cell, uint32_t cell_size);
+
+// Adds count cells, packed back to back in cells, to a leaf that has room for
+// all of them. Their keys are ascending and none is in the leaf yet.
+void leaf_node_merge_cells(Page &node,
+                           const uint32_t *keys,
+                           const char *cells,
+                           const uint16_t *cell_sizes,
+                           uint32_t count);
+
+// Takes cell cell_num out of a leaf, the space it used is free right away.
+void leaf_node_remove_cell(Page &node, uint32_t cell_num);
+
+// Returns the pages of a cell's overflow chain to the free list.
+void free_overflow_chain(Pager &pager, const char *cell);
+
 Cursor table_start(Table &table);
 
+Cursor table_find(Table &table, uint32_t key);
+
+// Rows with an id below key, found in one descent by adding up the counts
+// of the children left of the path. Inserts count their row on the way down,
+// so one in progress may already be included.
+uint64_t table_rank(Table &table, uint32_t key);
+
+uint64_t table_row_count(Table &table);
+
+// Cursor on the row at position, counting from 0 in id order, found by
+// descending through the subtree counts. Past the last row it is at the end.
+Cursor table_seek_position(Table &table, uint64_t position);
+
+// Adds rows_added to the count of every child the descent passes through,
+// for the rows the caller is about to put in the leaf.
+Cursor table_find_for_write(Table &table, uint32_t key, std::vector<PageLatch> &path, int32_t rows_added = 0);
+
+Cursor table_seek(Table &table, uint32_t key);
+
+// Cursors over a snapshot, their rows stay valid while the snapshot is open.
+Cursor table_find(const Snapshot &snapshot, uint32_t key);
+
+Cursor table_seek(const Snapshot &snapshot, uint32_t key);
+
+// Cursor on the row with id key, if there is one. The leaf's filter, when it
+// has one, rules most missing keys out before the leaf is fetched.
+std::optional<Cursor> table_lookup(Table &table, uint32_t key);
+
+// Removes the row with id key, copying it to old_row when given, and merges
+// or rebalances the nodes it leaves underfull. Returns false if there is no
+// such row. Caller holds the writer mutex.
+bool table_delete(Table &table, uint32_t key, Row *old_row = nullptr);
+
+// Replaces the row with row.id. Returns false if there is no such row.
+// Caller holds the writer mutex.
+bool table_update(Table &table, const Row &row);
+
 void db_close(Table &table);
 
+uint32_t page_checksum(const char *data);
+
+void stamp_page_checksum(char *data);
+
+bool page_checksum_valid(const char *data);
+
+// Writes everything out, then reads every page of the file back on
+// num_threads threads (0 for one per core) and returns the page numbers
+// whose checksum doesn't match, in order. Takes the writer mutex.
+std::vector<std::size_t> check_pages(Table &table, std::size_t num_threads = 0);
+
+// Moves the pages at the end of the file into free pages, fixing up every
+// reference to them, and truncates the file after the last page in use.
+// Takes the writer mutex, no reader may be active.
+void vacuum(Table &table);
+
 MetaCommandResult do_meta_command(const std::string &command, Table &table);
 
-PrepareResult prepare_statement(const std::string &input, Statement &out_statement);
+PrepareResult prepare_statement(std::string_view input, Statement &out_statement);
+
+// A statement parsed once, with ? in place of values, and then bound and
+// executed any number of times without going through the parser again.
+// Placeholders are numbered from 0 in the order they appear. One standing
+// in for a like prefix is bound to the prefix without the %.
+struct PreparedStatement {
+  Statement statement;
+  std::vector<Parameter> parameters;
+  // Id range of the literal id terms, bound id terms narrow it on execute.
+  uint32_t id_min = 0;
+  uint32_t id_max = std::numeric_limits<uint32_t>::max();
+
+  PrepareResult bind(std::size_t index, uint32_t value);
+  PrepareResult bind(std::size_t index, std::string_view value);
+
+  // Selects print their rows like execute_statement.
+  ExecuteResult execute(Table &table);
+  ExecuteResult execute(Table &table, std::vector<Row> &out_rows);
+};
+
+PrepareResult prepare(std::string_view input, PreparedStatement &out_statement);
 
 ExecuteResult execute_insert(const Statement &statement, Table &table);
 
+// Inserts the rows in key order. Each leaf is reached once for the run of rows
+// it receives, which is merged in in one pass, and only split once full.
+// Nothing is inserted if an id is taken or appears twice.
+ExecuteResult execute_insert_batch(const Row *rows, std::size_t count, Table &table);
+
+// Rows of a select pulled one at a time, in id order, without collecting
+// them first. A view points into the current leaf, which stays latched, and
+// is valid until the next call to next. The statement, and the table or
+// snapshot, must outlive the result set.
+struct ResultSet {
+  const Statement *statement;
+  std::optional<Cursor> cursor;
+  bool started = false;
+  // Set when rows are looked up by id one at a time, in the table's row
+  // cache first: the ids an index matched, or the one id asked for.
+  Table *lookup_table = nullptr;
+  std::vector<uint32_t> ids;
+  std::size_t ids_read = 0;
+  Row cached_row; // the last row that came from the row cache
+  uint32_t to_skip = 0; // matches still to pass over for the offset
+  uint32_t to_return = 0; // and to hand out before reaching the limit
+
+  bool next(RowView &out_row);
+};
+
+ResultSet open_select(const Statement &statement, Table &table);
+
+// Always scans, the indexes aren't consulted.
+ResultSet open_select(const Statement &statement, const Snapshot &snapshot);
+
+// Number of rows a select matches. Without predicates besides the id range
+// it comes from the subtree counts of two descents, without visiting rows.
+ExecuteResult execute_count(const Statement &statement, Table &table, uint64_t &out_count);
+
+// A count(*) comes back as a single row with the count in its id.
 ExecuteResult execute_select(const Statement &statement, Table &table, std::vector<Row> &out_vec);
 
+ExecuteResult execute_select(const Statement &statement, const Snapshot &snapshot, std::vector<Row> &out_vec);
+
+// Both keep the secondary indexes in step with the rows they change.
+ExecuteResult execute_delete(const Statement &statement, Table &table);
+
+ExecuteResult execute_update(const Statement &statement, Table &table);
+
+// The leaves of the snapshot's tree that may hold ids in [id_min, id_max], in key order.
+std::vector<uint32_t> collect_leaves(const Snapshot &snapshot, uint32_t id_min, uint32_t id_max);
+
+// Splits the leaves covering the statement's id range into morsels that
+// num_threads workers (0 for one per core) scan and filter independently.
+// The scan reads a snapshot taken when it starts, so it sees whole statements
+// and the writer carries on while it runs.
+ExecuteResult execute_select_parallel(const Statement &statement,
+                                      Table &table,
+                                      std::vector<Row> &out_vec,
+                                      std::size_t num_threads = 0,
+                                      ScanOrder order = ScanOrder::KEY);
+
 ExecuteResult execute_statement(const Statement &statement, Table &table);
 
+struct LatencySummary {
+  uint64_t count;
+  uint64_t mean_ns;
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  uint64_t max_ns;
+};
+
+// A copy of every counter at one point in time.
+struct MetricsSnapshot {
+  uint64_t pages_read;
+  uint64_t pages_written;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t evictions;
+  uint64_t readaheads;
+  uint64_t filter_skips;
+  uint64_t row_cache_hits;
+  uint64_t row_cache_misses;
+  uint64_t leaf_splits;
+  uint64_t internal_splits;
+  uint64_t root_splits;
+  uint64_t merges;
+  uint64_t redistributions;
+  uint32_t tree_depth;
+  std::size_t num_pages;
+  std::array<LatencySummary, STATEMENT_TYPE_COUNT> statements;
+};
+
+// Safe to call from any thread while the table is in use, as a monitoring
+// agent polling it would.
+MetricsSnapshot collect_metrics(Table &table);
+
+void print_metrics(const MetricsSnapshot &metrics);
+
 #endif //CPPQLITE_DB_HPP
@@ -0,0 +1,324 @@
+#include "index.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+
+uint16_t *index_slots(Page &node) {
+  return (uint16_t *) (node.data.data() + NODE_KEYS_OFFSET);
+}
+
+char *index_cell(Page &node, uint32_t cell_num) {
+  return node.data.data() + index_slots(node)[cell_num];
+}
+
+uint32_t index_free_space(Page &node) {
+  return *node.cell_content_start() - (NODE_KEYS_OFFSET + *node.num_cells() * INDEX_NODE_SLOT_SIZE);
+}
+
+uint32_t *index_cell_child(Page &node, uint32_t cell_num) {
+  return (uint32_t *) index_cell(node, cell_num);
+}
+
+IndexEntry index_cell_entry(Page &node, uint32_t cell_num) {
+  const char *cell = index_cell(node, cell_num);
+  if (node.node_type() == Page::NodeType::INDEX_INTERNAL) {
+    cell += INDEX_CHILD_SIZE;
+  }
+  auto length = static_cast<uint8_t>(cell[0]);
+  return IndexEntry{{cell + COLUMN_LENGTH_SIZE, length}, *(uint32_t *) (cell + COLUMN_LENGTH_SIZE + length)};
+}
+
+uint32_t index_cell_size(Page &node, uint32_t cell_num) {
+  auto child_size = node.node_type() == Page::NodeType::INDEX_INTERNAL ? INDEX_CHILD_SIZE : 0;
+  return child_size + COLUMN_LENGTH_SIZE + index_cell_entry(node, cell_num).value.size() + INDEX_ID_SIZE;
+}
+
+std::string index_make_cell(const IndexEntry &entry, std::optional<uint32_t> child = std::nullopt) {
+  std::string cell;
+  if (child) {
+    cell.append((const char *) &*child, INDEX_CHILD_SIZE);
+  }
+  cell.push_back(static_cast<char>(entry.value.size()));
+  cell.append(entry.value);
+  cell.append((const char *) &entry.id, INDEX_ID_SIZE);
+  return cell;
+}
+
+int index_compare(const IndexEntry &a, const IndexEntry &b) {
+  auto comparison = a.value.compare(b.value);
+  if (comparison != 0) {
+    return comparison;
+  }
+  return a.id < b.id ? -1 : a.id > b.id;
+}
+
+// First cell whose entry is >= entry. In an internal node that cell's child,
+// or the right child past the last cell, is the subtree that may hold it.
+uint32_t index_node_lower_bound(Page &node, const IndexEntry &entry) {
+  uint32_t min_index = 0;
+  uint32_t max_index = *node.num_cells();
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (index_compare(index_cell_entry(node, index), entry) >= 0) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+uint32_t index_node_child(Page &node, uint32_t cell_num) {
+  return cell_num < *node.num_cells() ? *index_cell_child(node, cell_num) : *node.right_child();
+}
+
+void index_node_insert_cell(Page &node, uint32_t cell_num, const std::string &cell) {
+  auto num_cells = *node.num_cells();
+  auto *slots = index_slots(node);
+  memmove(slots + cell_num + 1, slots + cell_num, (num_cells - cell_num) * INDEX_NODE_SLOT_SIZE);
+  *node.cell_content_start() -= cell.size();
+  memcpy(node.data.data() + *node.cell_content_start(), cell.data(), cell.size());
+  slots[cell_num] = *node.cell_content_start();
+  *node.num_cells() = num_cells + 1;
+}
+
+// Splits a full node while adding cell at cell_num. The node keeps the lower
+// half, the upper half moves to a new page. Returns the new page and the
+// largest entry left behind, which becomes the node's separator.
+std::pair<std::size_t, std::string> index_node_split(Pager &pager,
+                                                     Page &node,
+                                                     uint32_t cell_num,
+                                                     const std::string &cell) {
+  auto num_cells = *node.num_cells();
+  std::vector<std::string> cells;
+  cells.reserve(num_cells + 1);
+  std::size_t total_space = 0;
+  for (uint32_t i = 0; i <= num_cells; i++) {
+    if (i == cell_num) {
+      cells.push_back(cell);
+    }
+    if (i < num_cells) {
+      cells.emplace_back(index_cell(node, i), index_cell_size(node, i));
+    }
+    total_space += INDEX_NODE_SLOT_SIZE + cells.back().size();
+  }
+  std::size_t left_count = 0;
+  for (std::size_t left_space = 0; left_count + 1 < cells.size() && left_space < total_space / 2; left_count++) {
+    left_space += INDEX_NODE_SLOT_SIZE + cells[left_count].size();
+  }
+
+  auto type = node.node_type();
+  auto is_leaf = type == Page::NodeType::INDEX_LEAF;
+  auto new_page_num = pager.get_unused_page_num();
+  auto &new_node = pager.get_page(new_page_num);
+  new_node.node_type(type);
+  // For leaves this is the sibling chain, for internal nodes the right child moves up.
+  *new_node.next_leaf() = *node.next_leaf();
+
+  // An internal node's last left cell gives up its child as the left half's right child.
+  auto separator = cells[left_count - 1];
+  node.node_type(type);
+  if (is_leaf) {
+    *node.next_leaf() = new_page_num;
+  } else {
+    *node.right_child() = *(uint32_t *) separator.data();
+    separator.erase(0, INDEX_CHILD_SIZE);
+  }
+  auto left_cells = is_leaf ? left_count : left_count - 1;
+  for (std::size_t i = 0; i < left_cells; i++) {
+    index_node_insert_cell(node, i, cells[i]);
+  }
+  for (std::size_t i = left_count; i < cells.size(); i++) {
+    index_node_insert_cell(new_node, i - left_count, cells[i]);
+  }
+  pager.mark_dirty(new_page_num);
+  return {new_page_num, separator};
+}
+
+void index_insert(Pager &pager, std::size_t root_page_num, const IndexEntry &entry) {
+  PinScope scope{pager};
+  // A split can travel all the way up, so the whole path stays latched.
+  std::vector<PageLatch> path;
+  std::vector<uint32_t> positions;
+  auto page_num = root_page_num;
+  while (true) {
+    path.emplace_back(pager, page_num, true);
+    auto &node = *path.back().page;
+    positions.push_back(index_node_lower_bound(node, entry));
+    if (node.node_type() == Page::NodeType::INDEX_LEAF) {
+      break;
+    }
+    page_num = index_node_child(node, positions.back());
+  }
+
+  auto cell = index_make_cell(entry);
+  auto level = path.size() - 1;
+  while (true) {
+    auto &node = *path[level].page;
+    auto node_page_num = path[level].page_num;
+    pager.mark_dirty(node_page_num);
+    if (index_free_space(node) >= INDEX_NODE_SLOT_SIZE + cell.size()) {
+      index_node_insert_cell(node, positions[level], cell);
+      return;
+    }
+    if (level == 0) {
+      // The root keeps its page number: its contents move to a new child
+      // that the root then points at, and that child is split instead.
+      auto child_page_num = pager.get_unused_page_num();
+      auto &child = pager.get_page(child_page_num);
+      memcpy(child.data.data(), node.data.data(), PAGE_SIZE);
+      pager.mark_dirty(child_page_num);
+      node.node_type(Page::NodeType::INDEX_INTERNAL);
+      *node.right_child() = child_page_num;
+      path.insert(path.begin() + 1, PageLatch{pager, child_page_num, true});
+      positions.insert(positions.begin() + 1, positions[0]);
+      positions[0] = 0;
+      level = 1;
+      continue;
+    }
+
+    auto split = index_node_split(pager, node, positions[level], cell);
+    // The parent's pointer to node now leads to the upper half, the lower
+    // half goes in right before it with its new largest entry.
+    auto &parent = *path[level - 1].page;
+    auto parent_position = positions[level - 1];
+    if (parent_position < *parent.num_cells()) {
+      *index_cell_child(parent, parent_position) = split.first;
+    } else {
+      *parent.right_child() = split.first;
+    }
+    cell = split.second;
+    cell.insert(0, (const char *) &node_page_num, INDEX_CHILD_SIZE);
+    level--;
+  }
+}
+
+void index_node_remove_cell(Page &node, uint32_t cell_num) {
+  auto num_cells = *node.num_cells();
+  auto *slots = index_slots(node);
+  auto offset = slots[cell_num];
+  auto cell_size = index_cell_size(node, cell_num);
+  auto content_start = *node.cell_content_start();
+  memmove(node.data.data() + content_start + cell_size, node.data.data() + content_start, offset - content_start);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    if (slots[i] < offset) {
+      slots[i] += cell_size;
+    }
+  }
+  *node.cell_content_start() = content_start + cell_size;
+  memmove(slots + cell_num, slots + cell_num + 1, (num_cells - cell_num - 1) * INDEX_NODE_SLOT_SIZE);
+  *node.num_cells() = num_cells - 1;
+}
+
+bool index_delete(Pager &pager, std::size_t root_page_num, const IndexEntry &entry) {
+  PinScope scope{pager};
+  PageLatch latch{pager, root_page_num, true};
+  while (latch.page->node_type() == Page::NodeType::INDEX_INTERNAL) {
+    auto child_page_num = index_node_child(*latch.page, index_node_lower_bound(*latch.page, entry));
+    latch = PageLatch{pager, child_page_num, true};
+  }
+  auto &leaf = *latch.page;
+  auto cell_num = index_node_lower_bound(leaf, entry);
+  if (cell_num >= *leaf.num_cells() || index_compare(index_cell_entry(leaf, cell_num), entry) != 0) {
+    return false;
+  }
+  index_node_remove_cell(leaf, cell_num);
+  pager.mark_dirty(latch.page_num);
+  return true;
+}
+
+void index_lookup(Pager &pager,
+                  std::size_t root_page_num,
+                  std::string_view value,
+                  bool prefix,
+                  std::vector<uint32_t> &ids) {
+  IndexEntry start{value, 0};
+  PageLatch latch{pager, root_page_num, false};
+  while (latch.page->node_type() == Page::NodeType::INDEX_INTERNAL) {
+    auto child_page_num = index_node_child(*latch.page, index_node_lower_bound(*latch.page, start));
+    latch = PageLatch{pager, child_page_num, false};
+  }
+
+  auto cell_num = index_node_lower_bound(*latch.page, start);
+  while (true) {
+    auto &node = *latch.page;
+    for (; cell_num < *node.num_cells(); cell_num++) {
+      auto entry = index_cell_entry(node, cell_num);
+      if (prefix ? entry.value.substr(0, value.size()) != value : entry.value != value) {
+        return;
+      }
+      ids.push_back(entry.id);
+    }
+    auto next_page_num = *node.next_leaf();
+    if (next_page_num == 0) {
+      return;
+    }
+    latch = PageLatch{pager, next_page_num, false};
+    cell_num = 0;
+  }
+}
+
+bool index_node_remap_pages(Page &node, const std::vector<uint32_t> &new_page_nums) {
+  auto changed = false;
+  auto remap = [&](uint32_t *page_num) {
+    changed |= new_page_nums[*page_num] != *page_num;
+    *page_num = new_page_nums[*page_num];
+  };
+  // A leaf's next leaf and an internal node's right child share the field.
+  remap(node.next_leaf());
+  if (node.node_type() == Page::NodeType::INDEX_INTERNAL) {
+    for (uint32_t i = 0; i < *node.num_cells(); i++) {
+      remap(index_cell_child(node, i));
+    }
+  }
+  return changed;
+}
+
+std::string_view index_column_value(const Row &row, IndexColumn column) {
+  return column == IndexColumn::USERNAME ? row.username.data() : row.email.data();
+}
+
+std::string_view index_column_value(const RowView &row, IndexColumn column) {
+  return column == IndexColumn::USERNAME ? row.username : row.email;
+}
+
+void index_build(Table &table, IndexColumn column, std::size_t root_page_num) {
+  // Sorting first fills the index from left to right.
+  std::vector<std::pair<std::string, uint32_t>> entries;
+  auto cursor = table_start(table);
+  while (!cursor.end_of_table) {
+    PinScope scope{table.pager};
+    auto row = cursor.value();
+    entries.emplace_back(index_column_value(row, column), row.id);
+    cursor.advance();
+  }
+  std::sort(entries.begin(), entries.end());
+  for (auto &entry : entries) {
+    index_insert(table.pager, root_page_num, IndexEntry{entry.first, entry.second});
+  }
+}
+
+ExecuteResult create_index(Table &table, IndexColumn column) {
+  WriteScope writer{table};
+  auto column_index = static_cast<std::size_t>(column);
+  if (table.index_roots[column_index] != 0) {
+    return ExecuteResult::INDEX_EXISTS;
+  }
+  auto &pager = table.pager;
+  auto root_page_num = pager.get_unused_page_num();
+  {
+    PinScope scope{pager};
+    pager.get_page(root_page_num).node_type(Page::NodeType::INDEX_LEAF);
+    pager.mark_dirty(root_page_num);
+  }
+  index_build(table, column, root_page_num);
+
+  // Only publish the index once it is complete.
+  PageLatch header{pager, HEADER_PAGE_NUM, true};
+  header.page->index_roots()[column_index] = root_page_num;
+  pager.mark_dirty(HEADER_PAGE_NUM);
+  table.index_roots[column_index] = root_page_num;
+  return ExecuteResult::SUCCESS;
+}
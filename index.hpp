@@ -0,0 +1,65 @@
+#ifndef CPPQLITE_INDEX_HPP
+#define CPPQLITE_INDEX_HPP
+
+#include "db.hpp"
+
+#include <string_view>
+#include <vector>
+
+// A secondary index is a B+tree of its own in the same file, ordered by
+// (column value, id) so rows sharing a value are still distinct entries.
+// Both node types are slotted pages like table leaves: num_cells, the next
+// leaf (INDEX_LEAF) or right child (INDEX_INTERNAL) and cell_content_start sit
+// where a table leaf keeps them, the cell pointer array grows up from
+// NODE_KEYS_OFFSET and the cells grow down from the end of the page.
+//
+// Leaf cell:     [uint8 length][value][uint32 id]
+// Internal cell: [uint32 child][uint8 length][value][uint32 id], the largest entry under child
+const uint32_t INDEX_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INDEX_ID_SIZE = sizeof(uint32_t);
+const uint32_t INDEX_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint32_t INDEX_MAX_CELL_SIZE = INDEX_CHILD_SIZE + COLUMN_LENGTH_SIZE + Row::COLUMN_EMAIL_SIZE + INDEX_ID_SIZE;
+
+struct IndexEntry {
+  std::string_view value;
+  uint32_t id;
+};
+
+// The entry of a node's cell, its value points into the page.
+IndexEntry index_cell_entry(Page &node, uint32_t cell_num);
+
+// The child of an INDEX_INTERNAL node's cell.
+uint32_t *index_cell_child(Page &node, uint32_t cell_num);
+
+std::string_view index_column_value(const Row &row, IndexColumn column);
+
+std::string_view index_column_value(const RowView &row, IndexColumn column);
+
+// Builds an index on column from the rows already in the table and makes it
+// visible to the planner. Takes the writer mutex.
+ExecuteResult create_index(Table &table, IndexColumn column);
+
+// Adds an entry for every row of the table. Caller holds the writer mutex.
+void index_build(Table &table, IndexColumn column, std::size_t root_page_num);
+
+// Caller holds the writer mutex.
+void index_insert(Pager &pager, std::size_t root_page_num, const IndexEntry &entry);
+
+// Removes entry, returns false if it isn't there. Nodes are never merged:
+// separators stay valid upper bounds as entries go, and an emptied leaf just
+// stays in the chain until inserts fill it again. Caller holds the writer mutex.
+bool index_delete(Pager &pager, std::size_t root_page_num, const IndexEntry &entry);
+
+// Appends the ids of rows whose value equals value, or starts with it when
+// prefix is set, in index order.
+void index_lookup(Pager &pager,
+                  std::size_t root_page_num,
+                  std::string_view value,
+                  bool prefix,
+                  std::vector<uint32_t> &ids);
+
+// Replaces every page number stored in an index node by new_page_nums[page_num].
+// Returns whether any changed.
+bool index_node_remap_pages(Page &node, const std::vector<uint32_t> &new_page_nums);
+
+#endif //CPPQLITE_INDEX_HPP
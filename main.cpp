@@ -7,7 +7,25 @@ int main(int argc, char *argv[]) {
   }
 
   std::string filename = argv[1];
-  Table table{filename};
+  auto backend = PagerBackend::BUFFER_POOL;
+  WalOptions wal_options{};
+  std::size_t row_cache_rows = 0;
+  for (auto i = 2; i < argc; i++) {
+    std::string option = argv[i];
+    if (option == "--mmap") {
+      backend = PagerBackend::MMAP;
+    } else if (option == "--io-uring") {
+      backend = PagerBackend::IO_URING;
+    } else if (option == "--wal") {
+      wal_options.enabled = true;
+    } else if (option == "--row-cache" && i + 1 < argc) {
+      row_cache_rows = std::strtoul(argv[++i], nullptr, 10);
+    } else {
+      std::cerr << "Unknown option " << option << '\n';
+      exit(EXIT_FAILURE);
+    }
+  }
+  Table table{filename, DEFAULT_POOL_FRAMES, backend, wal_options, row_cache_rows};
 
   std::string input;
   while (true) {
@@ -51,6 +69,15 @@ int main(int argc, char *argv[]) {
       case (ExecuteResult::TABLE_FULL):
         std::cout << "Error: Table full.\n";
         break;
+      case (ExecuteResult::UNSORTED_INPUT):
+        std::cout << "Error: Rows are not sorted by id.\n";
+        break;
+      case (ExecuteResult::TABLE_NOT_EMPTY):
+        std::cout << "Error: Table is not empty.\n";
+        break;
+      case (ExecuteResult::INDEX_EXISTS):
+        std::cout << "Error: Index already exists.\n";
+        break;
       case (ExecuteResult::UNHANDLED_STATEMENT):
         std::cout << "Error: Unhandled statement.\n";
         break;
@@ -0,0 +1,48 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+unsigned LatencyHistogram::bucket_index(uint64_t value) {
+  if (value < LATENCY_SUB_BUCKETS) {
+    return static_cast<unsigned>(value);
+  }
+  unsigned shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BUCKET_BITS;
+  auto sub_bucket = static_cast<unsigned>(value >> shift) & (LATENCY_SUB_BUCKETS - 1);
+  return ((shift + 1) << LATENCY_SUB_BUCKET_BITS) | sub_bucket;
+}
+
+uint64_t LatencyHistogram::bucket_upper_bound(unsigned index) {
+  if (index < LATENCY_SUB_BUCKETS) {
+    return index;
+  }
+  unsigned shift = (index >> LATENCY_SUB_BUCKET_BITS) - 1;
+  uint64_t lower = static_cast<uint64_t>(LATENCY_SUB_BUCKETS | (index & (LATENCY_SUB_BUCKETS - 1))) << shift;
+  return lower + ((uint64_t(1) << shift) - 1);
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+  metric_add(buckets[bucket_index(ns)]);
+  metric_add(count);
+  metric_add(total_ns, ns);
+  auto max = max_ns.load(std::memory_order_relaxed);
+  while (ns > max && !max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+  auto total = metric_read(count);
+  if (total == 0) {
+    return 0;
+  }
+  // Buckets keep counting while they are read, the rank is clamped to what was seen.
+  auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p * total)));
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += metric_read(buckets[i]);
+    if (seen >= rank) {
+      return std::min(bucket_upper_bound(i), metric_read(max_ns));
+    }
+  }
+  return metric_read(max_ns);
+}
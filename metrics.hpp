@@ -0,0 +1,43 @@
+#ifndef CPPQLITE_METRICS_HPP
+#define CPPQLITE_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Counters are bumped on hot paths from any thread and only ever read as a
+// whole by a poller, so relaxed ordering is all they need.
+inline void metric_add(std::atomic<uint64_t> &counter, uint64_t amount = 1) {
+  counter.fetch_add(amount, std::memory_order_relaxed);
+}
+
+inline uint64_t metric_read(const std::atomic<uint64_t> &counter) {
+  return counter.load(std::memory_order_relaxed);
+}
+
+// Log-linear buckets in the style of an HDR histogram: values below
+// 2^LATENCY_SUB_BUCKET_BITS get a bucket each, every power of two above is
+// split into that many buckets, so a bucket is never wider than an eighth
+// of its lower bound.
+const unsigned LATENCY_SUB_BUCKET_BITS = 3;
+const unsigned LATENCY_SUB_BUCKETS = 1U << LATENCY_SUB_BUCKET_BITS;
+const unsigned LATENCY_BUCKETS = (65 - LATENCY_SUB_BUCKET_BITS) * LATENCY_SUB_BUCKETS;
+
+struct LatencyHistogram {
+  std::array<std::atomic<uint64_t>, LATENCY_BUCKETS> buckets{};
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> total_ns{0};
+  std::atomic<uint64_t> max_ns{0};
+
+  void record(uint64_t ns);
+
+  // Upper bound of the bucket holding the value at fraction p of the
+  // recorded ones, 0 if there are none.
+  uint64_t percentile(double p) const;
+
+  static unsigned bucket_index(uint64_t value);
+
+  static uint64_t bucket_upper_bound(unsigned index);
+};
+
+#endif //CPPQLITE_METRICS_HPP
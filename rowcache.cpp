@@ -0,0 +1,74 @@
+#include "rowcache.hpp"
+
+#include <algorithm>
+
+RowCache::RowCache(std::size_t rows) {
+  for (auto &shard : shards) {
+    shard.capacity = std::max<std::size_t>(1, (rows + ROW_CACHE_SHARDS - 1) / ROW_CACHE_SHARDS);
+    shard.slots.reserve(shard.capacity);
+    shard.slot_of.reserve(shard.capacity);
+  }
+}
+
+RowCache::Shard &RowCache::shard(uint32_t id) {
+  // Fibonacci hashing, the top bits are spread well even for sequential ids.
+  auto hash = static_cast<uint32_t>(id * 0x9E3779B9U);
+  return shards[(static_cast<uint64_t>(hash) * ROW_CACHE_SHARDS) >> 32];
+}
+
+bool RowCache::get(uint32_t id, Row &out) {
+  auto &shard = this->shard(id);
+  std::lock_guard<std::mutex> lock{shard.mutex};
+  auto it = shard.slot_of.find(id);
+  if (it == shard.slot_of.end()) {
+    metric_add(misses);
+    return false;
+  }
+  auto &slot = shard.slots[it->second];
+  slot.referenced = true;
+  out = slot.row;
+  metric_add(hits);
+  return true;
+}
+
+void RowCache::put(const Row &row) {
+  auto &shard = this->shard(row.id);
+  std::lock_guard<std::mutex> lock{shard.mutex};
+  auto it = shard.slot_of.find(row.id);
+  if (it != shard.slot_of.end()) {
+    shard.slots[it->second].row = row;
+    return;
+  }
+
+  uint32_t slot_num;
+  if (!shard.free_slots.empty()) {
+    slot_num = shard.free_slots.back();
+    shard.free_slots.pop_back();
+  } else if (shard.slots.size() < shard.capacity) {
+    slot_num = shard.slots.size();
+    shard.slots.emplace_back();
+  } else {
+    // Every slot is in use, sweep for one that hasn't been hit since the hand last passed.
+    while (shard.slots[shard.hand].referenced) {
+      shard.slots[shard.hand].referenced = false;
+      shard.hand = (shard.hand + 1) % shard.slots.size();
+    }
+    slot_num = shard.hand;
+    shard.hand = (shard.hand + 1) % shard.slots.size();
+    shard.slot_of.erase(shard.slots[slot_num].row.id);
+  }
+  shard.slots[slot_num] = Slot{row, false};
+  shard.slot_of.emplace(row.id, slot_num);
+}
+
+void RowCache::erase(uint32_t id) {
+  auto &shard = this->shard(id);
+  std::lock_guard<std::mutex> lock{shard.mutex};
+  auto it = shard.slot_of.find(id);
+  if (it == shard.slot_of.end()) {
+    return;
+  }
+  shard.slots[it->second].referenced = false;
+  shard.free_slots.push_back(it->second);
+  shard.slot_of.erase(it);
+}
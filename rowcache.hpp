@@ -0,0 +1,58 @@
+#ifndef CPPQLITE_ROWCACHE_HPP
+#define CPPQLITE_ROWCACHE_HPP
+
+#include "db.hpp"
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Shards are picked by a hash of the id, so neighbouring ids don't contend.
+const std::size_t ROW_CACHE_SHARDS = 16;
+
+// Deserialized rows by id, for point lookups that would otherwise descend
+// the tree. Each shard evicts with the CLOCK algorithm: a hit sets the
+// slot's reference bit, and the hand clears bits until it finds a slot
+// without one. Misses are not cached.
+//
+// Rows are put in while the reader holds a shared latch on their leaf and
+// erased while the writer holds an exclusive one, so a row can't be put
+// back after a change to it has erased it.
+struct RowCache {
+  struct Slot {
+    Row row;
+    bool referenced;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::size_t capacity = 0;
+    std::vector<Slot> slots;
+    std::unordered_map<uint32_t, uint32_t> slot_of; // id -> slot
+    std::vector<uint32_t> free_slots; // emptied by erase
+    std::size_t hand = 0;
+  };
+
+  std::array<Shard, ROW_CACHE_SHARDS> shards;
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+
+  // Holds about rows rows, split evenly over the shards.
+  explicit RowCache(std::size_t rows);
+
+  RowCache(const RowCache &) = delete;
+  RowCache &operator=(const RowCache &) = delete;
+
+  // Copies the row with id out, returns false if it isn't cached.
+  bool get(uint32_t id, Row &out);
+
+  void put(const Row &row);
+
+  void erase(uint32_t id);
+
+  Shard &shard(uint32_t id);
+};
+
+#endif //CPPQLITE_ROWCACHE_HPP
@@ -0,0 +1,112 @@
+#include "search.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPPQLITE_X86 1
+#include <immintrin.h>
+#endif
+
+// Sorted runs at most this long are counted with the vector kernel, longer
+// ones are first narrowed down to such a window by binary search.
+const uint32_t SEARCH_LINEAR_WINDOW = 32;
+
+uint32_t count_keys_less_scalar(const uint32_t *keys, uint32_t count, uint32_t key) {
+  uint32_t less = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    less += keys[i] < key;
+  }
+  return less;
+}
+
+#ifdef CPPQLITE_X86
+// SSE2 and AVX2 only compare signed lanes, flipping the sign bit of both sides
+// turns that into the unsigned comparison keys need.
+uint32_t count_keys_less_sse2(const uint32_t *keys, uint32_t count, uint32_t key) {
+  const __m128i sign = _mm_set1_epi32(INT32_MIN);
+  const __m128i target = _mm_xor_si128(_mm_set1_epi32(static_cast<int32_t>(key)), sign);
+  uint32_t less = 0;
+  uint32_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i lanes = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (keys + i)), sign);
+    auto mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(target, lanes)));
+    less += __builtin_popcount(mask);
+  }
+  return less + count_keys_less_scalar(keys + i, count - i, key);
+}
+
+__attribute__((target("avx2")))
+uint32_t count_keys_less_avx2(const uint32_t *keys, uint32_t count, uint32_t key) {
+  const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+  const __m256i target = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int32_t>(key)), sign);
+  uint32_t less = 0;
+  uint32_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i lanes = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (keys + i)), sign);
+    auto mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(target, lanes)));
+    less += __builtin_popcount(mask);
+  }
+  return less + count_keys_less_sse2(keys + i, count - i, key);
+}
+#endif
+
+bool search_kernel_supported(SearchKernel kernel) {
+  switch (kernel) {
+    case SearchKernel::SCALAR:
+      return true;
+#ifdef CPPQLITE_X86
+    case SearchKernel::SSE2:
+      return __builtin_cpu_supports("sse2");
+    case SearchKernel::AVX2:
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+SearchKernel search_kernel() {
+  static const SearchKernel kernel = search_kernel_supported(SearchKernel::AVX2) ? SearchKernel::AVX2
+      : search_kernel_supported(SearchKernel::SSE2) ? SearchKernel::SSE2
+      : SearchKernel::SCALAR;
+  return kernel;
+}
+
+uint32_t count_keys_less(SearchKernel kernel, const uint32_t *keys, uint32_t count, uint32_t key) {
+  switch (kernel) {
+#ifdef CPPQLITE_X86
+    case SearchKernel::SSE2:
+      return count_keys_less_sse2(keys, count, key);
+    case SearchKernel::AVX2:
+      return count_keys_less_avx2(keys, count, key);
+#endif
+    default:
+      return count_keys_less_scalar(keys, count, key);
+  }
+}
+
+uint32_t node_lower_bound(const uint32_t *keys, uint32_t count, uint32_t key) {
+  using Kernel = uint32_t (*)(const uint32_t *, uint32_t, uint32_t);
+  static const Kernel count_less = [] {
+    switch (search_kernel()) {
+#ifdef CPPQLITE_X86
+      case SearchKernel::SSE2:
+        return Kernel{count_keys_less_sse2};
+      case SearchKernel::AVX2:
+        return Kernel{count_keys_less_avx2};
+#endif
+      default:
+        return Kernel{count_keys_less_scalar};
+    }
+  }();
+
+  uint32_t begin = 0;
+  while (count > SEARCH_LINEAR_WINDOW) {
+    uint32_t half = count / 2;
+    if (keys[begin + half] < key) {
+      begin += half + 1;
+      count -= half + 1;
+    } else {
+      count = half;
+    }
+  }
+  return begin + count_less(keys + begin, count, key);
+}
@@ -0,0 +1,25 @@
+#ifndef CPPQLITE_SEARCH_HPP
+#define CPPQLITE_SEARCH_HPP
+
+#include <cstdint>
+
+// Kernels for finding a key in a node's packed key array. The widest one the
+// CPU supports is picked at runtime, the scalar one works everywhere.
+enum class SearchKernel {
+  SCALAR,
+  SSE2,
+  AVX2
+};
+
+bool search_kernel_supported(SearchKernel kernel);
+
+// Kernel used by node_lower_bound on this machine.
+SearchKernel search_kernel();
+
+// Number of keys among the first count that are smaller than key.
+uint32_t count_keys_less(SearchKernel kernel, const uint32_t *keys, uint32_t count, uint32_t key);
+
+// Index of the first of count sorted keys that is >= key, or count if there is none.
+uint32_t node_lower_bound(const uint32_t *keys, uint32_t count, uint32_t key);
+
+#endif //CPPQLITE_SEARCH_HPP
@@ -4,13 +4,32 @@
 
 #include <catch2/catch.hpp>
 #include "../db.hpp"
+#include "../checksum.hpp"
+#include "../index.hpp"
+#include "../metrics.hpp"
+#include "../rowcache.hpp"
+#include "../search.hpp"
+#include "../uring.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 TEST_CASE("Serialize/deserialize puts rows into raw memory and back to struct") {
-  char storage[ROW_SIZE];
-  Row output_row{};
+  char storage[ROW_MAX_PAYLOAD_SIZE];
+  Row output_row{1};
   {
     Row row{1, "username", "email"};
-    serialize_row(row, storage);
+    // Only the length-prefixed columns are stored, the id is the cell's key.
+    REQUIRE(serialize_row(row, storage) == 2 + 8 + 5);
   }
   {
     deserialize_row(storage, output_row);
@@ -32,6 +51,12 @@ TEST_CASE("Prepare statement catches syntax errors and unrecognized keywords") {
   std::string username(33, 'a');
   std::string email(256, 'a');
   REQUIRE(prepare_statement("insert 1 " + username + " " + email, statement) == PrepareResult::STRING_TOO_LONG);
+  REQUIRE(prepare_statement("select where id between 3 and 9", statement) == PrepareResult::SUCCESS);
+  REQUIRE(statement.id_min == 3);
+  REQUIRE(statement.id_max == 9);
+  REQUIRE(prepare_statement("select where id between 3", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("select where id between a and 9", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("select where id between -3 and 9", statement) == PrepareResult::NEGATIVE_ID);
 }
 
 TEST_CASE("Execute_select gives all inserted rows and correct return codes") {
@@ -51,25 +76,31 @@ TEST_CASE("Execute_select gives all inserted rows and correct return codes") {
   std::remove("test.db");
 }
 
-TEST_CASE("Execute_insert returns table full or succeeds if row fits") {
+TEST_CASE("Execute_insert splits a full leaf instead of dropping rows") {
   std::remove("test.db");
   Table table{"test.db"};
   Statement statement{};
-  REQUIRE(prepare_statement("insert 1 test test@email.com", statement) == PrepareResult::SUCCESS);
-  REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
-
-  Table fill_this_table{"filldb.db"};
-  ExecuteResult last_execute = ExecuteResult::UNHANDLED_STATEMENT;
-  for (auto i = 0; i < LEAF_NODE_MAX_CELLS; ++i) {
+  int i = 0;
+  for (; tree_depth(table) == 1; ++i) {
     char buffer[50];
-    sprintf_s(buffer, "insert %d user#%d person#%d@example.com", i, i, i);
+    snprintf(buffer, sizeof(buffer), "insert %d user#%d person#%d@example.com", i, i, i);
     prepare_statement(buffer, statement);
-    last_execute = execute_insert(statement, fill_this_table);
+    REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
   }
-  REQUIRE(last_execute == ExecuteResult::SUCCESS);
-  REQUIRE(execute_insert(statement, fill_this_table) == ExecuteResult::TABLE_FULL);
-  db_close(fill_this_table);
-  std::remove("filldb.db");
+  // Fixed 297 byte cells only fit 13 of these rows in a leaf.
+  REQUIRE(i > 5 * 13);
+  REQUIRE(execute_insert(statement, table) == ExecuteResult::DUPLICATE_KEY);
+  REQUIRE(tree_depth(table) == 2);
+  auto &root = table.pager.get_page(table.root_page_num);
+  REQUIRE(root.node_type() == Page::NodeType::INTERNAL);
+  REQUIRE(*root.num_keys() == 1);
+  auto &left = table.pager.get_page(*root.child(0));
+  auto &right = table.pager.get_page(*root.right_child());
+  REQUIRE(*root.key(0) == left.max_key());
+  REQUIRE(*left.num_cells() + *right.num_cells() == static_cast<uint32_t>(i));
+  // Split evenly by bytes, to within a cell.
+  REQUIRE(std::abs(static_cast<int>(left.free_space()) - static_cast<int>(right.free_space())) < 100);
+  std::remove("test.db");
 }
 
 TEST_CASE("Table allows inserting strings that are maximum length") {
@@ -141,4 +172,2133 @@ TEST_CASE("Inserted data comes out of select statement sorted") {
   REQUIRE(selected_rows[2].id == 3);
 
   std::remove("test.db");
-}
\ No newline at end of file
+}
+TEST_CASE("Buffer pool evicts and writes back pages beyond its frame budget") {
+  std::remove("test.db");
+  {
+    Pager pager{"test.db", 4};
+    for (uint32_t i = 0; i < 50; ++i) {
+      auto &page = pager.get_page(i);
+      *(uint32_t *) page.data.data() = i * 7;
+      pager.mark_dirty(i);
+    }
+    REQUIRE(pager.num_pages == 50);
+    REQUIRE(pager.page_table.size() == 4);
+    REQUIRE(pager.stats.misses == 50);
+    REQUIRE(pager.stats.evictions == 46);
+    REQUIRE(pager.stats.writebacks == 46);
+    pager.get_page(49);
+    REQUIRE(pager.stats.hits == 1);
+    pager.flush_all();
+  }
+  {
+    Pager pager{"test.db", 4};
+    REQUIRE(pager.num_pages == 50);
+    for (uint32_t i = 0; i < 50; ++i) {
+      REQUIRE(*(uint32_t *) pager.get_page(i).data.data() == i * 7);
+    }
+    REQUIRE(pager.stats.writebacks == 0);
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("Pages pinned by a PinScope are never chosen for eviction") {
+  std::remove("test.db");
+  Pager pager{"test.db", 2};
+  {
+    PinScope scope{pager};
+    auto &pinned_page = pager.get_page(0);
+    pinned_page.data[0] = 'x';
+    pager.mark_dirty(0);
+    for (uint32_t i = 1; i < 10; ++i) {
+      PinScope inner_scope{pager};
+      pager.get_page(i);
+    }
+    REQUIRE(pager.page_table.count(0) == 1);
+    REQUIRE(&pager.get_page(0) == &pinned_page);
+  }
+  for (auto &frame : pager.frames) {
+    REQUIRE(frame.pin_count == 0);
+  }
+  for (uint32_t i = 1; i < 10; ++i) {
+    pager.get_page(i);
+  }
+  REQUIRE(pager.page_table.count(0) == 0);
+  REQUIRE(pager.get_page(0).data[0] == 'x');
+  std::remove("test.db");
+}
+
+TEST_CASE("Mmap pager grows the file and shares its format with the buffer pool") {
+  std::remove("test.db");
+  {
+    Pager pager{"test.db", DEFAULT_POOL_FRAMES, PagerBackend::MMAP};
+    for (uint32_t i = 0; i < 50; ++i) {
+      *(uint32_t *) pager.get_page(i).data.data() = i * 7;
+      pager.mark_dirty(i);
+    }
+    REQUIRE(pager.num_pages == 50);
+    REQUIRE(pager.file_capacity >= 50 * PAGE_SIZE);
+    pager.flush_all();
+    pager.close();
+  }
+  {
+    Pager pager{"test.db"};
+    REQUIRE(pager.file_length == 50 * PAGE_SIZE);
+    for (uint32_t i = 0; i < 50; ++i) {
+      REQUIRE(*(uint32_t *) pager.get_page(i).data.data() == i * 7);
+    }
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("Rows inserted through the mmap backend persist after reopening") {
+  std::remove("test.db");
+  {
+    Table table{"test.db", DEFAULT_POOL_FRAMES, PagerBackend::MMAP};
+    Statement statement{};
+    REQUIRE(prepare_statement("insert 2 test test@email.com", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+    REQUIRE(prepare_statement("insert 1 other other@email.com", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+    db_close(table);
+  }
+  {
+    Table table{"test.db", DEFAULT_POOL_FRAMES, PagerBackend::MMAP};
+    Statement statement{};
+    REQUIRE(prepare_statement("select", statement) == PrepareResult::SUCCESS);
+    std::vector<Row> selected_rows;
+    REQUIRE(execute_select(statement, table, selected_rows) == ExecuteResult::SUCCESS);
+    REQUIRE(selected_rows.size() == 2);
+    REQUIRE(selected_rows[0].id == 1);
+    REQUIRE(std::string(selected_rows[1].email.data()) == "test@email.com");
+    db_close(table);
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("Mapped pages carry a current checksum without a flush") {
+  std::remove("test.db");
+  {
+    Table table{"test.db", DEFAULT_POOL_FRAMES, PagerBackend::MMAP};
+    Statement statement{Statement::INSERT};
+    for (uint32_t i = 0; i < 3000; ++i) {
+      statement.row_to_insert = Row{(i * 7919) % 3000, "user", "user@example.com"};
+      REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+    }
+    REQUIRE(prepare_statement("delete where id < 1000", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+    // Whatever the kernel has written back so far, as if the process died here.
+    auto fd = ::open("test.db", O_RDONLY);
+    REQUIRE(fd >= 0);
+    std::array<char, PAGE_SIZE> data{};
+    for (std::size_t page_num = 0; page_num < table.pager.num_pages; page_num++) {
+      data.fill(0);
+      REQUIRE(pread(fd, data.data(), PAGE_SIZE, page_num * PAGE_SIZE) >= 0);
+      REQUIRE(page_checksum_valid(data.data()));
+    }
+    ::close(fd);
+    // No db_close, the mapping goes away with changes never flushed.
+  }
+  {
+    // Both backends check pages as they first come in.
+    Table table{"test.db", DEFAULT_POOL_FRAMES, PagerBackend::MMAP};
+    REQUIRE(table.pager.verified_pages.size() == table.pager.num_pages);
+    REQUIRE_FALSE(table.pager.verified_pages[table.root_page_num]);
+    REQUIRE(table_row_count(table) == 2000);
+    REQUIRE(table.pager.verified_pages[table.root_page_num]);
+  }
+  {
+    Table table{"test.db"};
+    REQUIRE(check_pages(table, 1).empty());
+    REQUIRE(table_row_count(table) == 2000);
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("B+tree grows past two levels and finds every key") {
+  std::remove("test.db");
+  const uint32_t row_count = 20000;
+  std::vector<uint32_t> ids(row_count);
+  for (uint32_t i = 0; i < row_count; ++i) {
+    ids[i] = (i * 7919) % row_count; // every id exactly once, in scattered order
+  }
+  {
+    Table table{"test.db", 16};
+    Statement statement{Statement::INSERT};
+    // Long emails keep leaves small enough for a third level.
+    statement.row_to_insert = Row{0, "user"};
+    std::fill_n(statement.row_to_insert.email.begin(), 100, 'e');
+    for (auto id : ids) {
+      statement.row_to_insert.id = id;
+      REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+    }
+    REQUIRE(execute_insert(statement, table) == ExecuteResult::DUPLICATE_KEY);
+    REQUIRE(tree_depth(table) == 3);
+    db_close(table);
+  }
+  {
+    Table table{"test.db", 16};
+    for (uint32_t id = 0; id < row_count; ++id) {
+      auto cursor = table_find(table, id);
+      auto &leaf = table.pager.get_page(cursor.page_num);
+      REQUIRE(cursor.cell_num < *leaf.num_cells());
+      REQUIRE(*leaf.key(cursor.cell_num) == id);
+      Row row{};
+      deserialize_row(cursor.value(), row);
+      REQUIRE(row.id == id);
+    }
+    db_close(table);
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("Select scans across leaves and streams id ranges") {
+  std::remove("test.db");
+  Table table{"test.db"};
+  Statement statement{Statement::INSERT};
+  for (uint32_t i = 1; i <= 200; ++i) {
+    statement.row_to_insert = Row{(i * 37) % 200 + 1, "user", "user@example.com"};
+    REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+  }
+
+  std::vector<Row> selected_rows;
+  REQUIRE(prepare_statement("select", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_select(statement, table, selected_rows) == ExecuteResult::SUCCESS);
+  REQUIRE(selected_rows.size() == 200);
+  for (uint32_t i = 0; i < 200; ++i) {
+    REQUIRE(selected_rows[i].id == i + 1);
+  }
+
+  selected_rows.clear();
+  REQUIRE(prepare_statement("select where id between 50 and 120", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_select(statement, table, selected_rows) == ExecuteResult::SUCCESS);
+  REQUIRE(selected_rows.size() == 71);
+  REQUIRE(selected_rows.front().id == 50);
+  REQUIRE(selected_rows.back().id == 120);
+
+  selected_rows.clear();
+  REQUIRE(prepare_statement("select where id between 201 and 500", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_select(statement, table, selected_rows) == ExecuteResult::SUCCESS);
+  REQUIRE(selected_rows.empty());
+  std::remove("test.db");
+}
+
+TEST_CASE("Bulk load builds a packed tree from sorted rows") {
+  std::remove("test.db");
+  std::vector<Row> rows;
+  for (uint32_t i = 0; i < 20000; ++i) {
+    rows.push_back(Row{i * 2, "user"});
+    std::fill_n(rows.back().email.begin(), 100, 'e');
+  }
+  {
+    Table table{"test.db", 16};
+    REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::SUCCESS);
+    // The header, the root and 572 leaves: 108 byte cells plus key and slot, 35 to a leaf.
+    REQUIRE(table.pager.num_pages == 2 + 572 + 2);
+    REQUIRE(tree_depth(table) == 3);
+    REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::TABLE_NOT_EMPTY);
+    db_close(table);
+  }
+  {
+    Table table{"test.db", 16};
+    Statement statement{};
+    REQUIRE(prepare_statement("select", statement) == PrepareResult::SUCCESS);
+    std::vector<Row> selected_rows;
+    REQUIRE(execute_select(statement, table, selected_rows) == ExecuteResult::SUCCESS);
+    REQUIRE(selected_rows.size() == rows.size());
+    for (std::size_t i = 0; i < rows.size(); ++i) {
+      REQUIRE(selected_rows[i].id == rows[i].id);
+    }
+
+    // The packed tree still takes regular inserts in between the loaded keys.
+    statement = Statement{Statement::INSERT};
+    for (uint32_t i = 0; i < 2000; ++i) {
+      statement.row_to_insert = Row{i * 2 + 1, "user", "user@example.com"};
+      REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+    }
+    statement.row_to_insert = Row{500, "user", "user@example.com"};
+    REQUIRE(execute_insert(statement, table) == ExecuteResult::DUPLICATE_KEY);
+    for (uint32_t id = 0; id < 4000; ++id) {
+      auto cursor = table_find(table, id);
+      REQUIRE(*table.pager.get_page(cursor.page_num).key(cursor.cell_num) == id);
+    }
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("Bulk load honours the fill factor and rejects unsorted input") {
+  std::remove("test.db");
+  Table table{"test.db"};
+  std::vector<Row> rows{Row{1, "a", "a"}, Row{3, "b", "b"}, Row{2, "c", "c"}};
+  REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::UNSORTED_INPUT);
+  rows[2].id = 3;
+  REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::DUPLICATE_KEY);
+  REQUIRE(*table.pager.get_page(table.root_page_num).num_cells() == 0);
+
+  rows.clear();
+  for (uint32_t i = 0; i < 100; ++i) {
+    rows.push_back(Row{i, "user", "user@example.com"});
+  }
+  REQUIRE(table.bulk_load(rows.begin(), rows.end(), 0.5) == ExecuteResult::SUCCESS);
+  auto cursor = table_start(table);
+  auto &first_leaf = table.pager.get_page(cursor.page_num);
+  REQUIRE(first_leaf.free_space() >= LEAF_NODE_SPACE_FOR_CELLS / 2);
+  // 22 byte payloads take 30 bytes each with key and slot, 67 of them fill half a leaf.
+  REQUIRE(*first_leaf.num_cells() == 67);
+  REQUIRE(*table.pager.get_page(table.root_page_num).num_keys() + 1 == 2);
+  std::remove("test.db");
+}
+
+TEST_CASE("Committed inserts survive a crash through the write-ahead log") {
+  std::remove("test.db");
+  std::remove("test.db-wal");
+  WalOptions wal_options{};
+  wal_options.enabled = true;
+  {
+    Table table{"test.db", 4, PagerBackend::BUFFER_POOL, wal_options};
+    Statement statement{Statement::INSERT};
+    for (uint32_t i = 0; i < 100; ++i) {
+      statement.row_to_insert = Row{i, "user", "user@example.com"};
+      REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+    }
+    REQUIRE(table.pager.wal->stats.commits == 101);
+    REQUIRE(table.pager.wal->stats.syncs == 101);
+    // No db_close, the buffer pool and every unwritten page are simply dropped.
+  }
+  {
+    std::ofstream torn_tail{"test.db-wal", std::ios::binary | std::ios::app};
+    torn_tail << "half a frame";
+  }
+  {
+    Table table{"test.db", 4, PagerBackend::BUFFER_POOL, wal_options};
+    REQUIRE(table.pager.wal->frame_count == 0);
+    Statement statement{Statement::SELECT};
+    std::vector<Row> selected_rows;
+    REQUIRE(execute_select(statement, table, selected_rows) == ExecuteResult::SUCCESS);
+    REQUIRE(selected_rows.size() == 100);
+    REQUIRE(selected_rows.back().id == 99);
+    db_close(table);
+  }
+  std::ifstream wal_file{"test.db-wal"};
+  REQUIRE(!wal_file);
+  {
+    Table table{"test.db"};
+    Statement statement{Statement::SELECT};
+    std::vector<Row> selected_rows;
+    REQUIRE(execute_select(statement, table, selected_rows) == ExecuteResult::SUCCESS);
+    REQUIRE(selected_rows.size() == 100);
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("A commit with every page already spilled marks the last frame instead of logging another") {
+  std::remove("test.db");
+  std::remove("test.db-wal");
+  WalOptions wal_options{};
+  wal_options.enabled = true;
+  {
+    Table table{"test.db", DEFAULT_POOL_FRAMES, PagerBackend::BUFFER_POOL, wal_options};
+    auto &pager = table.pager;
+    auto frames_before = pager.wal->frame_count;
+    REQUIRE(frames_before == 2);
+    pager.commit();
+    REQUIRE(pager.wal->frame_count == frames_before);
+
+    {
+      WriteScope writer{table};
+      PinScope scope{pager};
+      auto &root = pager.get_page(table.root_page_num);
+      *root.num_cells() = 0;
+      pager.mark_dirty(table.root_page_num);
+      pager.flush(table.root_page_num);
+      REQUIRE(pager.wal->uncommitted_frames == 1);
+      pager.commit();
+    }
+    REQUIRE(pager.wal->frame_count == frames_before + 1);
+    REQUIRE(pager.wal->uncommitted_frames == 0);
+  }
+  {
+    // Recovery only keeps frames up to the last commit mark, the spilled one included.
+    Wal wal{"test.db-wal", wal_options};
+    REQUIRE(wal.frame_count == 3);
+    REQUIRE(wal.index[TABLE_ROOT_PAGE_NUM] == 2);
+  }
+  std::remove("test.db");
+  std::remove("test.db-wal");
+}
+
+TEST_CASE("A statement rejected part way commits its undo before returning") {
+  std::remove("test.db");
+  std::remove("test.db-wal");
+  WalOptions wal_options{};
+  wal_options.enabled = true;
+  Table table{"test.db", DEFAULT_POOL_FRAMES, PagerBackend::BUFFER_POOL, wal_options};
+  auto &pager = table.pager;
+  std::vector<Row> rows;
+  for (uint32_t id = 0; id < 2000; id += 2) {
+    rows.push_back(Row{id, "user", "user@example.com"});
+  }
+  REQUIRE(execute_insert_batch(rows.data(), rows.size(), table) == ExecuteResult::SUCCESS);
+  auto nothing_pending = [&] {
+    auto dirty = std::any_of(pager.frames.begin(), pager.frames.end(), [](const Frame &frame) {
+      return frame.in_use && frame.dirty;
+    });
+    // Everything logged so far is committed, as recovery would see it.
+    Wal recovered{"test.db-wal", wal_options};
+    return !dirty && pager.wal->uncommitted_frames == 0 && recovered.frame_count == pager.wal->frame_count;
+  };
+
+  // The counts bumped on the way down are taken back.
+  Statement insert{Statement::INSERT};
+  insert.row_to_insert = Row{1000, "user", "user@example.com"};
+  REQUIRE(execute_insert(insert, table) == ExecuteResult::DUPLICATE_KEY);
+  REQUIRE(nothing_pending());
+  // The rows merged into earlier leaves are taken back out.
+  rows = {Row{1, "user", "user@example.com"}, Row{1501, "user", "user@example.com"},
+          Row{1998, "user", "user@example.com"}};
+  REQUIRE(execute_insert_batch(rows.data(), rows.size(), table) == ExecuteResult::DUPLICATE_KEY);
+  REQUIRE(nothing_pending());
+  REQUIRE(table_row_count(table) == 1000);
+  REQUIRE_FALSE(table_lookup(table, 1));
+  std::remove("test.db");
+  std::remove("test.db-wal");
+}
+
+TEST_CASE("Group commit shares fsyncs and checkpoints bound the log") {
+  std::remove("test.db");
+  std::remove("test.db-wal");
+  WalOptions wal_options{};
+  wal_options.enabled = true;
+  wal_options.commit_window = std::chrono::milliseconds(2);
+  wal_options.checkpoint_frames = 64;
+  Table table{"test.db", DEFAULT_POOL_FRAMES, PagerBackend::BUFFER_POOL, wal_options};
+  auto &wal = *table.pager.wal;
+  auto durable_writes = [&wal] {
+    std::lock_guard<std::mutex> lock{wal.sync_mutex};
+    return wal.synced_writes;
+  };
+
+  // Alone, a commit has everything it wrote on disk when it returns.
+  Statement statement{Statement::INSERT};
+  for (uint32_t i = 0; i < 20; ++i) {
+    statement.row_to_insert = Row{i, "user", "user@example.com"};
+    REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+    REQUIRE(durable_writes() == wal.writes);
+  }
+
+  // Concurrent commits share fsyncs, and each is on disk when acknowledged:
+  // its commit frame was written after the count read before it started.
+  const uint32_t thread_count = 8;
+  const uint32_t inserts_per_thread = 50;
+  auto syncs_before = wal.stats.syncs;
+  std::atomic<bool> acknowledged_early{false};
+  std::atomic<bool> log_too_long{false};
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&, t] {
+      Statement insert{Statement::INSERT};
+      for (uint32_t i = 0; i < inserts_per_thread; ++i) {
+        insert.row_to_insert = Row{1000 + t * inserts_per_thread + i, "user", "user@example.com"};
+        auto written_before = wal.writes.load();
+        if (execute_insert(insert, table) != ExecuteResult::SUCCESS || durable_writes() <= written_before) {
+          acknowledged_early = true;
+        }
+        std::lock_guard<std::recursive_mutex> lock{table.pager.mutex};
+        if (wal.frame_count >= 64) {
+          log_too_long = true;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE_FALSE(acknowledged_early);
+  REQUIRE_FALSE(log_too_long);
+  auto &stats = wal.stats;
+  REQUIRE(stats.commits == 1 + 20 + thread_count * inserts_per_thread);
+  REQUIRE(stats.checkpoints > 0);
+  REQUIRE(stats.syncs - syncs_before < thread_count * inserts_per_thread);
+  db_close(table);
+
+  Table reopened{"test.db"};
+  REQUIRE(table_row_count(reopened) == 20 + thread_count * inserts_per_thread);
+  std::remove("test.db");
+}
+
+TEST_CASE("Readers scan and look up rows while a single writer inserts") {
+  std::remove("test.db");
+  Table table{"test.db", 64};
+  const uint32_t row_count = 12000;
+  std::atomic<uint32_t> inserted{0};
+  std::atomic<bool> failed{false};
+
+  std::vector<std::thread> readers;
+  for (auto t = 0; t < 4; ++t) {
+    readers.emplace_back([&table, &inserted, &failed, t]() {
+      Statement statement{Statement::SELECT};
+      uint32_t probe = t;
+      while (inserted < row_count && !failed) {
+        // Everything below the watermark was inserted before this scan started.
+        auto watermark = inserted.load();
+        std::vector<Row> selected_rows;
+        execute_select(statement, table, selected_rows);
+        if (selected_rows.size() < watermark) {
+          failed = true;
+        }
+        for (std::size_t i = 1; i < selected_rows.size(); ++i) {
+          if (selected_rows[i - 1].id >= selected_rows[i].id) {
+            failed = true;
+          }
+        }
+
+        for (auto i = 0; i < 50 && watermark > 0; ++i) {
+          probe = (probe * 7919 + 13) % watermark;
+          auto cursor = table_find(table, probe);
+          Row row{};
+          deserialize_row(cursor.value(), row);
+          if (row.id != probe) {
+            failed = true;
+          }
+        }
+      }
+    });
+  }
+
+  Statement statement{Statement::INSERT};
+  statement.row_to_insert = Row{0, "user"};
+  std::fill_n(statement.row_to_insert.email.begin(), 100, 'e');
+  for (uint32_t i = 0; i < row_count; ++i) {
+    statement.row_to_insert.id = i;
+    REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+    inserted = i + 1;
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  REQUIRE(!failed);
+  REQUIRE(tree_depth(table) == 3);
+  std::remove("test.db");
+}
+
+TEST_CASE("Parallel select matches the serial scan in both orders") {
+  std::remove("test.db");
+  std::vector<Row> rows;
+  for (uint32_t i = 0; i < 20000; ++i) {
+    rows.push_back(Row{i * 3, "user", "user@example.com"});
+  }
+  Table table{"test.db", 64};
+  REQUIRE(table.bulk_load(rows.begin(), rows.end(), 0.8) == ExecuteResult::SUCCESS);
+
+  Statement statement{Statement::SELECT};
+  for (auto range : {std::make_pair(0U, std::numeric_limits<uint32_t>::max()),
+                     std::make_pair(1000U, 35000U),
+                     std::make_pair(59998U, 70000U),
+                     std::make_pair(70000U, 80000U)}) {
+    statement.id_min = range.first;
+    statement.id_max = range.second;
+    std::vector<Row> serial_rows;
+    REQUIRE(execute_select(statement, table, serial_rows) == ExecuteResult::SUCCESS);
+
+    std::vector<Row> parallel_rows;
+    REQUIRE(execute_select_parallel(statement, table, parallel_rows, 4) == ExecuteResult::SUCCESS);
+    REQUIRE(parallel_rows.size() == serial_rows.size());
+    for (std::size_t i = 0; i < serial_rows.size(); ++i) {
+      REQUIRE(parallel_rows[i].id == serial_rows[i].id);
+    }
+
+    std::vector<Row> unordered_rows;
+    REQUIRE(execute_select_parallel(statement, table, unordered_rows, 4, ScanOrder::ANY) == ExecuteResult::SUCCESS);
+    std::sort(unordered_rows.begin(), unordered_rows.end(), [](const Row &a, const Row &b) { return a.id < b.id; });
+    REQUIRE(unordered_rows.size() == serial_rows.size());
+    for (std::size_t i = 0; i < serial_rows.size(); ++i) {
+      REQUIRE(unordered_rows[i].id == serial_rows[i].id);
+    }
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("Prepare select parses projections and where clauses") {
+  Statement statement{};
+  REQUIRE(prepare_statement("select id,username where username = bob", statement) == PrepareResult::SUCCESS);
+  REQUIRE(statement.columns == (COLUMN_ID | COLUMN_USERNAME));
+  REQUIRE(statement.predicates.size() == 1);
+  REQUIRE(statement.predicates[0].column == Predicate::Column::USERNAME);
+
+  REQUIRE(prepare_statement("select * where id > 10 and id <= 20 and email != x@y", statement)
+              == PrepareResult::SUCCESS);
+  REQUIRE(statement.columns == ALL_COLUMNS);
+  REQUIRE(statement.id_min == 11);
+  REQUIRE(statement.id_max == 20);
+  REQUIRE(statement.predicates.size() == 1);
+
+  REQUIRE(prepare_statement("select email, id where id < 0", statement) == PrepareResult::SUCCESS);
+  REQUIRE(statement.columns == (COLUMN_ID | COLUMN_EMAIL));
+  REQUIRE(statement.id_min > statement.id_max);
+
+  REQUIRE(prepare_statement("select name", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("select id where", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("select where id ~ 3", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("select where id = 3 or id = 4", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("select where id >= -1", statement) == PrepareResult::NEGATIVE_ID);
+  REQUIRE(prepare_statement("select where username = " + std::string(33, 'a'), statement)
+              == PrepareResult::STRING_TOO_LONG);
+}
+
+TEST_CASE("Select filters on serialized rows and copies out only projected columns") {
+  std::remove("test.db");
+  Table table{"test.db"};
+  Statement statement{Statement::INSERT};
+  for (uint32_t i = 1; i <= 300; ++i) {
+    statement.row_to_insert = Row{i, "user", "user@example.com"};
+    if (i % 3 == 0) {
+      statement.row_to_insert.username = {"bob"};
+    }
+    REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+  }
+
+  REQUIRE(prepare_statement("select id,username where username = bob and id between 100 and 200", statement)
+              == PrepareResult::SUCCESS);
+  std::vector<Row> serial_rows;
+  REQUIRE(execute_select(statement, table, serial_rows) == ExecuteResult::SUCCESS);
+  std::vector<Row> parallel_rows;
+  REQUIRE(execute_select_parallel(statement, table, parallel_rows, 2) == ExecuteResult::SUCCESS);
+  REQUIRE(serial_rows.size() == 33);
+  REQUIRE(parallel_rows.size() == serial_rows.size());
+  for (std::size_t i = 0; i < serial_rows.size(); ++i) {
+    REQUIRE(serial_rows[i].id == 102 + 3 * i);
+    REQUIRE(parallel_rows[i].id == serial_rows[i].id);
+    REQUIRE(std::string(serial_rows[i].username.data()) == "bob");
+    REQUIRE(serial_rows[i].email[0] == '\0');
+  }
+
+  serial_rows.clear();
+  REQUIRE(prepare_statement("select email where username > bob and id != 1", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_select(statement, table, serial_rows) == ExecuteResult::SUCCESS);
+  REQUIRE(serial_rows.size() == 199);
+  REQUIRE(serial_rows[0].id == 0);
+  REQUIRE(std::string(serial_rows[0].email.data()) == "user@example.com");
+  std::remove("test.db");
+}
+
+TEST_CASE("Every supported search kernel agrees with the scalar one") {
+  std::mt19937 random{42};
+  for (uint32_t count : {0U, 1U, 3U, 4U, 7U, 8U, 13U, 33U, 510U}) {
+    std::vector<uint32_t> keys(count);
+    for (auto &key : keys) {
+      key = random() % 4 == 0 ? random() : random() % 1000;
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    auto size = static_cast<uint32_t>(keys.size());
+
+    std::vector<uint32_t> probes{0, 1, 500, std::numeric_limits<uint32_t>::max(), 0x80000000U};
+    for (auto key : keys) {
+      probes.push_back(key);
+      probes.push_back(key + 1);
+    }
+    for (auto probe : probes) {
+      auto expected = std::lower_bound(keys.begin(), keys.end(), probe) - keys.begin();
+      for (auto kernel : {SearchKernel::SCALAR, SearchKernel::SSE2, SearchKernel::AVX2}) {
+        if (search_kernel_supported(kernel)) {
+          REQUIRE(count_keys_less(kernel, keys.data(), size, probe) == expected);
+        }
+      }
+      REQUIRE(node_lower_bound(keys.data(), size, probe) == expected);
+    }
+  }
+}
+
+TEST_CASE("Nodes keep their keys packed apart from values and children") {
+  std::remove("test.db");
+  Table table{"test.db"};
+  Statement statement{Statement::INSERT};
+  for (uint32_t i = 0; i < 2000; ++i) {
+    statement.row_to_insert = Row{(i * 7919) % 2000, "user", "user@example.com"};
+    REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+  }
+
+  PinScope scope{table.pager};
+  auto &root = table.pager.get_page(table.root_page_num);
+  REQUIRE(root.node_type() == Page::NodeType::INTERNAL);
+  REQUIRE(reinterpret_cast<char *>(root.keys()) == root.data.data() + NODE_KEYS_OFFSET);
+  REQUIRE(std::is_sorted(root.keys(), root.keys() + *root.num_keys()));
+  auto &leaf = table.pager.get_page(*root.child(0));
+  REQUIRE(std::is_sorted(leaf.keys(), leaf.keys() + *leaf.num_cells()));
+  REQUIRE(reinterpret_cast<uint32_t *>(leaf.slots()) == leaf.keys() + *leaf.num_cells());
+  for (uint32_t i = 0; i < *leaf.num_cells(); ++i) {
+    REQUIRE(leaf.slots()[i] >= *leaf.cell_content_start());
+  }
+  for (uint32_t id = 0; id < 2000; id += 97) {
+    auto cursor = table_find(table, id);
+    REQUIRE(cursor.value().id == id);
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("Leaves hold many short rows and keep long ones local") {
+  std::remove("test.db");
+  {
+    Table table{"test.db", 16};
+    Statement statement{Statement::INSERT};
+    for (uint32_t i = 0; i < 1000; ++i) {
+      statement.row_to_insert = Row{i, "user"};
+      // Every tenth email is as long as an email gets.
+      std::fill_n(statement.row_to_insert.email.begin(), i % 10 == 0 ? 255 : 25, 'a' + i % 26);
+      REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+    }
+    db_close(table);
+  }
+  {
+    Table table{"test.db", 16};
+    Statement statement{};
+    REQUIRE(prepare_statement("select", statement) == PrepareResult::SUCCESS);
+    std::vector<Row> rows;
+    REQUIRE(execute_select(statement, table, rows) == ExecuteResult::SUCCESS);
+    REQUIRE(rows.size() == 1000);
+    for (uint32_t i = 0; i < 1000; ++i) {
+      REQUIRE(rows[i].id == i);
+      REQUIRE(std::string(rows[i].email.data()) == std::string(i % 10 == 0 ? 255 : 25, 'a' + i % 26));
+    }
+
+    std::vector<Row> parallel_rows;
+    REQUIRE(prepare_statement("select id where email > z", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_select_parallel(statement, table, parallel_rows, 2) == ExecuteResult::SUCCESS);
+    REQUIRE(parallel_rows.size() == 38);
+
+    // No row spills to an overflow page, every leaf holds dozens of rows.
+    uint32_t overflow_pages = 0;
+    for (std::size_t page_num = 0; page_num < table.pager.num_pages; ++page_num) {
+      PinScope scope{table.pager};
+      auto &page = table.pager.get_page(page_num);
+      if (page.node_type() == Page::NodeType::OVERFLOW) {
+        overflow_pages++;
+      } else if (page.node_type() == Page::NodeType::LEAF) {
+        REQUIRE(*page.num_cells() >= 20);
+      }
+    }
+    REQUIRE(overflow_pages == 0);
+    REQUIRE(table.pager.num_pages < 40);
+    REQUIRE(tree_depth(table) == 2);
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("A lower local limit spills long rows to overflow chains that delete and vacuum follow") {
+  std::remove("test.db");
+  auto email_of = [](uint32_t id) { return std::string(id % 10 == 0 ? 255 : 25, 'a' + id % 26); };
+  auto count_overflow_pages = [](Table &table) {
+    uint32_t overflow_pages = 0;
+    for (std::size_t page_num = 0; page_num < table.pager.num_pages; ++page_num) {
+      PinScope scope{table.pager};
+      overflow_pages += table.pager.get_page(page_num).node_type() == Page::NodeType::OVERFLOW;
+    }
+    return overflow_pages;
+  };
+  auto check_rows = [&](Table &table, uint32_t first_id) {
+    Statement statement{Statement::SELECT};
+    std::vector<Row> rows;
+    REQUIRE(execute_select(statement, table, rows) == ExecuteResult::SUCCESS);
+    REQUIRE(rows.size() == 1000 - first_id);
+    for (auto &row : rows) {
+      REQUIRE(row.id == first_id++);
+      REQUIRE(std::string(row.email.data()) == email_of(row.id));
+    }
+  };
+  {
+    Table table{"test.db", 16};
+    table.pager.max_local = 128;
+    Statement statement{Statement::INSERT};
+    for (uint32_t i = 0; i < 1000; ++i) {
+      statement.row_to_insert = Row{i, "user"};
+      auto email = email_of(i);
+      std::copy(email.begin(), email.end(), statement.row_to_insert.email.begin());
+      REQUIRE(execute_insert(statement, table) == ExecuteResult::SUCCESS);
+    }
+    // Every tenth row spilled the tail of its email to a page of its own.
+    REQUIRE(count_overflow_pages(table) == 100);
+    check_rows(table, 0);
+    std::vector<Row> parallel_rows;
+    REQUIRE(prepare_statement("select id where email > z", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_select_parallel(statement, table, parallel_rows, 2) == ExecuteResult::SUCCESS);
+    REQUIRE(parallel_rows.size() == 38);
+    db_close(table);
+  }
+  {
+    // Cells say whether they spilled, the limit a table is opened with only affects new rows.
+    Table table{"test.db", 16};
+    check_rows(table, 0);
+
+    // Deleting the rows gives their chains back.
+    Statement statement{};
+    REQUIRE(prepare_statement("delete where id < 500", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+    REQUIRE(table.pager.free_page_count() >= 50);
+    check_rows(table, 500);
+
+    // Vacuum moves the chains that are left and the cells pointing at them.
+    auto pages_before = table.pager.num_pages.load();
+    vacuum(table);
+    REQUIRE(table.pager.free_page_count() == 0);
+    REQUIRE(table.pager.num_pages < pages_before);
+    REQUIRE(count_overflow_pages(table) == 50);
+    check_rows(table, 500);
+    db_close(table);
+  }
+  {
+    Table table{"test.db", 16};
+    check_rows(table, 500);
+    // So does an update that makes a row short enough to stay in its leaf.
+    Statement statement{};
+    REQUIRE(prepare_statement("update set email = short where id = 990", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+    REQUIRE(table.pager.free_page_count() == 1);
+    REQUIRE(count_overflow_pages(table) == 49);
+  }
+  std::remove("test.db");
+  {
+    // Bulk loads lay the chains out after the tree.
+    Table table{"test.db", 16};
+    table.pager.max_local = 128;
+    std::vector<Row> rows;
+    for (uint32_t i = 0; i < 1000; ++i) {
+      rows.push_back(Row{i, "user"});
+      auto email = email_of(i);
+      std::copy(email.begin(), email.end(), rows.back().email.begin());
+    }
+    REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::SUCCESS);
+    REQUIRE(count_overflow_pages(table) == 100);
+    check_rows(table, 0);
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("Secondary indexes answer equality and prefix selects and survive reopening") {
+  std::remove("test.db");
+  auto make_row = [](uint32_t id) {
+    Row row{id};
+    auto username = "user" + std::to_string(id % 50);
+    auto email = "person" + std::to_string(id) + "@example.com";
+    std::copy(username.begin(), username.end(), row.username.begin());
+    std::copy(email.begin(), email.end(), row.email.begin());
+    return row;
+  };
+  Statement statement{};
+  {
+    Table table{"test.db", 32};
+    REQUIRE(prepare_statement("create index on users(username)", statement) == PrepareResult::SUCCESS);
+    REQUIRE(statement.index_column == IndexColumn::USERNAME);
+    Statement insert{Statement::INSERT};
+    for (uint32_t i = 0; i < 3000; ++i) {
+      insert.row_to_insert = make_row((i * 7919) % 3000);
+      REQUIRE(execute_insert(insert, table) == ExecuteResult::SUCCESS);
+      if (i == 1000) {
+        // Half the rows go in before the index exists, the rest are added to it on insert.
+        REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+      }
+    }
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::INDEX_EXISTS);
+    REQUIRE(prepare_statement("create index on users (email)", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+    db_close(table);
+  }
+  {
+    Table table{"test.db", 32};
+    REQUIRE(table.index_roots[0] != 0);
+    REQUIRE(table.index_roots[1] != 0);
+
+    std::vector<uint32_t> ids;
+    index_lookup(table.pager, table.index_roots[0], "user7", false, ids);
+    REQUIRE(ids.size() == 60);
+
+    std::vector<Row> rows;
+    REQUIRE(prepare_statement("select id,email where username = user7 and id < 1000", statement)
+                == PrepareResult::SUCCESS);
+    REQUIRE(execute_select(statement, table, rows) == ExecuteResult::SUCCESS);
+    REQUIRE(rows.size() == 20);
+    for (std::size_t i = 0; i < rows.size(); ++i) {
+      REQUIRE(rows[i].id == 7 + 50 * i);
+      REQUIRE(std::string(rows[i].email.data()) == "person" + std::to_string(rows[i].id) + "@example.com");
+    }
+
+    rows.clear();
+    REQUIRE(prepare_statement("select where email like person12%", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_select_parallel(statement, table, rows) == ExecuteResult::SUCCESS);
+    // person12, person120-129 and person1200-1299
+    REQUIRE(rows.size() == 1 + 10 + 100);
+    REQUIRE(std::is_sorted(rows.begin(), rows.end(), [](const Row &a, const Row &b) { return a.id < b.id; }));
+
+    rows.clear();
+    REQUIRE(prepare_statement("select where email = nobody@example.com", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_select(statement, table, rows) == ExecuteResult::SUCCESS);
+    REQUIRE(rows.empty());
+  }
+  REQUIRE(prepare_statement("create index on users(id)", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("select where id like 1%", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("select where email like a%b", statement) == PrepareResult::SYNTAX_ERROR);
+  std::remove("test.db");
+}
+
+TEST_CASE("Bulk load fills indexes created on the empty table") {
+  std::remove("test.db");
+  Table table{"test.db"};
+  REQUIRE(create_index(table, IndexColumn::EMAIL) == ExecuteResult::SUCCESS);
+  std::vector<Row> rows;
+  for (uint32_t i = 0; i < 2000; ++i) {
+    rows.push_back(Row{i, "user"});
+    // Long values make the index tree split a few levels deep.
+    std::fill_n(rows.back().email.begin(), 200, 'a' + i % 3);
+  }
+  REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::SUCCESS);
+  std::vector<uint32_t> ids;
+  index_lookup(table.pager, table.index_roots[1], std::string(200, 'b'), false, ids);
+  REQUIRE(ids.size() == 667);
+  for (std::size_t i = 0; i < ids.size(); ++i) {
+    REQUIRE(ids[i] == 1 + 3 * i);
+  }
+  PinScope scope{table.pager};
+  REQUIRE(table.pager.get_page(table.index_roots[1]).node_type() == Page::NodeType::INDEX_INTERNAL);
+
+  // .btree style printing walks index trees too, one line per node and entry.
+  std::ostringstream captured;
+  auto old_buffer = std::cout.rdbuf(captured.rdbuf());
+  table.pager.print_tree(table.index_roots[1], 0);
+  std::cout.rdbuf(old_buffer);
+  auto output = captured.str();
+  REQUIRE(output.rfind("- index internal (size ", 0) == 0);
+  REQUIRE(output.find("- index leaf (size ") != std::string::npos);
+  REQUIRE(output.find(std::string(200, 'c') + " 1997\n") != std::string::npos);
+  std::remove("test.db");
+}
+
+TEST_CASE("Prepared statements bind values into a statement parsed once") {
+  std::remove("test.db");
+  Table table{"test.db"};
+
+  PreparedStatement insert;
+  REQUIRE(prepare("insert ? ? ?", insert) == PrepareResult::SUCCESS);
+  REQUIRE(insert.parameters.size() == 3);
+  for (uint32_t id = 1; id <= 200; id++) {
+    REQUIRE(insert.bind(0, id) == PrepareResult::SUCCESS);
+    // Shorter values overwrite longer ones from the previous round.
+    REQUIRE(insert.bind(1, id % 2 ? "odd" : "evenuser") == PrepareResult::SUCCESS);
+    REQUIRE(insert.bind(2, "user" + std::to_string(id) + "@example.com") == PrepareResult::SUCCESS);
+    REQUIRE(insert.execute(table) == ExecuteResult::SUCCESS);
+  }
+  REQUIRE(insert.bind(0, "7") == PrepareResult::SUCCESS);
+  REQUIRE(insert.execute(table) == ExecuteResult::DUPLICATE_KEY);
+  REQUIRE(insert.bind(0, "-7") == PrepareResult::NEGATIVE_ID);
+  REQUIRE(insert.bind(1, std::string(33, 'a')) == PrepareResult::STRING_TOO_LONG);
+  REQUIRE(insert.bind(1, 5u) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(insert.bind(3, "x") == PrepareResult::SYNTAX_ERROR);
+
+  PreparedStatement select;
+  REQUIRE(prepare("select id,username where id between ? and ? and username = ? and email like ?", select)
+              == PrepareResult::SUCCESS);
+  REQUIRE(select.parameters.size() == 4);
+  std::vector<Row> rows;
+  REQUIRE(select.bind(0, 10u) == PrepareResult::SUCCESS);
+  REQUIRE(select.bind(1, 40u) == PrepareResult::SUCCESS);
+  REQUIRE(select.bind(2, "odd") == PrepareResult::SUCCESS);
+  REQUIRE(select.bind(3, "user2") == PrepareResult::SUCCESS);
+  REQUIRE(select.execute(table, rows) == ExecuteResult::SUCCESS);
+  REQUIRE(select.statement.id_min == 10);
+  REQUIRE(select.statement.id_max == 40);
+  std::vector<uint32_t> ids;
+  for (auto &row : rows) {
+    ids.push_back(row.id);
+    REQUIRE(std::string(row.username.data()) == "odd");
+    REQUIRE(row.email[0] == '\0');
+  }
+  REQUIRE(ids == std::vector<uint32_t>{21, 23, 25, 27, 29});
+
+  rows.clear();
+  REQUIRE(select.bind(0, 50u) == PrepareResult::SUCCESS);
+  REQUIRE(select.bind(1, 49u) == PrepareResult::SUCCESS);
+  REQUIRE(select.execute(table, rows) == ExecuteResult::SUCCESS);
+  REQUIRE(rows.empty());
+
+  // Literal id terms still narrow the range, bound ones narrow it further.
+  PreparedStatement lookup;
+  REQUIRE(prepare("select where id < 100 and id > ?", lookup) == PrepareResult::SUCCESS);
+  REQUIRE(lookup.bind(0, 95u) == PrepareResult::SUCCESS);
+  REQUIRE(lookup.execute(table, rows) == ExecuteResult::SUCCESS);
+  REQUIRE(rows.size() == 4);
+  REQUIRE(rows.front().id == 96);
+  REQUIRE(rows.back().id == 99);
+
+  // Outside of prepare a ? is just a value.
+  Statement statement;
+  REQUIRE(prepare_statement("insert 500 ? ?", statement) == PrepareResult::SUCCESS);
+  REQUIRE(std::string(statement.row_to_insert.username.data()) == "?");
+  REQUIRE(prepare_statement("insert ? a b", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare("select where id like ?", lookup) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("insert 4294967296 a b", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("select id , email", statement) == PrepareResult::SUCCESS);
+  REQUIRE(statement.columns == (COLUMN_ID | COLUMN_EMAIL));
+  REQUIRE(prepare_statement("select ,", statement) == PrepareResult::SYNTAX_ERROR);
+  std::remove("test.db");
+}
+
+TEST_CASE("Insert values parses a list of rows") {
+  Statement statement;
+  REQUIRE(prepare_statement("insert values (1, alice, a@example.com), (2,bob,b@example.com)", statement)
+              == PrepareResult::SUCCESS);
+  REQUIRE(statement.statement_type == Statement::INSERT_BATCH);
+  REQUIRE(statement.rows_to_insert.size() == 2);
+  REQUIRE(statement.rows_to_insert[1].id == 2);
+  REQUIRE(std::string(statement.rows_to_insert[0].username.data()) == "alice");
+  REQUIRE(std::string(statement.rows_to_insert[1].email.data()) == "b@example.com");
+
+  REQUIRE(prepare_statement("insert values", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("insert values (1, a, b) (2, c, d)", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("insert values (1, a, b),", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("insert values (1, a, b, c)", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("insert values (1, a)", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("insert values (1, , b)", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("insert values (-1, a, b)", statement) == PrepareResult::NEGATIVE_ID);
+  REQUIRE(prepare_statement("insert values (1, a, " + std::string(256, 'e') + ")", statement)
+              == PrepareResult::STRING_TOO_LONG);
+}
+
+TEST_CASE("Batched inserts merge sorted runs into leaves") {
+  std::remove("test.db");
+  Table table{"test.db", 32};
+  REQUIRE(create_index(table, IndexColumn::USERNAME) == ExecuteResult::SUCCESS);
+  std::mt19937 random{7};
+  std::map<uint32_t, std::string> expected;
+  auto make_row = [&](uint32_t id) {
+    Row row{id};
+    auto username = "user" + std::to_string(id % 10);
+    // Every so often a row with a long email.
+    auto email = std::string(id % 13 == 0 ? 200 : 5 + id % 40, 'a' + id % 26);
+    std::copy(username.begin(), username.end(), row.username.begin());
+    std::copy(email.begin(), email.end(), row.email.begin());
+    return row;
+  };
+  for (int batch = 0; batch < 10; batch++) {
+    std::vector<Row> rows;
+    while (rows.size() < 1000) {
+      auto id = random() % 50000;
+      if (expected.emplace(id, "").second) {
+        rows.push_back(make_row(id));
+        expected[id] = rows.back().email.data();
+      }
+    }
+    REQUIRE(execute_insert_batch(rows.data(), rows.size(), table) == ExecuteResult::SUCCESS);
+  }
+
+  std::vector<Row> before;
+  Statement select{Statement::SELECT};
+  REQUIRE(execute_select(select, table, before) == ExecuteResult::SUCCESS);
+  REQUIRE(before.size() == expected.size());
+  auto it = expected.begin();
+  for (auto &row : before) {
+    REQUIRE(row.id == it->first);
+    REQUIRE(std::string(row.email.data()) == it->second);
+    ++it;
+  }
+  REQUIRE(tree_depth(table) == 2);
+
+  // A taken id, in the table or twice in the batch, rejects the whole batch.
+  std::vector<Row> rows{make_row(50001), make_row(before[500].id)};
+  REQUIRE(execute_insert_batch(rows.data(), rows.size(), table) == ExecuteResult::DUPLICATE_KEY);
+  rows = {make_row(50001), make_row(50002), make_row(50001)};
+  REQUIRE(execute_insert_batch(rows.data(), rows.size(), table) == ExecuteResult::DUPLICATE_KEY);
+  // Found only once the rows for earlier leaves went in, which are taken back out.
+  uint32_t free_id = 0;
+  while (expected.count(free_id)) {
+    free_id++;
+  }
+  rows = {make_row(free_id), make_row(50003), make_row(before.back().id)};
+  REQUIRE(execute_insert_batch(rows.data(), rows.size(), table) == ExecuteResult::DUPLICATE_KEY);
+  std::vector<Row> after;
+  REQUIRE(execute_select(select, table, after) == ExecuteResult::SUCCESS);
+  REQUIRE(after.size() == before.size());
+  REQUIRE(table_row_count(table) == before.size());
+  REQUIRE(table_rank(table, before.back().id) == before.size() - 1);
+
+  // A run too big for its leaf is split in with the leaf's cells, many rows per split.
+  rows.clear();
+  for (uint32_t id = 60000; id < 65000; id++) {
+    rows.push_back(make_row(id));
+  }
+  auto splits_before = metric_read(table.stats.leaf_splits);
+  REQUIRE(execute_insert_batch(rows.data(), rows.size(), table) == ExecuteResult::SUCCESS);
+  REQUIRE(metric_read(table.stats.leaf_splits) - splits_before < rows.size() / 20);
+  REQUIRE(table_row_count(table) == before.size() + rows.size());
+  REQUIRE(table_rank(table, 62500) == before.size() + 2500);
+  after.clear();
+  REQUIRE(execute_select(select, table, after) == ExecuteResult::SUCCESS);
+  REQUIRE(after.size() == before.size() + rows.size());
+  REQUIRE(after.back().id == 64999);
+
+  std::vector<uint32_t> ids;
+  index_lookup(table.pager, table.index_roots[0], "user3", false, ids);
+  REQUIRE(ids.size() == 500 + (std::size_t) std::count_if(expected.begin(), expected.end(), [](auto &entry) {
+    return entry.first % 10 == 3;
+  }));
+  std::remove("test.db");
+}
+
+TEST_CASE("Freed pages are handed out again before the file grows") {
+  std::remove("test.db");
+  std::vector<std::size_t> freed;
+  {
+    Table table{"test.db"};
+    auto &pager = table.pager;
+    // More than a trunk can list, so the list needs a second trunk.
+    for (std::size_t i = 0; i < FREELIST_TRUNK_CAPACITY + 10; i++) {
+      PinScope scope{pager};
+      auto page_num = pager.get_unused_page_num();
+      pager.get_page(page_num).node_type(Page::NodeType::OVERFLOW);
+      pager.mark_dirty(page_num);
+      freed.push_back(page_num);
+    }
+    for (auto page_num : freed) {
+      pager.free_page(page_num);
+    }
+    REQUIRE(pager.free_page_count() == freed.size());
+    pager.commit();
+    db_close(table);
+  }
+  Table table{"test.db"};
+  auto &pager = table.pager;
+  auto num_pages = pager.num_pages.load();
+  REQUIRE(pager.free_page_count() == freed.size());
+  std::vector<std::size_t> reused;
+  for (std::size_t i = 0; i < freed.size(); i++) {
+    reused.push_back(pager.get_unused_page_num());
+    PinScope scope{pager};
+    // Recycled pages come back zeroed, whatever they were used for.
+    REQUIRE(pager.get_page(reused.back()).node_type() == Page::NodeType::INTERNAL);
+  }
+  REQUIRE(pager.free_page_count() == 0);
+  REQUIRE(pager.num_pages == num_pages);
+  std::sort(reused.begin(), reused.end());
+  REQUIRE(reused == freed);
+  REQUIRE(pager.get_unused_page_num() == num_pages);
+  std::remove("test.db");
+}
+
+TEST_CASE("Vacuum moves pages into free ones and truncates the file") {
+  WalOptions wal_options{};
+  wal_options.enabled = true;
+  for (auto [backend, options] : {std::pair{PagerBackend::BUFFER_POOL, WalOptions{}},
+                                  std::pair{PagerBackend::MMAP, WalOptions{}},
+                                  std::pair{PagerBackend::BUFFER_POOL, wal_options},
+                                  std::pair{PagerBackend::IO_URING, wal_options}}) {
+    std::remove("test.db");
+    std::remove("test.db-wal");
+    auto make_row = [](uint32_t id) {
+      Row row{id, "user"};
+      std::fill_n(row.email.begin(), id % 7 == 0 ? 250 : 20, 'a' + id % 26);
+      return row;
+    };
+    std::size_t pages_before;
+    {
+      Table table{"test.db", 16, backend, options};
+      REQUIRE(create_index(table, IndexColumn::EMAIL) == ExecuteResult::SUCCESS);
+      Statement insert{Statement::INSERT};
+      // Junk pages in the middle of the file, between rows inserted before and after.
+      std::vector<std::size_t> junk;
+      for (uint32_t id = 0; id < 2000; id++) {
+        if (id == 1000) {
+          for (int i = 0; i < 50; i++) {
+            PinScope scope{table.pager};
+            junk.push_back(table.pager.get_unused_page_num());
+            table.pager.get_page(junk.back());
+            table.pager.mark_dirty(junk.back());
+          }
+        }
+        insert.row_to_insert = make_row(id * 7919 % 2000);
+        REQUIRE(execute_insert(insert, table) == ExecuteResult::SUCCESS);
+      }
+      for (auto page_num : junk) {
+        table.pager.free_page(page_num);
+      }
+      table.pager.commit();
+      pages_before = table.pager.num_pages;
+
+      vacuum(table);
+      REQUIRE(table.pager.num_pages == pages_before - 50);
+      REQUIRE(table.pager.free_page_count() == 0);
+      db_close(table);
+    }
+    REQUIRE(std::filesystem::file_size("test.db") == (pages_before - 50) * PAGE_SIZE);
+
+    Table table{"test.db", 16, backend, options};
+    std::vector<Row> rows;
+    Statement select{Statement::SELECT};
+    REQUIRE(execute_select(select, table, rows) == ExecuteResult::SUCCESS);
+    REQUIRE(rows.size() == 2000);
+    for (uint32_t id = 0; id < 2000; id++) {
+      REQUIRE(rows[id].id == id);
+      REQUIRE(std::string(rows[id].email.data()) == make_row(id).email.data());
+    }
+    std::vector<uint32_t> ids;
+    index_lookup(table.pager, table.index_roots[1], std::string(250, 'a'), false, ids);
+    // Ids that are multiples of 7 with id % 26 == 0, so multiples of 182.
+    REQUIRE(ids.size() == 11);
+    db_close(table);
+  }
+  std::remove("test.db");
+  std::remove("test.db-wal");
+}
+
+TEST_CASE("Delete and update parse their where and set clauses") {
+  Statement statement{};
+  REQUIRE(prepare_statement("delete", statement) == PrepareResult::SUCCESS);
+  REQUIRE(statement.statement_type == Statement::DELETE);
+  REQUIRE(prepare_statement("delete where id between 3 and 9", statement) == PrepareResult::SUCCESS);
+  REQUIRE(statement.id_min == 3);
+  REQUIRE(statement.id_max == 9);
+  REQUIRE(prepare_statement("delete from users", statement) == PrepareResult::SYNTAX_ERROR);
+
+  REQUIRE(prepare_statement("update set email = a@b.c, username = bob where id = 4", statement)
+              == PrepareResult::SUCCESS);
+  REQUIRE(statement.statement_type == Statement::UPDATE);
+  REQUIRE(statement.update_columns == (COLUMN_USERNAME | COLUMN_EMAIL));
+  REQUIRE(std::string(statement.row_to_insert.email.data()) == "a@b.c");
+  REQUIRE(std::string(statement.row_to_insert.username.data()) == "bob");
+  REQUIRE(statement.id_min == 4);
+  REQUIRE(statement.id_max == 4);
+  REQUIRE(prepare_statement("update set email = x , username = y", statement) == PrepareResult::SUCCESS);
+  REQUIRE(prepare_statement("update set id = 3", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("update set email = x, email = y", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("update set where id = 1", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("update set username = " + std::string(33, 'a'), statement)
+              == PrepareResult::STRING_TOO_LONG);
+
+  PreparedStatement prepared;
+  REQUIRE(prepare("update set username = ? where id = ?", prepared) == PrepareResult::SUCCESS);
+  REQUIRE(prepared.parameters.size() == 2);
+  REQUIRE(prepared.bind(0, "carol") == PrepareResult::SUCCESS);
+  REQUIRE(prepared.bind(1, 7u) == PrepareResult::SUCCESS);
+  REQUIRE(std::string(prepared.statement.row_to_insert.username.data()) == "carol");
+}
+
+// Checks key order, parent pointers and that every separator bounds its
+// subtree. Returns the subtree's largest key.
+uint32_t check_subtree(Pager &pager, uint32_t page_num, uint32_t parent_page_num, uint32_t &leaves) {
+  PinScope scope{pager};
+  auto &node = pager.get_page(page_num);
+  if (parent_page_num != 0) {
+    REQUIRE(*node.parent() == parent_page_num);
+  }
+  if (node.node_type() == Page::NodeType::LEAF) {
+    leaves++;
+    for (uint32_t i = 1; i < *node.num_cells(); i++) {
+      REQUIRE(*node.key(i - 1) < *node.key(i));
+    }
+    return *node.num_cells() == 0 ? 0 : *node.key(*node.num_cells() - 1);
+  }
+  REQUIRE(*node.num_keys() > 0);
+  uint32_t max_key = 0;
+  for (uint32_t i = 0; i <= *node.num_keys(); i++) {
+    max_key = check_subtree(pager, *node.child(i), page_num, leaves);
+    if (i < *node.num_keys()) {
+      REQUIRE(max_key <= *node.key(i));
+    }
+    PinScope child_scope{pager};
+    REQUIRE(*node.child_count(i) == pager.get_page(*node.child(i)).row_count());
+  }
+  return max_key;
+}
+
+TEST_CASE("Deletes merge and rebalance leaves and give their pages back") {
+  std::remove("test.db");
+  Table table{"test.db", 32};
+  REQUIRE(create_index(table, IndexColumn::EMAIL) == ExecuteResult::SUCCESS);
+  std::mt19937 random{11};
+  std::map<uint32_t, std::string> expected;
+  Statement insert{Statement::INSERT};
+  while (expected.size() < 5000) {
+    uint32_t id = random() % 100000;
+    auto email = std::string(id % 9 == 0 ? 220 : 5 + id % 30, 'a' + id % 26);
+    insert.row_to_insert = Row{id, "user"};
+    std::copy(email.begin(), email.end(), insert.row_to_insert.email.begin());
+    if (execute_insert(insert, table) == ExecuteResult::SUCCESS) {
+      expected[id] = email;
+    }
+  }
+  uint32_t leaves_before = 0;
+  check_subtree(table.pager, table.root_page_num, 0, leaves_before);
+  auto pages_before = table.pager.num_pages.load();
+
+  // Single rows, then whole ranges, leaving about a tenth of the rows.
+  Statement statement{};
+  for (int i = 0; i < 1000; i++) {
+    auto it = std::next(expected.begin(), random() % expected.size());
+    REQUIRE(prepare_statement("delete where id = " + std::to_string(it->first), statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+    expected.erase(it);
+  }
+  for (uint32_t start = 0; start < 100000; start += 10000) {
+    auto end = start + 8999;
+    REQUIRE(prepare_statement("delete where id between " + std::to_string(start) + " and " + std::to_string(end),
+                              statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+    expected.erase(expected.lower_bound(start), expected.upper_bound(end));
+  }
+  REQUIRE_FALSE(table_delete(table, 99999999));
+
+  uint32_t leaves_after = 0;
+  check_subtree(table.pager, table.root_page_num, 0, leaves_after);
+  REQUIRE(leaves_after < leaves_before / 5);
+  REQUIRE(table.pager.free_page_count() > 0);
+  REQUIRE(table.pager.num_pages == pages_before);
+
+  std::vector<Row> rows;
+  Statement select{Statement::SELECT};
+  REQUIRE(execute_select(select, table, rows) == ExecuteResult::SUCCESS);
+  REQUIRE(rows.size() == expected.size());
+  auto it = expected.begin();
+  for (auto &row : rows) {
+    REQUIRE(row.id == it->first);
+    REQUIRE(std::string(row.email.data()) == it->second);
+    ++it;
+  }
+  // The index lost the deleted rows' entries too.
+  std::vector<uint32_t> ids;
+  index_lookup(table.pager, table.index_roots[1], std::string(220, 'a'), false, ids);
+  REQUIRE(ids.size() == (std::size_t) std::count_if(expected.begin(), expected.end(), [](auto &entry) {
+    return entry.second == std::string(220, 'a');
+  }));
+
+  // New rows go into the freed pages before the file grows.
+  for (uint32_t id = 200000; id < 200500; id++) {
+    insert.row_to_insert = Row{id, "user", "user@example.com"};
+    REQUIRE(execute_insert(insert, table) == ExecuteResult::SUCCESS);
+  }
+  REQUIRE(table.pager.num_pages == pages_before);
+  std::remove("test.db");
+}
+
+TEST_CASE("Updates rewrite rows in place or move them and keep indexes current") {
+  std::remove("test.db");
+  Table table{"test.db", 32};
+  REQUIRE(create_index(table, IndexColumn::USERNAME) == ExecuteResult::SUCCESS);
+  Statement statement{};
+  for (uint32_t id = 0; id < 1000; id++) {
+    REQUIRE(prepare_statement("insert " + std::to_string(id) + " user" + std::to_string(id % 10) + " e"
+                                  + std::to_string(id), statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  }
+  auto select_one = [&](uint32_t id) {
+    std::vector<Row> rows;
+    Statement select{Statement::SELECT};
+    REQUIRE(prepare_statement("select where id = " + std::to_string(id), select) == PrepareResult::SUCCESS);
+    REQUIRE(execute_select(select, table, rows) == ExecuteResult::SUCCESS);
+    REQUIRE(rows.size() == 1);
+    return rows[0];
+  };
+
+  // Growing every email moves rows out of leaves that no longer have room, they still don't spill.
+  auto long_email = std::string(240, 'x');
+  REQUIRE(prepare_statement("update set email = " + long_email + " where id < 500", statement)
+              == PrepareResult::SUCCESS);
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  REQUIRE(std::string(select_one(499).email.data()) == long_email);
+  REQUIRE(std::string(select_one(500).email.data()) == "e500");
+  for (std::size_t page_num = 0; page_num < table.pager.num_pages; ++page_num) {
+    PinScope scope{table.pager};
+    REQUIRE(table.pager.get_page(page_num).node_type() != Page::NodeType::OVERFLOW);
+  }
+
+  REQUIRE(prepare_statement("update set email = short where id < 500", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  REQUIRE(std::string(select_one(123).email.data()) == "short");
+
+  REQUIRE(prepare_statement("update set username = renamed where username = user3", statement)
+              == PrepareResult::SUCCESS);
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  std::vector<uint32_t> ids;
+  index_lookup(table.pager, table.index_roots[0], "user3", false, ids);
+  REQUIRE(ids.empty());
+  index_lookup(table.pager, table.index_roots[0], "renamed", false, ids);
+  REQUIRE(ids.size() == 100);
+  REQUIRE(std::string(select_one(13).username.data()) == "renamed");
+  REQUIRE(std::string(select_one(13).email.data()) == "short");
+  std::remove("test.db");
+}
+
+TEST_CASE("Deleting every row collapses the tree back to a root leaf") {
+  std::remove("test.db");
+  Table table{"test.db"};
+  Statement statement{};
+  for (uint32_t id = 0; id < 3000; id++) {
+    statement = Statement{Statement::INSERT};
+    statement.row_to_insert = Row{id, "user", "user@example.com"};
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  }
+  REQUIRE(tree_depth(table) > 1);
+  REQUIRE(prepare_statement("delete", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  REQUIRE(tree_depth(table) == 1);
+  {
+    PinScope scope{table.pager};
+    auto &root = table.pager.get_page(table.root_page_num);
+    REQUIRE(root.node_type() == Page::NodeType::LEAF);
+    REQUIRE(root.is_root());
+    REQUIRE(*root.num_cells() == 0);
+  }
+  // The table counts as empty again.
+  std::vector<Row> rows{Row{1, "a", "b"}, Row{2, "c", "d"}};
+  REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::SUCCESS);
+  std::remove("test.db");
+}
+
+TEST_CASE("An io ring runs a batch of writes and reads") {
+  std::remove("test.db");
+  auto fd = ::open("test.db", O_RDWR | O_CREAT, 0644);
+  REQUIRE(fd >= 0);
+  // More requests than the ring has entries, so it has to refill.
+  IoRing ring{8};
+  std::vector<std::array<char, PAGE_SIZE>> pages(20);
+  std::vector<IoRequest> requests;
+  for (std::size_t i = 0; i < pages.size(); i++) {
+    pages[i].fill('a' + i);
+    requests.push_back(IoRequest{pages[i].data(), PAGE_SIZE, (pages.size() - 1 - i) * PAGE_SIZE, true});
+  }
+  ring.run(fd, requests.data(), requests.size());
+  for (auto &request : requests) {
+    REQUIRE(request.result == (int) PAGE_SIZE);
+  }
+
+  std::vector<std::array<char, PAGE_SIZE>> read_back(pages.size());
+  requests.clear();
+  for (std::size_t i = 0; i < pages.size(); i++) {
+    requests.push_back(IoRequest{read_back[i].data(), PAGE_SIZE, i * PAGE_SIZE, false});
+  }
+  ring.run(fd, requests.data(), requests.size());
+  for (std::size_t i = 0; i < pages.size(); i++) {
+    REQUIRE(requests[i].result == (int) PAGE_SIZE);
+    REQUIRE(read_back[i] == pages[pages.size() - 1 - i]);
+  }
+  ::close(fd);
+  std::remove("test.db");
+}
+
+TEST_CASE("The io_uring backend reads ahead of scans") {
+  std::remove("test.db");
+  {
+    Table table{"test.db", 32, PagerBackend::IO_URING};
+    Statement insert{Statement::INSERT};
+    for (uint32_t id = 0; id < 5000; id++) {
+      insert.row_to_insert = Row{id, "user", "user@example.com"};
+      REQUIRE(execute_insert(insert, table) == ExecuteResult::SUCCESS);
+    }
+    db_close(table);
+  }
+
+  Table table{"test.db", 32, PagerBackend::IO_URING};
+  std::vector<Row> rows;
+  Statement select{Statement::SELECT};
+  REQUIRE(execute_select(select, table, rows) == ExecuteResult::SUCCESS);
+  REQUIRE(rows.size() == 5000);
+  for (uint32_t id = 0; id < 5000; id++) {
+    REQUIRE(rows[id].id == id);
+  }
+  // Most leaves came in through read-ahead rather than one miss each.
+  auto leaves = collect_leaves(Snapshot{table}, 0, std::numeric_limits<uint32_t>::max()).size();
+  REQUIRE(leaves > 50);
+  REQUIRE(table.pager.stats.readaheads > leaves / 2);
+  REQUIRE(table.pager.stats.misses < leaves / 2);
+  db_close(table);
+  std::remove("test.db");
+}
+
+TEST_CASE("CRC32C gives the same checksums in hardware and from the table") {
+  std::string check = "123456789";
+  REQUIRE(crc32c_table(check.data(), check.size()) == 0xe3069283);
+  REQUIRE(crc32c(check.data(), check.size()) == 0xe3069283);
+  std::mt19937 random{5};
+  std::vector<char> data(PAGE_SIZE + 7);
+  for (auto &byte : data) {
+    byte = static_cast<char>(random());
+  }
+  // Odd lengths exercise the byte at a time tail, chaining splits the input.
+  for (std::size_t size : {0, 1, 7, 8, 9, 100, (int) PAGE_SIZE, (int) PAGE_SIZE + 7}) {
+    auto whole = crc32c(data.data(), size);
+    REQUIRE(whole == crc32c_table(data.data(), size));
+    REQUIRE(whole == crc32c(data.data() + size / 2, size - size / 2, crc32c(data.data(), size / 2)));
+  }
+}
+
+TEST_CASE("Check finds pages whose checksum doesn't match") {
+  WalOptions wal_options{};
+  wal_options.enabled = true;
+  for (auto [backend, options] : {std::pair{PagerBackend::BUFFER_POOL, WalOptions{}},
+                                  std::pair{PagerBackend::MMAP, WalOptions{}},
+                                  std::pair{PagerBackend::BUFFER_POOL, wal_options}}) {
+    std::remove("test.db");
+    std::remove("test.db-wal");
+    std::size_t leaf_page_num;
+    {
+      Table table{"test.db", 16, backend, options};
+      Statement insert{Statement::INSERT};
+      for (uint32_t id = 0; id < 2000; id++) {
+        insert.row_to_insert = Row{id, "user", "user@example.com"};
+        REQUIRE(execute_insert(insert, table) == ExecuteResult::SUCCESS);
+      }
+      REQUIRE(check_pages(table, 4).empty());
+      leaf_page_num = table_find(table, 1000).page_num;
+      db_close(table);
+    }
+
+    // Flip one byte in the middle of a leaf, as a torn write might.
+    {
+      std::fstream file{"test.db", std::ios::in | std::ios::out | std::ios::binary};
+      file.seekg(leaf_page_num * PAGE_SIZE + PAGE_SIZE / 2);
+      char byte;
+      file.read(&byte, 1);
+      byte ^= 0x40;
+      file.seekp(leaf_page_num * PAGE_SIZE + PAGE_SIZE / 2);
+      file.write(&byte, 1);
+    }
+    Table table{"test.db", 16, backend, options};
+    REQUIRE(check_pages(table, 4) == std::vector<std::size_t>{leaf_page_num});
+    REQUIRE(check_pages(table, 1) == std::vector<std::size_t>{leaf_page_num});
+    db_close(table);
+  }
+  std::remove("test.db");
+  std::remove("test.db-wal");
+}
+
+TEST_CASE("Latency histogram buckets stay within an eighth of their values") {
+  uint64_t previous_bound = 0;
+  for (unsigned i = 1; i < LATENCY_BUCKETS; i++) {
+    auto bound = LatencyHistogram::bucket_upper_bound(i);
+    REQUIRE(bound > previous_bound);
+    REQUIRE(LatencyHistogram::bucket_index(bound) == i);
+    REQUIRE(LatencyHistogram::bucket_index(previous_bound + 1) == i);
+    previous_bound = bound;
+  }
+  REQUIRE(previous_bound == std::numeric_limits<uint64_t>::max());
+
+  LatencyHistogram histogram;
+  REQUIRE(histogram.percentile(0.5) == 0);
+  for (uint64_t value = 1; value <= 10000; value++) {
+    histogram.record(value * 100);
+  }
+  REQUIRE(histogram.count == 10000);
+  REQUIRE(histogram.max_ns == 1000000);
+  for (double p : {0.5, 0.9, 0.99}) {
+    auto exact = static_cast<double>(p * 10000 * 100);
+    REQUIRE(histogram.percentile(p) >= exact);
+    REQUIRE(histogram.percentile(p) <= exact * 1.125);
+  }
+  REQUIRE(histogram.percentile(1.0) == 1000000);
+}
+
+TEST_CASE("Metrics count I/O, tree changes and statement latency") {
+  std::remove("test.db");
+  Table table{"test.db", 16};
+  Statement statement{};
+  for (uint32_t id = 0; id < 3000; id++) {
+    statement = Statement{Statement::INSERT};
+    statement.row_to_insert = Row{id, "user", "user@example.com"};
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  }
+  // Someone polling while the writer is busy sees consistent enough numbers and no races.
+  std::atomic<bool> done{false};
+  std::atomic<bool> shallow{false};
+  std::thread poller{[&] {
+    while (!done) {
+      shallow = shallow || collect_metrics(table).tree_depth < 2;
+    }
+  }};
+  REQUIRE(prepare_statement("delete where id < 2500", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  PreparedStatement select;
+  REQUIRE(prepare("select where id > ?", select) == PrepareResult::SUCCESS);
+  REQUIRE(select.bind(0, 2900u) == PrepareResult::SUCCESS);
+  std::vector<Row> rows;
+  REQUIRE(select.execute(table, rows) == ExecuteResult::SUCCESS);
+  REQUIRE(rows.size() == 99);
+  done = true;
+  poller.join();
+  REQUIRE_FALSE(shallow);
+
+  auto metrics = collect_metrics(table);
+  REQUIRE(metrics.tree_depth == tree_depth(table));
+  REQUIRE(metrics.leaf_splits > 3000 / 100);
+  REQUIRE(metrics.root_splits == 1);
+  REQUIRE(metrics.merges + metrics.redistributions > 0);
+  // A pool of 16 frames can't hold the table, so pages went back and forth.
+  REQUIRE(metrics.cache_misses > 0);
+  REQUIRE(metrics.pages_written > 0);
+  REQUIRE(metrics.bytes_written == metrics.pages_written * PAGE_SIZE);
+  REQUIRE(metrics.pages_read > 0);
+  REQUIRE(metrics.bytes_read == metrics.pages_read * PAGE_SIZE);
+
+  auto &inserts = metrics.statements[Statement::INSERT];
+  REQUIRE(inserts.count == 3000);
+  REQUIRE(inserts.p50_ns <= inserts.p99_ns);
+  REQUIRE(inserts.p99_ns <= inserts.max_ns);
+  REQUIRE(inserts.mean_ns > 0);
+  REQUIRE(metrics.statements[Statement::DELETE].count == 1);
+  REQUIRE(metrics.statements[Statement::SELECT].count == 1);
+  REQUIRE(metrics.statements[Statement::UPDATE].count == 0);
+
+  std::ostringstream captured;
+  auto old_buffer = std::cout.rdbuf(captured.rdbuf());
+  auto result = do_meta_command(".stats", table);
+  std::cout.rdbuf(old_buffer);
+  REQUIRE(result == MetaCommandResult::SUCCESS);
+  auto output = captured.str();
+  REQUIRE(output.rfind("pages_read: ", 0) == 0);
+  REQUIRE(output.find("\ntree_depth: " + std::to_string(metrics.tree_depth) + "\n") != std::string::npos);
+  REQUIRE(output.find("\nroot_splits: 1\n") != std::string::npos);
+  REQUIRE(output.find("\ninsert: count 3000, mean ") != std::string::npos);
+  REQUIRE(output.find("\nupdate: ") == std::string::npos);
+  std::remove("test.db");
+}
+
+TEST_CASE("Metrics count log frames in the same unit as file pages") {
+  std::remove("test.db");
+  std::remove("test.db-wal");
+  Table table{"test.db", 16, PagerBackend::BUFFER_POOL, WalOptions{true}};
+  Statement statement{};
+  for (uint32_t id = 0; id < 3000; id++) {
+    statement = Statement{Statement::INSERT};
+    statement.row_to_insert = Row{id, "user", "user@example.com"};
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  }
+  // Spilled frames are read back from the log, a checkpoint reads them all again.
+  REQUIRE(table_lookup(table, 0));
+  table.pager.checkpoint();
+  auto metrics = collect_metrics(table);
+  REQUIRE(metrics.pages_written > 0);
+  REQUIRE(metrics.bytes_written == metrics.pages_written * PAGE_SIZE);
+  REQUIRE(metrics.pages_read > 0);
+  REQUIRE(metrics.bytes_read == metrics.pages_read * PAGE_SIZE);
+  db_close(table);
+  std::remove("test.db");
+  std::remove("test.db-wal");
+}
+
+TEST_CASE("Snapshots keep seeing the table as it was when they were taken") {
+  std::remove("test.db");
+  Table table{"test.db", 16};
+  std::vector<Row> rows;
+  for (uint32_t id = 0; id < 1000; id += 2) {
+    rows.push_back(Row{id, "user", "user@example.com"});
+  }
+  REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::SUCCESS);
+  Statement select{Statement::SELECT};
+  std::vector<Row> before;
+  {
+    Snapshot snapshot{table};
+    Statement statement{};
+    // Splits, merges, rows moved by growing and page reuse all happen behind the snapshot's back.
+    for (uint32_t id = 1; id < 1000; id += 2) {
+      statement = Statement{Statement::INSERT};
+      statement.row_to_insert = Row{id, "user", "user@example.com"};
+      REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+    }
+    REQUIRE(prepare_statement("delete where id < 300", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+    std::string long_email(Row::COLUMN_EMAIL_SIZE, 'x');
+    REQUIRE(prepare_statement("update set email = " + long_email + " where id > 900", statement)
+                == PrepareResult::SUCCESS);
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+    REQUIRE_FALSE(table.pager.versions.versions.empty());
+
+    REQUIRE(execute_select(select, snapshot, before) == ExecuteResult::SUCCESS);
+    REQUIRE(before.size() == 500);
+    for (std::size_t i = 0; i < before.size(); i++) {
+      REQUIRE(before[i].id == 2 * i);
+      REQUIRE(std::string{before[i].email.data()} == "user@example.com");
+    }
+    auto cursor = table_find(snapshot, 501);
+    REQUIRE(cursor.value().id == 502);
+
+    Snapshot later{table};
+    std::vector<Row> after;
+    REQUIRE(execute_select(select, later, after) == ExecuteResult::SUCCESS);
+    REQUIRE(after.size() == 700);
+    REQUIRE(after.front().id == 300);
+    REQUIRE(std::string{after.back().email.data()} == long_email);
+  }
+  // Nothing needs the old versions once the snapshots are gone.
+  REQUIRE(table.pager.versions.versions.empty());
+  REQUIRE(table.pager.versions.snapshots.empty());
+  std::remove("test.db");
+}
+
+TEST_CASE("Snapshot scans running alongside the writer see whole statements") {
+  for (auto backend : {PagerBackend::BUFFER_POOL, PagerBackend::MMAP}) {
+    std::remove("test.db");
+    Table table{"test.db", 32, backend};
+    std::vector<uint32_t> ids(3000);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::shuffle(ids.begin(), ids.end(), std::mt19937{7});
+    auto first_seq = table.pager.versions.commit_seq;
+    std::atomic<bool> done{false};
+    std::atomic<bool> torn{false};
+    std::atomic<std::size_t> scans{0};
+    std::thread reader{[&] {
+      Statement select{Statement::SELECT};
+      while (!done) {
+        Snapshot snapshot{table};
+        std::vector<Row> rows;
+        execute_select(select, snapshot, rows);
+        // Every insert is its own statement, so the snapshot holds exactly one row per commit before it.
+        auto sorted = std::adjacent_find(rows.begin(), rows.end(),
+                                         [](const Row &a, const Row &b) { return a.id >= b.id; }) == rows.end();
+        torn = torn || !sorted || rows.size() != snapshot.seq - first_seq;
+        scans++;
+      }
+    }};
+    Statement statement{Statement::INSERT};
+    for (auto id : ids) {
+      statement.row_to_insert = Row{id, "user", "user@example.com"};
+      REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+    }
+    done = true;
+    reader.join();
+    REQUIRE_FALSE(torn);
+    REQUIRE(scans > 0);
+    REQUIRE(table.pager.versions.versions.empty());
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("Parallel selects read a snapshot while the writer carries on") {
+  std::remove("test.db");
+  Table table{"test.db", 64};
+  std::vector<uint32_t> ids(6000);
+  std::iota(ids.begin(), ids.end(), 0);
+  std::shuffle(ids.begin(), ids.end(), std::mt19937{11});
+  auto commit_seq = [&] {
+    std::lock_guard<std::mutex> lock{table.pager.versions.mutex};
+    return table.pager.versions.commit_seq;
+  };
+  auto first_seq = commit_seq();
+  std::atomic<bool> done{false};
+  std::atomic<bool> torn{false};
+  std::atomic<std::size_t> scans{0};
+  std::thread reader{[&] {
+    Statement select{Statement::SELECT};
+    while (!done) {
+      auto seq_before = commit_seq();
+      std::vector<Row> rows;
+      execute_select_parallel(select, table, rows, 4);
+      auto seq_after = commit_seq();
+      // One row per insert statement committed before the scan's snapshot.
+      auto sorted = std::adjacent_find(rows.begin(), rows.end(),
+                                       [](const Row &a, const Row &b) { return a.id >= b.id; }) == rows.end();
+      torn = torn || !sorted || rows.size() < seq_before - first_seq || rows.size() > seq_after - first_seq;
+      scans++;
+    }
+  }};
+  Statement statement{Statement::INSERT};
+  for (auto id : ids) {
+    statement.row_to_insert = Row{id, "user", "user@example.com"};
+    REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  }
+  done = true;
+  reader.join();
+  REQUIRE_FALSE(torn);
+  REQUIRE(scans > 0);
+  REQUIRE(table.pager.versions.versions.empty());
+  std::remove("test.db");
+}
+
+TEST_CASE("Result sets stream rows straight from the leaves") {
+  std::remove("test.db");
+  Table table{"test.db", 16};
+  std::string long_email(Row::COLUMN_EMAIL_SIZE, 'e');
+  std::vector<Row> rows;
+  for (uint32_t id = 0; id < 2000; id++) {
+    Row row{id, "user", "user@example.com"};
+    if (id % 7 == 0) {
+      strcpy(row.email.data(), long_email.c_str());
+    }
+    rows.push_back(row);
+  }
+  REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::SUCCESS);
+
+  Statement statement{};
+  REQUIRE(prepare_statement("select where id >= 100 and id < 1500", statement) == PrepareResult::SUCCESS);
+  auto results = open_select(statement, table);
+  RowView row{};
+  uint32_t expected = 100;
+  while (results.next(row)) {
+    REQUIRE(row.id == expected);
+    REQUIRE(row.email == (expected % 7 == 0 ? long_email : "user@example.com"));
+    expected++;
+  }
+  REQUIRE(expected == 1500);
+  REQUIRE_FALSE(results.next(row));
+
+  REQUIRE(prepare_statement("create index on users(email)", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  REQUIRE(prepare_statement("select id where email = " + long_email + " and id > 1000", statement)
+              == PrepareResult::SUCCESS);
+  std::vector<Row> collected;
+  REQUIRE(execute_select(statement, table, collected) == ExecuteResult::SUCCESS);
+  REQUIRE(collected.size() == 143);
+  REQUIRE(collected.front().id == 1001);
+
+  // Printing goes through the same rows, formatted like print_row.
+  std::ostringstream captured;
+  auto old_buffer = std::cout.rdbuf(captured.rdbuf());
+  auto result = execute_statement(statement, table);
+  REQUIRE(prepare_statement("select", statement) == PrepareResult::SUCCESS);
+  auto full_result = execute_statement(statement, table);
+  std::cout.rdbuf(old_buffer);
+  REQUIRE(result == ExecuteResult::SUCCESS);
+  REQUIRE(full_result == ExecuteResult::SUCCESS);
+  auto output = captured.str();
+  REQUIRE(output.rfind("(1001)\n(1008)\n", 0) == 0);
+  REQUIRE(output.find("(1, user, user@example.com)\n(2, user, user@example.com)\n") != std::string::npos);
+  REQUIRE(output.size() > OUTPUT_BUFFER_SIZE);
+  REQUIRE(std::count(output.begin(), output.end(), '\n') == 143 + 2000);
+  std::remove("test.db");
+}
+
+TEST_CASE("Subtree counts answer count, rank and offset without scanning") {
+  std::remove("test.db");
+  Table table{"test.db", 64};
+  std::mt19937 random{23};
+  std::set<uint32_t> expected;
+  Statement insert{Statement::INSERT};
+  // Enough rows for internal nodes to split, with duplicates that have to take their count back.
+  for (int i = 0; i < 40000; i++) {
+    uint32_t id = random() % 60000;
+    insert.row_to_insert = Row{id, "u", "user-with-a-longer-address@example.com"};
+    auto result = execute_insert(insert, table);
+    REQUIRE(result == (expected.insert(id).second ? ExecuteResult::SUCCESS : ExecuteResult::DUPLICATE_KEY));
+  }
+  std::vector<Row> batch;
+  for (uint32_t id = 60000; id < 63000; id += 3) {
+    batch.push_back(Row{id, "batch", "batch@example.com"});
+    expected.insert(id);
+  }
+  REQUIRE(execute_insert_batch(batch.data(), batch.size(), table) == ExecuteResult::SUCCESS);
+  REQUIRE(table.stats.internal_splits > 0);
+  Statement statement{};
+  REQUIRE(prepare_statement("delete where id between 10000 and 25000", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  expected.erase(expected.lower_bound(10000), expected.upper_bound(25000));
+  uint32_t leaves = 0;
+  check_subtree(table.pager, table.root_page_num, 0, leaves);
+
+  REQUIRE(table_row_count(table) == expected.size());
+  for (uint32_t key : {0u, 1u, 9999u, 10000u, 30000u, 59999u, 61500u, 99999u}) {
+    REQUIRE(table_rank(table, key) == static_cast<uint64_t>(std::distance(expected.begin(), expected.lower_bound(key))));
+  }
+
+  std::vector<Row> rows;
+  REQUIRE(prepare_statement("select count(*) where id >= 5000 and id < 40000", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_select(statement, table, rows) == ExecuteResult::SUCCESS);
+  REQUIRE(rows.size() == 1);
+  REQUIRE(rows[0].id == std::distance(expected.lower_bound(5000), expected.lower_bound(40000)));
+  rows.clear();
+  REQUIRE(prepare_statement("select count(*) where username = batch", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_select(statement, table, rows) == ExecuteResult::SUCCESS);
+  REQUIRE(rows[0].id == 1000);
+
+  // Page 50 of 20 rows each, jumped to by position.
+  rows.clear();
+  REQUIRE(prepare_statement("select id where id > 100 limit 20 offset 1000", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_select_parallel(statement, table, rows) == ExecuteResult::SUCCESS);
+  auto first = std::next(expected.upper_bound(100), 1000);
+  REQUIRE(rows.size() == 20);
+  for (auto &row : rows) {
+    REQUIRE(row.id == *first++);
+  }
+  // With other predicates the offset counts matching rows.
+  rows.clear();
+  REQUIRE(prepare_statement("select where username = batch limit 5 offset 998", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_select(statement, table, rows) == ExecuteResult::SUCCESS);
+  REQUIRE(rows.size() == 2);
+  REQUIRE(rows[1].id == 62997);
+  rows.clear();
+  REQUIRE(prepare_statement("select offset 100000000", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_select(statement, table, rows) == ExecuteResult::SUCCESS);
+  REQUIRE(rows.empty());
+
+  REQUIRE(prepare_statement("select limit 0", statement) == PrepareResult::SUCCESS);
+  REQUIRE(statement.limit == 0);
+  REQUIRE(prepare_statement("select count(*) limit 3", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("select limit -3", statement) == PrepareResult::NEGATIVE_ID);
+  REQUIRE(prepare_statement("select where id > 3 limit", statement) == PrepareResult::SYNTAX_ERROR);
+  REQUIRE(prepare_statement("select where id > 3 offset 1 limit 2", statement) == PrepareResult::SYNTAX_ERROR);
+
+  // limit and offset are only keywords once the where clause is done.
+  REQUIRE(prepare_statement("select where email = limit limit 1", statement) == PrepareResult::SUCCESS);
+  REQUIRE(statement.limit == 1);
+  REQUIRE(statement.predicates.size() == 1);
+  REQUIRE(statement.predicates[0].text_value == "limit");
+  REQUIRE(prepare_statement("select where username = offset", statement) == PrepareResult::SUCCESS);
+  REQUIRE(statement.offset == 0);
+  REQUIRE(statement.predicates[0].text_value == "offset");
+  REQUIRE(prepare_statement("select where username = offset and email = limit offset 2", statement) == PrepareResult::SUCCESS);
+  REQUIRE(statement.offset == 2);
+  REQUIRE(statement.predicates.size() == 2);
+  REQUIRE(statement.predicates[1].text_value == "limit");
+  std::remove("test.db");
+}
+
+TEST_CASE("Leaf filters outlive their frames and come back after a change") {
+  std::remove("test.db");
+  Table table{"test.db", 16};
+  std::vector<Row> rows;
+  for (uint32_t id = 0; id < 20000; id += 2) {
+    rows.push_back(Row{id, "user", "someone@example.com"});
+  }
+  REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::SUCCESS);
+  for (uint32_t id = 0; id < 20000; id += 2) {
+    REQUIRE(table_lookup(table, id));
+  }
+  // Far more leaves than frames were looked up, and every one kept its filter.
+  std::size_t filters = 0;
+  for (auto &stripe : table.pager.filters) {
+    filters += stripe.filters.size();
+  }
+  REQUIRE(filters > 16);
+  auto before = collect_metrics(table);
+  for (uint32_t id = 1; id < 20000; id += 2) {
+    REQUIRE_FALSE(table_lookup(table, id));
+  }
+  auto after = collect_metrics(table);
+  REQUIRE(after.filter_skips - before.filter_skips > 10000 * 95 / 100);
+  REQUIRE(after.pages_read - before.pages_read < 10000 / 10);
+
+  // A changed leaf has no filter until the statement changing it ends.
+  auto leaf_page_num = table_find(table, 10000).page_num;
+  {
+    PinScope scope{table.pager};
+    table.pager.get_page(leaf_page_num);
+    table.pager.mark_dirty(leaf_page_num);
+    REQUIRE_FALSE(table.pager.filters[leaf_page_num % FILTER_STRIPES].filters.count(leaf_page_num));
+  }
+  Statement statement{};
+  REQUIRE(prepare_statement("insert 10001 user user@example.com", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  REQUIRE(table.pager.filters[leaf_page_num % FILTER_STRIPES].filters.count(leaf_page_num));
+  for (uint32_t id : {10000, 10001}) {
+    auto page_num = table_find(table, id).page_num;
+    REQUIRE(table.pager.filters[page_num % FILTER_STRIPES].filters.count(page_num));
+    REQUIRE_FALSE(table.pager.filter_excludes(page_num, id));
+  }
+  REQUIRE(table_lookup(table, 10001));
+
+  // Duplicate checks go by the filters too, without missing a taken id.
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::DUPLICATE_KEY);
+  std::vector<Row> batch{Row{10003, "user", "user@example.com"}, Row{10001, "user", "user@example.com"}};
+  REQUIRE(execute_insert_batch(batch.data(), batch.size(), table) == ExecuteResult::DUPLICATE_KEY);
+  REQUIRE_FALSE(table_lookup(table, 10003));
+  batch[1].id = 10005;
+  REQUIRE(execute_insert_batch(batch.data(), batch.size(), table) == ExecuteResult::SUCCESS);
+  REQUIRE(table_lookup(table, 10005));
+  std::remove("test.db");
+}
+
+TEST_CASE("Key filters never miss a key and rarely admit others") {
+  KeyFilter filter;
+  for (uint32_t key = 0; key < 400; key++) {
+    filter.add(key * 7919);
+  }
+  for (uint32_t key = 0; key < 400; key++) {
+    REQUIRE(filter.may_contain(key * 7919));
+  }
+  std::size_t false_positives = 0;
+  for (uint32_t key = 1; key < 100000; key += 2) {
+    false_positives += filter.may_contain(key * 7919 + 1);
+  }
+  REQUIRE(false_positives < 50000 / 50);
+}
+
+TEST_CASE("Lookups of missing ids are answered by leaf filters") {
+  for (auto backend : {PagerBackend::BUFFER_POOL, PagerBackend::MMAP}) {
+    std::remove("test.db");
+    Table table{"test.db", 512, backend};
+    std::set<uint32_t> expected;
+    std::vector<Row> rows;
+    for (uint32_t id = 0; id < 40000; id += 2) {
+      rows.push_back(Row{id, "user", "someone@example.com"});
+      expected.insert(id);
+    }
+    REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::SUCCESS);
+    for (uint32_t id = 0; id < 40000; id += 2) {
+      REQUIRE(table_lookup(table, id));
+    }
+    // Every leaf has been through a lookup, so the odd ids mostly never fetch one.
+    for (uint32_t id = 1; id < 40000; id += 2) {
+      REQUIRE_FALSE(table_lookup(table, id));
+    }
+    REQUIRE(collect_metrics(table).filter_skips > 20000 * 95 / 100);
+
+    // Changing a leaf rebuilds its filter, so rows that arrive later are found.
+    std::mt19937 random{5};
+    Statement statement{};
+    for (int i = 0; i < 3000; i++) {
+      uint32_t id = random() % 40000;
+      if (expected.count(id)) {
+        REQUIRE(prepare_statement("delete where id = " + std::to_string(id), statement) == PrepareResult::SUCCESS);
+        expected.erase(id);
+      } else {
+        REQUIRE(prepare_statement("insert " + std::to_string(id) + " user user@example.com", statement)
+                    == PrepareResult::SUCCESS);
+        expected.insert(id);
+      }
+      REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+      uint32_t probe = random() % 40000;
+      REQUIRE(table_lookup(table, probe).has_value() == (expected.count(probe) > 0));
+      REQUIRE(table_lookup(table, id).has_value() == (expected.count(id) > 0));
+    }
+    for (uint32_t id = 0; id < 40000; id++) {
+      REQUIRE(table_lookup(table, id).has_value() == (expected.count(id) > 0));
+    }
+    std::vector<Row> found;
+    REQUIRE(prepare_statement("select where id = 12345", statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_select_parallel(statement, table, found) == ExecuteResult::SUCCESS);
+    REQUIRE(found.size() == expected.count(12345));
+  }
+  std::remove("test.db");
+}
+
+TEST_CASE("Row cache keeps rows that are hit while others stream through") {
+  RowCache cache{1024};
+  for (uint32_t id = 0; id < 32; id++) {
+    cache.put(Row{id, "hot", "hot@example.com"});
+  }
+  Row row{};
+  for (uint32_t id = 1000; id < 20000; id++) {
+    cache.put(Row{id, "cold", "cold@example.com"});
+    for (uint32_t hot = 0; hot < 32; hot++) {
+      REQUIRE(cache.get(hot, row));
+    }
+  }
+  REQUIRE(std::string{row.username.data()} == "hot");
+  std::size_t cold_cached = 0;
+  for (uint32_t id = 1000; id < 20000; id++) {
+    cold_cached += cache.get(id, row);
+  }
+  REQUIRE(cold_cached <= 1024);
+
+  cache.put(Row{7, "changed", "changed@example.com"});
+  REQUIRE(cache.get(7, row));
+  REQUIRE(std::string{row.email.data()} == "changed@example.com");
+  cache.erase(7);
+  REQUIRE_FALSE(cache.get(7, row));
+  cache.put(Row{7, "back", "back@example.com"});
+  REQUIRE(cache.get(7, row));
+}
+
+TEST_CASE("Point lookups are served from the row cache and see every change") {
+  std::remove("test.db");
+  Table table{"test.db", DEFAULT_POOL_FRAMES, PagerBackend::BUFFER_POOL, WalOptions{}, 256};
+  std::vector<Row> rows;
+  for (uint32_t id = 0; id < 5000; id++) {
+    rows.push_back(Row{id, "user", "user@example.com"});
+  }
+  REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::SUCCESS);
+
+  Statement statement{};
+  auto select_one = [&](uint32_t id) {
+    std::vector<Row> found;
+    REQUIRE(prepare_statement("select where id = " + std::to_string(id), statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_select(statement, table, found) == ExecuteResult::SUCCESS);
+    return found;
+  };
+  for (int round = 0; round < 10; round++) {
+    for (uint32_t id = 100; id < 110; id++) {
+      REQUIRE(select_one(id).size() == 1);
+    }
+  }
+  auto metrics = collect_metrics(table);
+  REQUIRE(metrics.row_cache_misses == 10);
+  REQUIRE(metrics.row_cache_hits == 90);
+
+  REQUIRE(prepare_statement("update set email = changed@example.com where id = 105", statement)
+              == PrepareResult::SUCCESS);
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  auto found = select_one(105);
+  REQUIRE(found.size() == 1);
+  REQUIRE(std::string{found[0].email.data()} == "changed@example.com");
+  REQUIRE(prepare_statement("select where id = 105 and email = user@example.com", statement)
+              == PrepareResult::SUCCESS);
+  std::vector<Row> none;
+  REQUIRE(execute_select(statement, table, none) == ExecuteResult::SUCCESS);
+  REQUIRE(none.empty());
+
+  REQUIRE(prepare_statement("delete where id = 106", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  REQUIRE(select_one(106).empty());
+  REQUIRE(prepare_statement("insert 106 again again@example.com", statement) == PrepareResult::SUCCESS);
+  REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+  found = select_one(106);
+  REQUIRE(found.size() == 1);
+  REQUIRE(std::string{found[0].username.data()} == "again");
+
+  // Index lookups go through the cache too.
+  REQUIRE(create_index(table, IndexColumn::EMAIL) == ExecuteResult::SUCCESS);
+  REQUIRE(prepare_statement("select where email = changed@example.com", statement) == PrepareResult::SUCCESS);
+  auto hits_before = collect_metrics(table).row_cache_hits;
+  found.clear();
+  REQUIRE(execute_select(statement, table, found) == ExecuteResult::SUCCESS);
+  REQUIRE(found.size() == 1);
+  REQUIRE(found[0].id == 105);
+  REQUIRE(collect_metrics(table).row_cache_hits == hits_before + 1);
+  std::remove("test.db");
+}
+
+TEST_CASE("Row cache never hands out a row older than one already seen") {
+  std::remove("test.db");
+  Table table{"test.db", DEFAULT_POOL_FRAMES, PagerBackend::BUFFER_POOL, WalOptions{}, 64};
+  std::vector<Row> rows;
+  for (uint32_t id = 0; id < 2000; id++) {
+    rows.push_back(Row{id, "0", "v@example.com"});
+  }
+  REQUIRE(table.bulk_load(rows.begin(), rows.end()) == ExecuteResult::SUCCESS);
+
+  const uint32_t hot_ids = 8;
+  const int versions = 300;
+  std::atomic<bool> done{false};
+  std::atomic<bool> went_back{false};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&, t] {
+      std::vector<int> seen(hot_ids, 0);
+      Statement statement{};
+      uint32_t i = t;
+      while (!done) {
+        auto id = i++ % hot_ids;
+        prepare_statement("select where id = " + std::to_string(id), statement);
+        std::vector<Row> found;
+        execute_select(statement, table, found);
+        auto version = std::stoi(found.at(0).username.data());
+        if (version < seen[id]) {
+          went_back = true;
+        }
+        seen[id] = version;
+      }
+    });
+  }
+  Statement statement{};
+  for (int version = 1; version <= versions; version++) {
+    for (uint32_t id = 0; id < hot_ids; id++) {
+      REQUIRE(prepare_statement("update set username = " + std::to_string(version) + " where id = "
+                                    + std::to_string(id), statement) == PrepareResult::SUCCESS);
+      REQUIRE(execute_statement(statement, table) == ExecuteResult::SUCCESS);
+    }
+  }
+  done = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  REQUIRE_FALSE(went_back);
+  for (uint32_t id = 0; id < hot_ids; id++) {
+    std::vector<Row> found;
+    REQUIRE(prepare_statement("select where id = " + std::to_string(id), statement) == PrepareResult::SUCCESS);
+    REQUIRE(execute_select(statement, table, found) == ExecuteResult::SUCCESS);
+    REQUIRE(std::string{found.at(0).username.data()} == std::to_string(versions));
+  }
+  std::remove("test.db");
+}
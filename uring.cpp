@@ -0,0 +1,135 @@
+#include "uring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+IoRing::IoRing(unsigned entries)
+    : ring_fd(-1),
+      entries(entries),
+      sq_ring(),
+      sq_ring_size(),
+      cq_ring(),
+      cq_ring_size(),
+      sq_head(),
+      sq_tail(),
+      sq_mask(),
+      sq_array(),
+      sqes(),
+      sqes_size(),
+      cq_head(),
+      cq_tail(),
+      cq_mask(),
+      cqes() {
+  io_uring_params params{};
+  ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  if (ring_fd < 0) {
+    return;
+  }
+  this->entries = params.sq_entries;
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  auto single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+  }
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  cq_ring = single_mmap ? sq_ring
+                        : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                               IORING_OFF_CQ_RING);
+  sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes_address = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                            IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes_address == MAP_FAILED) {
+    std::cerr << "Unable to map io_uring queues.\n";
+    exit(EXIT_FAILURE);
+  }
+  auto *sq = static_cast<char *>(sq_ring);
+  auto *cq = static_cast<char *>(cq_ring);
+  sq_head = (unsigned *) (sq + params.sq_off.head);
+  sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  sq_array = (unsigned *) (sq + params.sq_off.array);
+  sqes = static_cast<io_uring_sqe *>(sqes_address);
+  cq_head = (unsigned *) (cq + params.cq_off.head);
+  cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+}
+
+IoRing::~IoRing() {
+  if (ring_fd < 0) {
+    return;
+  }
+  munmap(sqes, sqes_size);
+  if (cq_ring != sq_ring) {
+    munmap(cq_ring, cq_ring_size);
+  }
+  munmap(sq_ring, sq_ring_size);
+  ::close(ring_fd);
+}
+
+bool IoRing::available() const {
+  return ring_fd >= 0;
+}
+
+void IoRing::run(int fd, IoRequest *requests, std::size_t count) {
+  if (!available()) {
+    for (std::size_t i = 0; i < count; i++) {
+      auto &request = requests[i];
+      auto result = request.write ? pwrite(fd, request.buffer, request.length, request.offset)
+                                  : pread(fd, request.buffer, request.length, request.offset);
+      request.result = result < 0 ? -errno : static_cast<int>(result);
+    }
+    return;
+  }
+
+  std::size_t queued = 0;
+  std::size_t completed = 0;
+  unsigned unsubmitted = 0; // queued but not yet taken by the kernel
+  while (completed < count) {
+    auto tail = *sq_tail;
+    while (queued < count && queued - completed < entries) {
+      auto &request = requests[queued];
+      auto index = tail & *sq_mask;
+      auto &sqe = sqes[index];
+      memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+      sqe.fd = fd;
+      sqe.addr = reinterpret_cast<uint64_t>(request.buffer);
+      sqe.len = static_cast<uint32_t>(request.length);
+      sqe.off = request.offset;
+      sqe.user_data = queued;
+      sq_array[index] = index;
+      tail++;
+      queued++;
+      unsubmitted++;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+    auto submitted = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (submitted < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        continue;
+      }
+      std::cerr << "io_uring_enter failed: " << strerror(errno) << '\n';
+      exit(EXIT_FAILURE);
+    }
+    unsubmitted -= static_cast<unsigned>(submitted);
+
+    auto head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      auto &cqe = cqes[head & *cq_mask];
+      requests[cqe.user_data].result = cqe.res;
+      head++;
+      completed++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+}
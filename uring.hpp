@@ -0,0 +1,56 @@
+#ifndef CPPQLITE_URING_HPP
+#define CPPQLITE_URING_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+const unsigned IO_RING_DEFAULT_ENTRIES = 64;
+
+// A read or write of length bytes at offset. result is the byte count
+// transferred, or -errno.
+struct IoRequest {
+  char *buffer;
+  std::size_t length;
+  uint64_t offset;
+  bool write;
+  int result;
+};
+
+// Just enough of io_uring, driven through the raw system calls, to submit a
+// batch of requests on one file and wait for all of them. If the kernel won't
+// set up a ring, requests run one at a time with pread and pwrite instead.
+struct IoRing {
+  int ring_fd;
+  unsigned entries;
+  void *sq_ring;
+  std::size_t sq_ring_size;
+  void *cq_ring; // same mapping as sq_ring when the kernel supports it
+  std::size_t cq_ring_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  io_uring_sqe *sqes;
+  std::size_t sqes_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  io_uring_cqe *cqes;
+
+  explicit IoRing(unsigned entries = IO_RING_DEFAULT_ENTRIES);
+  ~IoRing();
+
+  IoRing(const IoRing &) = delete;
+  IoRing &operator=(const IoRing &) = delete;
+
+  bool available() const;
+
+  // Runs every request against fd, keeping up to entries of them in flight,
+  // and returns once all have completed.
+  void run(int fd, IoRequest *requests, std::size_t count);
+};
+
+#endif //CPPQLITE_URING_HPP
@@ -0,0 +1,212 @@
+#include "wal.hpp"
+#include "db.hpp"
+
+#include <cstring>
+#include <random>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// FNV-1a, enough to tell a torn or stale frame from a complete one.
+uint32_t wal_checksum(const char *data, std::size_t size, uint32_t hash = 2166136261U) {
+  for (std::size_t i = 0; i < size; i++) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+uint32_t frame_checksum(const char *frame) {
+  auto hash = wal_checksum(frame, WAL_FRAME_CHECKSUM_OFFSET);
+  return wal_checksum(frame + WAL_FRAME_HEADER_SIZE, PAGE_SIZE, hash);
+}
+
+Wal::Wal(const std::string &filename, const WalOptions &options)
+    : filename(filename),
+      fd(-1),
+      options(options),
+      salt(),
+      frame_count(),
+      uncommitted_frames(),
+      db_pages(),
+      index(),
+      frame_buffer(WAL_FRAME_HEADER_SIZE + PAGE_SIZE),
+      stats(),
+      writes(0),
+      synced_writes(0),
+      syncing(false) {
+  fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    std::cerr << "Unable to open write-ahead log " << filename << ".\n";
+    exit(EXIT_FAILURE);
+  }
+  recover();
+}
+
+Wal::~Wal() {
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+uint64_t Wal::frame_offset(uint64_t frame) const {
+  return WAL_HEADER_SIZE + frame * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE);
+}
+
+void Wal::recover() {
+  char header[WAL_HEADER_SIZE];
+  if (pread(fd, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE
+      || *(uint32_t *) (header + WAL_MAGIC_OFFSET) != WAL_MAGIC
+      || *(uint32_t *) (header + WAL_PAGE_SIZE_OFFSET) != PAGE_SIZE) {
+    restart();
+    return;
+  }
+  salt = *(uint32_t *) (header + WAL_SALT_OFFSET);
+
+  // Frames past the last commit belong to a statement that never finished.
+  std::unordered_map<std::size_t, uint64_t> pending;
+  uint64_t committed_frames = 0;
+  auto frame_size = frame_buffer.size();
+  for (uint64_t frame = 0;; frame++) {
+    char *buffer = frame_buffer.data();
+    if (pread(fd, buffer, frame_size, frame_offset(frame)) != static_cast<ssize_t>(frame_size)) {
+      break;
+    }
+    if (*(uint32_t *) (buffer + WAL_FRAME_SALT_OFFSET) != salt
+        || *(uint32_t *) (buffer + WAL_FRAME_CHECKSUM_OFFSET) != frame_checksum(buffer)) {
+      break;
+    }
+    pending[*(uint32_t *) (buffer + WAL_FRAME_PAGE_NUM_OFFSET)] = frame;
+    auto commit_pages = *(uint32_t *) (buffer + WAL_FRAME_COMMIT_PAGES_OFFSET);
+    if (commit_pages != 0) {
+      for (auto &entry : pending) {
+        index[entry.first] = entry.second;
+      }
+      pending.clear();
+      db_pages = commit_pages;
+      committed_frames = frame + 1;
+    }
+  }
+  frame_count = committed_frames;
+  uncommitted_frames = 0;
+}
+
+void Wal::append(std::size_t page_num, const char *data, uint32_t commit_pages) {
+  char *buffer = frame_buffer.data();
+  *(uint32_t *) (buffer + WAL_FRAME_PAGE_NUM_OFFSET) = page_num;
+  *(uint32_t *) (buffer + WAL_FRAME_COMMIT_PAGES_OFFSET) = commit_pages;
+  *(uint32_t *) (buffer + WAL_FRAME_SALT_OFFSET) = salt;
+  memcpy(buffer + WAL_FRAME_HEADER_SIZE, data, PAGE_SIZE);
+  *(uint32_t *) (buffer + WAL_FRAME_CHECKSUM_OFFSET) = frame_checksum(buffer);
+
+  if (pwrite(fd, buffer, frame_buffer.size(), frame_offset(frame_count)) != static_cast<ssize_t>(frame_buffer.size())) {
+    std::cerr << "Unable to append to write-ahead log.\n";
+    exit(EXIT_FAILURE);
+  }
+  index[page_num] = frame_count;
+  frame_count++;
+  writes++;
+  stats.frames++;
+  if (commit_pages != 0) {
+    db_pages = commit_pages;
+    uncommitted_frames = 0;
+    stats.commits++;
+  } else {
+    uncommitted_frames++;
+  }
+}
+
+void Wal::mark_commit(uint32_t commit_pages) {
+  char *buffer = frame_buffer.data();
+  *(uint32_t *) (buffer + WAL_FRAME_COMMIT_PAGES_OFFSET) = commit_pages;
+  *(uint32_t *) (buffer + WAL_FRAME_CHECKSUM_OFFSET) = frame_checksum(buffer);
+  // Frames aren't sector aligned, so a crash can tear the header across two
+  // sectors. The checksum then doesn't match and recovery stops before this
+  // frame, dropping a transaction that was never acknowledged.
+  if (pwrite(fd, buffer, WAL_FRAME_HEADER_SIZE, frame_offset(frame_count - 1)) != WAL_FRAME_HEADER_SIZE) {
+    std::cerr << "Unable to append to write-ahead log.\n";
+    exit(EXIT_FAILURE);
+  }
+  writes++;
+  db_pages = commit_pages;
+  uncommitted_frames = 0;
+  stats.commits++;
+}
+
+void Wal::wait_durable(uint64_t target) {
+  std::unique_lock<std::mutex> lock{sync_mutex};
+  while (synced_writes < target) {
+    if (syncing) {
+      synced.wait(lock);
+      continue;
+    }
+    syncing = true;
+    lock.unlock();
+    if (options.commit_window.count() > 0) {
+      std::this_thread::sleep_for(options.commit_window);
+    }
+    // Everything written before this load is covered by the fsync after it.
+    auto covered = writes.load();
+    if (fdatasync(fd) != 0) {
+      std::cerr << "Unable to sync write-ahead log.\n";
+      exit(EXIT_FAILURE);
+    }
+    lock.lock();
+    synced_writes = std::max(synced_writes, covered);
+    syncing = false;
+    stats.syncs++;
+    synced.notify_all();
+  }
+}
+
+bool Wal::read_page(std::size_t page_num, char *data) {
+  auto it = index.find(page_num);
+  if (it == index.end()) {
+    return false;
+  }
+  read_frame(it->second, data);
+  return true;
+}
+
+void Wal::read_frame(uint64_t frame, char *data) {
+  if (pread(fd, data, PAGE_SIZE, frame_offset(frame) + WAL_FRAME_HEADER_SIZE) != PAGE_SIZE) {
+    std::cerr << "Unable to read frame " << frame << " from write-ahead log.\n";
+    exit(EXIT_FAILURE);
+  }
+}
+
+void Wal::sync() {
+  std::lock_guard<std::mutex> lock{sync_mutex};
+  auto covered = writes.load();
+  if (fdatasync(fd) != 0) {
+    std::cerr << "Unable to sync write-ahead log.\n";
+    exit(EXIT_FAILURE);
+  }
+  synced_writes = std::max(synced_writes, covered);
+  stats.syncs++;
+  synced.notify_all();
+}
+
+void Wal::restart() {
+  // A fresh salt keeps frames of the previous generation from looking valid
+  // if the truncate below doesn't make it to disk.
+  salt = std::random_device{}() | 1U;
+  char header[WAL_HEADER_SIZE];
+  *(uint32_t *) (header + WAL_MAGIC_OFFSET) = WAL_MAGIC;
+  *(uint32_t *) (header + WAL_PAGE_SIZE_OFFSET) = PAGE_SIZE;
+  *(uint32_t *) (header + WAL_SALT_OFFSET) = salt;
+  if (ftruncate(fd, 0) != 0 || pwrite(fd, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE) {
+    std::cerr << "Unable to reset write-ahead log.\n";
+    exit(EXIT_FAILURE);
+  }
+  if (fdatasync(fd) != 0) {
+    std::cerr << "Unable to sync write-ahead log.\n";
+    exit(EXIT_FAILURE);
+  }
+  frame_count = 0;
+  uncommitted_frames = 0;
+  db_pages = 0;
+  index.clear();
+}
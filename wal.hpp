@@ -0,0 +1,98 @@
+#ifndef CPPQLITE_WAL_HPP
+#define CPPQLITE_WAL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// WAL file layout: a header followed by frames, each frame being a frame
+// header and a full page image. A frame with a non-zero commit_pages ends a
+// transaction and records the database size in pages at that point.
+const uint32_t WAL_MAGIC = 0x4c415743; // "CWAL"
+const uint32_t WAL_MAGIC_OFFSET = 0;
+const uint32_t WAL_PAGE_SIZE_OFFSET = WAL_MAGIC_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_SALT_OFFSET = WAL_PAGE_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_HEADER_SIZE = WAL_SALT_OFFSET + sizeof(uint32_t);
+
+const uint32_t WAL_FRAME_PAGE_NUM_OFFSET = 0;
+const uint32_t WAL_FRAME_COMMIT_PAGES_OFFSET = WAL_FRAME_PAGE_NUM_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_FRAME_SALT_OFFSET = WAL_FRAME_COMMIT_PAGES_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_FRAME_CHECKSUM_OFFSET = WAL_FRAME_SALT_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_FRAME_HEADER_SIZE = WAL_FRAME_CHECKSUM_OFFSET + sizeof(uint32_t);
+
+const std::size_t DEFAULT_CHECKPOINT_FRAMES = 1000;
+
+struct WalOptions {
+  bool enabled = false;
+  // How long the first commit waiting for an fsync holds it back so later
+  // ones can share it. Commits arriving while an fsync is running always
+  // share the next one, so this only widens the group.
+  std::chrono::microseconds commit_window{0};
+  // Copy the log back into the database once it holds this many frames.
+  std::size_t checkpoint_frames = DEFAULT_CHECKPOINT_FRAMES;
+};
+
+struct WalStats {
+  uint64_t frames;
+  uint64_t commits;
+  uint64_t syncs;
+  uint64_t checkpoints;
+};
+
+struct Wal {
+  std::string filename;
+  int fd;
+  WalOptions options;
+  uint32_t salt;
+  uint64_t frame_count;
+  uint64_t uncommitted_frames;
+  uint32_t db_pages; // database size recorded by the last commit frame
+  std::unordered_map<std::size_t, uint64_t> index; // page_num -> latest frame holding it
+  std::vector<char> frame_buffer; // the last frame appended
+  WalStats stats; // syncs is guarded by sync_mutex, the rest by the pager's mutex
+  // Writes to the log since it was opened, and how many of them an fsync has
+  // covered. Committers wait on synced for the writes up to their commit.
+  std::atomic<uint64_t> writes;
+  std::mutex sync_mutex;
+  std::condition_variable synced;
+  uint64_t synced_writes;
+  bool syncing;
+
+  Wal(const std::string &filename, const WalOptions &options);
+  ~Wal();
+
+  Wal(const Wal &) = delete;
+  Wal &operator=(const Wal &) = delete;
+
+  // Rebuilds the index from every frame up to the last intact commit frame.
+  void recover();
+
+  void append(std::size_t page_num, const char *data, uint32_t commit_pages);
+
+  // Turns the last frame appended into the commit frame of a transaction
+  // whose pages are all in the log already, without appending another.
+  void mark_commit(uint32_t commit_pages);
+
+  // Returns once the first target writes are on disk. The first caller to
+  // find no fsync running syncs for everyone waiting, the others wait for it.
+  void wait_durable(uint64_t target);
+
+  bool read_page(std::size_t page_num, char *data);
+
+  void read_frame(uint64_t frame, char *data);
+
+  // Syncs everything written so far right away.
+  void sync();
+
+  // Empties the log and starts a new generation of frames.
+  void restart();
+
+  uint64_t frame_offset(uint64_t frame) const;
+};
+
+#endif //CPPQLITE_WAL_HPP